@@ -43,6 +43,15 @@
 static inline long
 compare_and_swap(volatile long *ptr, long old, long new);
 
+static inline void *
+compare_and_swap_ptr(void * volatile *ptr, void *old, void *new);
+
+static inline long
+fetch_and_add(volatile long *ptr, long val);
+
+static inline void
+memory_barrier(void);
+
 
 /*
  *  We prefer the GNU builtin atomic ops.  If not, then provide
@@ -193,4 +202,51 @@ use a later version of gcc that supports the GNU atomic ops
 
 #endif
 
+/*
+ *  Ops built on top of compare_and_swap().  Pointers and longs are
+ *  the same size on all of our platforms.
+ */
+static inline void *
+compare_and_swap_ptr(void * volatile *ptr, void *old, void *new)
+{
+    return (void *) compare_and_swap((volatile long *) ptr,
+				     (long) old, (long) new);
+}
+
+static inline long
+fetch_and_add(volatile long *ptr, long val)
+{
+#if defined(USE_GNU_ATOMIC_OPS)
+    return __sync_fetch_and_add(ptr, val);
+#else
+    long old;
+
+    do {
+	old = *ptr;
+    } while (compare_and_swap(ptr, old, old + val) != old);
+
+    return old;
+#endif
+}
+
+/*
+ *  Full memory barrier: loads and stores before the barrier complete
+ *  before any after it.
+ */
+static inline void
+memory_barrier(void)
+{
+#if defined(USE_GNU_ATOMIC_OPS)
+    __sync_synchronize();
+#elif defined(__x86_64__)
+    __asm__ __volatile__ ("mfence" ::: "memory");
+#elif defined(__i386__)
+    __asm__ __volatile__ ("lock; addl $0,0(%%esp)" ::: "memory");
+#elif defined(__powerpc__)
+    __asm__ __volatile__ ("sync" ::: "memory");
+#elif defined(__ia64__)
+    __asm__ __volatile__ ("mf" ::: "memory");
+#endif
+}
+
 #endif  /* _MONITOR_ATOMIC_OPS_ */
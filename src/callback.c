@@ -47,7 +47,7 @@ monitor_init_process(int *argc, char **argv, void *data)
 
     MONITOR_DEBUG("(default callback) parent = %d, argc = %d, argv = %p\n",
 		  (int)getppid(), (argc != NULL) ? *argc : 0, argv);
-    if (monitor_debug) {
+    if (monitor_debug || monitor_trace) {
 	if (argc != NULL && argv != NULL && *argc > 0) {
 	    for (i = 0; i < *argc; i++) {
 		MONITOR_DEBUG("argv[%d] = %s\n", i, argv[i]);
@@ -159,7 +159,7 @@ monitor_init_mpi(int *argc, char ***argv)
     int i;
 
     MONITOR_DEBUG("(default callback) argc = %p, argv = %p\n", argc, argv);
-    if (monitor_debug && argc != NULL && argv != NULL && *argc > 0) {
+    if ((monitor_debug || monitor_trace) && argc != NULL && argv != NULL && *argc > 0) {
 	for (i = 0; i < *argc; i++) {
 	    MONITOR_DEBUG("argv[%d] = %s\n", i, (*argv)[i]);
 	}
@@ -185,3 +185,46 @@ monitor_wrap_main(int argc, char **argv, char **envp)
     MONITOR_DEBUG1("(default callback)\n");
     return 0;
 }
+
+/*
+ *  Local aliases for the default thread callbacks.  The callback
+ *  names resolve to the client's functions if it overrides them, but
+ *  the aliases always resolve to the defaults in this file.
+ */
+static void *monitor_dflt_thread_pre_create(void)
+    __attribute__ ((alias ("monitor_thread_pre_create")));
+static void monitor_dflt_thread_post_create(void *)
+    __attribute__ ((alias ("monitor_thread_post_create")));
+static void monitor_dflt_init_thread_support(void)
+    __attribute__ ((alias ("monitor_init_thread_support")));
+static void *monitor_dflt_init_thread(int, void *)
+    __attribute__ ((alias ("monitor_init_thread")));
+static void monitor_dflt_fini_thread(void *)
+    __attribute__ ((alias ("monitor_fini_thread")));
+static size_t monitor_dflt_reset_stacksize(size_t)
+    __attribute__ ((alias ("monitor_reset_stacksize")));
+
+/*
+ *  Returns: bit mask of the thread callbacks that the client has
+ *  overridden (MONITOR_CB_* in common.h).
+ */
+int
+monitor_client_thread_callbacks(void)
+{
+    int mask = 0;
+
+    if (monitor_thread_pre_create != monitor_dflt_thread_pre_create)
+	mask |= MONITOR_CB_PRE_CREATE;
+    if (monitor_thread_post_create != monitor_dflt_thread_post_create)
+	mask |= MONITOR_CB_POST_CREATE;
+    if (monitor_init_thread_support != monitor_dflt_init_thread_support)
+	mask |= MONITOR_CB_THREAD_SUPPORT;
+    if (monitor_init_thread != monitor_dflt_init_thread)
+	mask |= MONITOR_CB_INIT_THREAD;
+    if (monitor_fini_thread != monitor_dflt_fini_thread)
+	mask |= MONITOR_CB_FINI_THREAD;
+    if (monitor_reset_stacksize != monitor_dflt_reset_stacksize)
+	mask |= MONITOR_CB_STACKSIZE;
+
+    return (mask);
+}
@@ -38,10 +38,375 @@
 
 #include "common.h"
 #include "monitor.h"
+#include "atomic.h"
 
+#include <sys/mman.h>
 #include <dlfcn.h>
+#include <elf.h>
 #include <link.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ *  Batch symbol table.
+ *
+ *  Every real_* function that monitor overrides, resolved together in
+ *  one walk of the link map on the first call to monitor_dlsym(),
+ *  using each object's GNU hash table directly instead of dlopen() and
+ *  dlsym() per object and per symbol.  The addresses live on their own
+ *  pages that are made read-only once the walk is done.
+ *
+ *  The walk follows the RTLD_NEXT rules.  The first object after
+ *  libmonitor that defines a name owns it.  If that definition is one
+ *  we don't handle (IFUNC, unique, non-default version, etc), the name
+ *  is left to dlsym() rather than taken from a later object.  Only the
+ *  objects loaded at startup are searched: the program, the preloads
+ *  and their DT_NEEDED libraries, which glibc loads ahead of anything
+ *  from dlopen().  The walk stops at the first object that isn't one
+ *  of these, because we can't tell whether it was opened RTLD_GLOBAL.
+ *
+ *  Names that are missing here, or not resolved in the walk, fall back
+ *  to the dlsym() path below.  Set MONITOR_NO_DLSYM_TABLE to skip the
+ *  table entirely.
+ */
+static const char *const dlsym_names[] = {
+    // main.c, fork.c
+    "__libc_start_main", "exit", "_exit", "fork", "execv", "execvp",
+    "execve", "system", "malloc", "dlopen", "dlclose",
+    "posix_spawn", "posix_spawnp", "popen", "pclose",
+    // signal.c
+    "sigaction", "sigprocmask", "sigwaitinfo", "sigtimedwait", "signalfd",
+    // pthread.c
+    "pthread_create", "pthread_exit", "pthread_sigmask", "pthread_kill",
+    "pthread_self", "pthread_equal", "pthread_setcancelstate",
+    "pthread_key_create", "pthread_key_delete", "pthread_getspecific",
+    "pthread_setspecific", "pthread_attr_init", "pthread_attr_destroy",
+    "pthread_attr_getstacksize", "pthread_attr_setstacksize",
+    "pthread_cleanup_push", "pthread_cleanup_pop",
+    // pmpi.c
+    "MPI_Init", "MPI_Init_thread", "MPI_Finalize", "MPI_Comm_rank",
+    "MPI_Comm_size", "PMPI_Init", "PMPI_Init_thread", "PMPI_Finalize",
+    "PMPI_Comm_rank", "PMPI_Comm_size",
+    "mpi_init", "mpi_init_", "mpi_init__",
+    "mpi_init_thread", "mpi_init_thread_", "mpi_init_thread__",
+    "mpi_finalize", "mpi_finalize_", "mpi_finalize__",
+    "mpi_comm_rank", "mpi_comm_rank_", "mpi_comm_rank__",
+    "mpi_comm_size", "mpi_comm_size_", "mpi_comm_size__",
+};
+
+#define DLSYM_NUM_NAMES  (sizeof(dlsym_names) / sizeof(dlsym_names[0]))
+
+enum {
+    DLSYM_TABLE_NONE = 0,
+    DLSYM_TABLE_BUILDING,
+    DLSYM_TABLE_READY,
+    DLSYM_TABLE_FAILED,
+};
+
+struct dlsym_table {
+    uint32_t hash[DLSYM_NUM_NAMES];
+    void *addr[DLSYM_NUM_NAMES];
+    int num_found;
+};
+
+#define DLSYM_MAX_NEEDED  200
+
+struct batch_data {
+    struct dlsym_table *table;
+    bool skip;
+    void *skip_until_base;
+    int num_done;
+    bool done[DLSYM_NUM_NAMES];
+    int num_needed;
+    const char *needed[DLSYM_MAX_NEEDED];
+    const char *preload;
+};
+
+static struct dlsym_table *dlsym_table = NULL;
+static volatile long dlsym_table_state = DLSYM_TABLE_NONE;
+
+static uint32_t gnu_hash(const char *name) {
+    uint32_t h = 5381;
+
+    for (; *name != 0; name++) {
+        h = (h << 5) + h + (unsigned char) *name;
+    }
+    return h;
+}
+
+// Some arches leave the dynamic section unrelocated.
+static const void *dyn_ptr(struct dl_phdr_info *info, ElfW(Addr) ptr) {
+    if (ptr < info->dlpi_addr) {
+        ptr += info->dlpi_addr;
+    }
+    return (const void *) ptr;
+}
+
+// Look up one name in an object's GNU hash table.  Returns true if
+// the object defines the name at all.  Then *addr is the address of
+// the default version of a global function or variable, the same one
+// that dlsym() would return, or NULL if there is no such definition
+// (only IFUNC, non-default versions, etc).
+static bool gnu_lookup(struct dl_phdr_info *info, const uint32_t *gnu_ht,
+                       const ElfW(Sym) *symtab, const char *strtab,
+                       const ElfW(Half) *versym, const char *name, uint32_t h,
+                       void **addr) {
+    const size_t bits = 8 * sizeof(ElfW(Addr));
+    uint32_t nbuckets = gnu_ht[0];
+    uint32_t symoffset = gnu_ht[1];
+    uint32_t bloom_size = gnu_ht[2];
+    uint32_t bloom_shift = gnu_ht[3];
+    const ElfW(Addr) *bloom = (const ElfW(Addr) *) &gnu_ht[4];
+    const uint32_t *buckets = (const uint32_t *) &bloom[bloom_size];
+    const uint32_t *chain = &buckets[nbuckets];
+
+    *addr = NULL;
+    if (nbuckets == 0 || bloom_size == 0) {
+        return false;
+    }
+    ElfW(Addr) word = bloom[(h / bits) % bloom_size];
+    ElfW(Addr) mask = ((ElfW(Addr)) 1 << (h % bits))
+        | ((ElfW(Addr)) 1 << ((h >> bloom_shift) % bits));
+    if ((word & mask) != mask) {
+        return false;
+    }
+
+    bool defined = false;
+    uint32_t k = buckets[h % nbuckets];
+    if (k < symoffset) {
+        return false;
+    }
+    for (;; k++) {
+        uint32_t h2 = chain[k - symoffset];
+        const ElfW(Sym) *sym = &symtab[k];
+
+        // st_info is the same for 32 and 64-bit
+        int type = ELF32_ST_TYPE(sym->st_info);
+        int bind = ELF32_ST_BIND(sym->st_info);
+
+        // An undefined reference or a local symbol doesn't count.  Any
+        // other definition means this object owns the name.
+        if ((h | 1) == (h2 | 1) && sym->st_shndx != SHN_UNDEF && bind != STB_LOCAL
+            && strcmp(name, strtab + sym->st_name) == 0) {
+            defined = true;
+            if (sym->st_value != 0
+                && (type == STT_FUNC || type == STT_OBJECT || type == STT_NOTYPE)
+                && (bind == STB_GLOBAL || bind == STB_WEAK)
+                && (versym == NULL || ((versym[k] & 0x8000) == 0 && versym[k] != 0))) {
+                *addr = (void *) (info->dlpi_addr + sym->st_value);
+                return true;
+            }
+        }
+        if (h2 & 1) {
+            break;
+        }
+    }
+    return defined;
+}
+
+static const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+
+    return slash != NULL ? slash + 1 : path;
+}
+
+// Does name (a DT_NEEDED or LD_PRELOAD entry) refer to this object?
+// A name with a slash is a path, otherwise it matches the soname or
+// the file name.
+static bool name_match(const char *name, size_t len, const char *path,
+                       const char *soname) {
+    if (memchr(name, '/', len) != NULL) {
+        return strlen(path) == len && strncmp(name, path, len) == 0;
+    }
+    if (soname != NULL && strlen(soname) == len && strncmp(name, soname, len) == 0) {
+        return true;
+    }
+    path = base_name(path);
+    return strlen(path) == len && strncmp(name, path, len) == 0;
+}
+
+// Was this object loaded at startup, that is, is it a preload or
+// needed by an earlier object?  Those are all in the global scope.
+static bool startup_object(struct batch_data *data, struct dl_phdr_info *info,
+                           const char *soname) {
+    const char *p, *end;
+    int k;
+
+    for (k = 0; k < data->num_needed; k++) {
+        if (name_match(data->needed[k], strlen(data->needed[k]),
+                       info->dlpi_name, soname)) {
+            return true;
+        }
+    }
+    // LD_PRELOAD entries are separated by spaces or colons.
+    for (p = data->preload; p != NULL && *p != 0; p = end) {
+        p += strspn(p, " :");
+        end = p + strcspn(p, " :");
+        if (end > p && name_match(p, end - p, info->dlpi_name, soname)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int batch_callback(struct dl_phdr_info *info, size_t sz, void *data_v) {
+    struct batch_data *data = data_v;
+    struct dlsym_table *table = data->table;
+    const ElfW(Dyn) *dyn = NULL, *dp;
+    const uint32_t *gnu_ht = NULL;
+    const ElfW(Sym) *symtab = NULL;
+    const char *strtab = NULL;
+    const char *soname = NULL;
+    const ElfW(Half) *versym = NULL;
+    void *addr;
+    int k;
+
+    for (k = 0; k < info->dlpi_phnum; k++) {
+        if (info->dlpi_phdr[k].p_type == PT_DYNAMIC) {
+            dyn = (const ElfW(Dyn) *) (info->dlpi_addr + info->dlpi_phdr[k].p_vaddr);
+            break;
+        }
+    }
+    if (dyn != NULL) {
+        for (dp = dyn; dp->d_tag != DT_NULL; dp++) {
+            switch (dp->d_tag) {
+            case DT_GNU_HASH:
+                gnu_ht = dyn_ptr(info, dp->d_un.d_ptr);
+                break;
+            case DT_SYMTAB:
+                symtab = dyn_ptr(info, dp->d_un.d_ptr);
+                break;
+            case DT_STRTAB:
+                strtab = dyn_ptr(info, dp->d_un.d_ptr);
+                break;
+            case DT_VERSYM:
+                versym = dyn_ptr(info, dp->d_un.d_ptr);
+                break;
+            }
+        }
+    }
+
+    // Objects up to libmonitor are all from startup (anything from
+    // dlopen() comes later).  After that, stop at the first object
+    // that we can't show was loaded at startup.
+    if (! data->skip) {
+        if (strtab != NULL) {
+            for (dp = dyn; dp->d_tag != DT_NULL; dp++) {
+                if (dp->d_tag == DT_SONAME) {
+                    soname = strtab + dp->d_un.d_val;
+                }
+            }
+        }
+        if (! startup_object(data, info, soname)) {
+            MONITOR_DEBUG("stop at object not from startup: %s\n", info->dlpi_name);
+            return 1;
+        }
+    }
+
+    // Remember what this object needs, for the objects after it.
+    if (strtab != NULL) {
+        for (dp = dyn; dp->d_tag != DT_NULL; dp++) {
+            if (dp->d_tag == DT_NEEDED && data->num_needed < DLSYM_MAX_NEEDED) {
+                data->needed[data->num_needed] = strtab + dp->d_un.d_val;
+                data->num_needed++;
+            }
+        }
+    }
+
+    // Same objects as the fallback walk: everything after libmonitor.
+    if (data->skip) {
+        if (data->skip_until_base == (void*)info->dlpi_addr) {
+            data->skip = false;
+        }
+        return 0;
+    }
+
+    if (gnu_ht == NULL || symtab == NULL || strtab == NULL) {
+        MONITOR_DEBUG("no gnu hash table in object: %s\n", info->dlpi_name);
+        return 0;
+    }
+
+    for (k = 0; k < (int) DLSYM_NUM_NAMES; k++) {
+        if (! data->done[k]
+            && gnu_lookup(info, gnu_ht, symtab, strtab, versym,
+                          dlsym_names[k], table->hash[k], &addr)) {
+            data->done[k] = true;
+            data->num_done++;
+            if (addr != NULL) {
+                table->addr[k] = addr;
+                table->num_found++;
+            } else {
+                MONITOR_DEBUG("leave %s() to dlsym, defined in: %s\n",
+                              dlsym_names[k], info->dlpi_name);
+            }
+        }
+    }
+    return data->num_done == (int) DLSYM_NUM_NAMES ? 1 : 0;
+}
+
+// Build the table once, in whichever thread gets here first.  Other
+// threads (or a recursive call) use the dlsym() path until it's ready.
+static void dlsym_table_init(void) {
+    struct batch_data data;
+    struct dlsym_table *table;
+    Dl_info dli;
+    size_t size, pagesize;
+    int k;
+
+    if (compare_and_swap(&dlsym_table_state, DLSYM_TABLE_NONE,
+                         DLSYM_TABLE_BUILDING) != DLSYM_TABLE_NONE) {
+        return;
+    }
+    if (getenv("MONITOR_NO_DLSYM_TABLE") != NULL
+        || dladdr(&monitor_dlsym, &dli) == 0) {
+        dlsym_table_state = DLSYM_TABLE_FAILED;
+        return;
+    }
+
+    pagesize = sysconf(_SC_PAGESIZE);
+    size = (sizeof(struct dlsym_table) + pagesize - 1) & ~(pagesize - 1);
+    table = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        dlsym_table_state = DLSYM_TABLE_FAILED;
+        return;
+    }
+    for (k = 0; k < (int) DLSYM_NUM_NAMES; k++) {
+        table->hash[k] = gnu_hash(dlsym_names[k]);
+    }
+
+    memset(&data, 0, sizeof(data));
+    data.table = table;
+    data.skip = true;
+    data.skip_until_base = dli.dli_fbase;
+    data.preload = getenv("LD_PRELOAD");
+    dl_iterate_phdr(batch_callback, &data);
+
+    if (mprotect(table, size, PROT_READ) != 0) {
+        MONITOR_DEBUG1("mprotect failed on symbol table\n");
+    }
+    MONITOR_DEBUG("found %d of %d symbols\n", table->num_found,
+                  (int) DLSYM_NUM_NAMES);
+
+    dlsym_table = table;
+    memory_barrier();
+    dlsym_table_state = DLSYM_TABLE_READY;
+}
+
+static void *dlsym_table_lookup(const char *symbol) {
+    uint32_t h = gnu_hash(symbol);
+    int k;
+
+    for (k = 0; k < (int) DLSYM_NUM_NAMES; k++) {
+        if (dlsym_table->hash[k] == h && strcmp(dlsym_names[k], symbol) == 0) {
+            return dlsym_table->addr[k];
+        }
+    }
+    return NULL;
+}
 
 struct callback_data {
     const char* symbol;
@@ -77,6 +442,18 @@ static int phdr_callback(struct dl_phdr_info *info, size_t sz, void *data_v) {
 
 void *monitor_dlsym(const char *symbol) {
     const char *err_str;
+
+    if (dlsym_table_state == DLSYM_TABLE_NONE) {
+        dlsym_table_init();
+    }
+    if (dlsym_table_state == DLSYM_TABLE_READY) {
+        void *addr = dlsym_table_lookup(symbol);
+        if (addr != NULL) {
+            MONITOR_DEBUG("%s() = %p\n", symbol, addr);
+            return addr;
+        }
+    }
+
     dlerror();
     void *result = dlsym(RTLD_NEXT, symbol);
     err_str = dlerror();
@@ -75,6 +75,7 @@
 
 #define TRUE   1
 #define FALSE  0
+
 #define SUCCESS   0
 #define FAILURE  -1
 
@@ -85,9 +86,14 @@
  *  Format (fmt) must be a string constant in these macros.  Some
  *  compilers don't accept the ##__VA_ARGS__ syntax for the case of
  *  empty args, so split the macros into two.
+ *
+ *  In trace mode (MONITOR_TRACE), debug messages go to the binary
+ *  trace rings instead of stderr, see utils.c.
  */
 #define MONITOR_DEBUG_ARGS(fmt, ...)  do {			\
-    if (monitor_debug) {					\
+    if (monitor_trace) {					\
+	monitor_trace_printf(fmt, __VA_ARGS__ );		\
+    } else if (monitor_debug) {					\
 	fprintf(stderr, "monitor debug [%d,%d] %s: " fmt ,	\
 		getpid(), monitor_get_thread_num(),		\
 		__VA_ARGS__ );					\
@@ -163,18 +169,51 @@ void *monitor_dlsym(const char *symbol);
     if ( monitor_has_run_##var ) { return; }		\
     monitor_has_run_##var = 1
 
+/*
+ *  Thread callbacks that the client overrides, from
+ *  monitor_client_thread_callbacks().
+ */
+#define MONITOR_CB_PRE_CREATE      0x01
+#define MONITOR_CB_POST_CREATE     0x02
+#define MONITOR_CB_THREAD_SUPPORT  0x04
+#define MONITOR_CB_INIT_THREAD     0x08
+#define MONITOR_CB_FINI_THREAD     0x10
+#define MONITOR_CB_STACKSIZE       0x20
+#define MONITOR_CB_ALL_THREAD      0x3f
+
 extern int monitor_debug;
+extern int monitor_trace;
 
 void monitor_early_init(void);
+
+/*  is_fork for the deferred init-process of a lazy fork child,
+ *  which was already reset when it was created.
+ */
+#define MONITOR_FORK_LAZY  2
+
 void monitor_fork_init(void);
+int  monitor_in_vfork_child(void);
+void monitor_fork_regions_snapshot(void);
+void monitor_fork_regions_child(void);
+void monitor_fork_lazy_init(void);
+void monitor_fork_lazy_due(void);
+int  monitor_fork_lazy_skip(void);
 void monitor_signal_init(void);
 void monitor_begin_process_fcn(void *, int);
+void monitor_fork_child_reset(void *);
 void monitor_end_process_fcn(int);
 void monitor_end_library_fcn(void);
 void monitor_thread_shootdown(void);
 int  monitor_shootdown_signal(void);
+int  monitor_fork_timer_signal(void);
 int  monitor_sigwait_handler(int, siginfo_t *, void *);
 void monitor_remove_client_signals(sigset_t *, int);
+int  monitor_sigmask_filter_used(void);
+void monitor_sigmask_shadow_reset(void);
+int  monitor_sigmask_shadow_enter(void);
+void monitor_sigmask_shadow_leave(int);
+size_t monitor_signal_altstack_size(void);
+void monitor_main_altstack_init(void);
 int  monitor_sigset_string(char *, int, const sigset_t *);
 int  monitor_signal_list_string(char *, int, int *);
 void monitor_get_main_args(int *, char ***, char ***);
@@ -183,5 +222,22 @@ int  monitor_in_main_start_func_narrow(void *);
 void monitor_set_mpi_size_rank(int, int);
 int  monitor_mpi_init_count(int);
 int  monitor_mpi_fini_count(int);
+int  monitor_client_thread_callbacks(void);
+int  monitor_client_signals_used(void);
+int  monitor_client_signal_handled(int);
+void monitor_broadcast_relay(int, siginfo_t *);
+void monitor_thread_lazy_init(void);
+void monitor_thread_lazy_due(void);
+void monitor_sample_thread_init(void);
+void monitor_trace_init(void);
+void monitor_trace_printf(const char *, const char *, ...);
+void monitor_trace_reset(void);
+void monitor_signal_stats_swallow(int);
+void monitor_signal_stats_retire(void *);
+void monitor_signal_stats_reset(void);
+void monitor_signal_stats_report(void);
+void monitor_phase_begin(int);
+void monitor_phase_end(int);
+void monitor_phase_client(int, long long);
 
 #endif  /* ! _MONITOR_COMMON_H_ */
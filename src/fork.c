@@ -36,8 +36,9 @@
  *  Override functions:
  *
  *    fork, vfork
+ *    posix_spawn, posix_spawnp
  *    execl, execlp, execle, execv, execvp, execve
- *    system
+ *    system, popen, pclose
  *
  *  Support functions:
  *
@@ -45,25 +46,35 @@
  *    monitor_real_system
  */
 
+/*  execvpe() is only visible with _GNU_SOURCE.  */
+#define _GNU_SOURCE
+
 #include "config.h"
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #ifdef MONITOR_DYNAMIC
 #include <dlfcn.h>
 #endif
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "atomic.h"
 #include "monitor.h"
+#include "spinlock.h"
 
 extern char **environ;
 
@@ -88,6 +99,12 @@ typedef int sigaction_fcn_t(int, const struct sigaction *,
 typedef int sigprocmask_fcn_t(int, const sigset_t *, sigset_t *);
 typedef int system_fcn_t(const char *);
 typedef void *malloc_fcn_t(size_t);
+typedef FILE *popen_fcn_t(const char *, const char *);
+typedef int pclose_fcn_t(FILE *);
+typedef int posix_spawn_fcn_t(pid_t *, const char *,
+			      const posix_spawn_file_actions_t *,
+			      const posix_spawnattr_t *,
+			      char *const [], char *const []);
 
 #ifdef MONITOR_STATIC
 extern fork_fcn_t    __real_fork;
@@ -97,6 +114,10 @@ extern execve_fcn_t  __real_execve;
 extern sigaction_fcn_t    __real_sigaction;
 extern sigprocmask_fcn_t  __real_sigprocmask;
 extern system_fcn_t       __real_system;
+extern posix_spawn_fcn_t  __real_posix_spawn;
+extern posix_spawn_fcn_t  __real_posix_spawnp;
+extern popen_fcn_t   __real_popen;
+extern pclose_fcn_t  __real_pclose;
 #endif
 
 static fork_fcn_t    *real_fork = NULL;
@@ -107,11 +128,233 @@ static sigaction_fcn_t    *real_sigaction = NULL;
 static sigprocmask_fcn_t  *real_sigprocmask = NULL;
 static system_fcn_t  *real_system = NULL;
 static malloc_fcn_t  *real_malloc = NULL;
+static posix_spawn_fcn_t  *real_posix_spawn = NULL;
+static posix_spawn_fcn_t  *real_posix_spawnp = NULL;
+static popen_fcn_t   *real_popen = NULL;
+static pclose_fcn_t  *real_pclose = NULL;
 
 static char *newenv_array[MONITOR_INIT_ENVIRON_SIZE];
 
 static int override_system = 1;
 
+/*
+ *  Threads currently inside vfork() and the parent's pid.  The vfork
+ *  child shares our memory until it execs or exits, so it must not
+ *  run any of the exit callbacks.
+ */
+#if defined(__x86_64__) && defined(SYS_vfork)
+#define MONITOR_USE_REAL_VFORK  1
+#endif
+
+static volatile long monitor_vfork_count = 0;
+static volatile pid_t monitor_vfork_parent = 0;
+
+/*
+ *  Exec filter: MONITOR_EXEC_INCLUDE and MONITOR_EXEC_EXCLUDE are
+ *  lists of basename globs, separated by ':' or ','.  A new program
+ *  that's excluded, or not included if there is an include list, gets
+ *  the environment without LD_PRELOAD.  The patterns are parsed once
+ *  in monitor_fork_init(), and the common forms (exact, prefix* and
+ *  *suffix) are matched without fnmatch().
+ */
+#define MONITOR_EXEC_MAX_PATTERNS  32
+
+enum { MONITOR_PAT_EXACT = 1, MONITOR_PAT_PREFIX, MONITOR_PAT_SUFFIX,
+       MONITOR_PAT_GLOB };
+
+struct monitor_exec_pattern {
+    char *ep_str;
+    int   ep_len;
+    int   ep_type;
+};
+
+struct monitor_exec_filter {
+    int  ef_num;
+    struct monitor_exec_pattern ef_pat[MONITOR_EXEC_MAX_PATTERNS];
+};
+
+static struct monitor_exec_filter monitor_exec_include;
+static struct monitor_exec_filter monitor_exec_exclude;
+static int monitor_exec_filter_used = 0;
+
+/*
+ *  Lazy init-process for fork children (MONITOR_LAZY_FORK or
+ *  monitor_set_lazy_fork(), in msec).  The child defers its
+ *  init-process callback until it creates a thread, forks or takes a
+ *  client signal.  A child that exits or execs first gets no
+ *  callbacks at all, unless it outlived the lifetime (if > 0), and
+ *  then it gets init-process and the fini callbacks at exit.
+ */
+#if defined(SYS_timer_create) && defined(SYS_timer_settime) \
+    && defined(SYS_timer_delete)
+#define MONITOR_USE_FORK_TIMER  1
+#endif
+
+enum { MONITOR_LAZY_FORK_NONE = 0, MONITOR_LAZY_FORK_PENDING,
+       MONITOR_LAZY_FORK_DUE, MONITOR_LAZY_FORK_SKIPPED };
+
+static int monitor_lazy_fork_msec = -1;
+static volatile long monitor_lazy_fork_state = MONITOR_LAZY_FORK_NONE;
+static void *monitor_lazy_fork_data = NULL;
+static int monitor_lazy_fork_signal = -1;
+static int monitor_lazy_fork_timer = -1;
+static struct sigaction monitor_lazy_fork_old_action;
+
+/*
+ *  Client regions marked MADV_DONTFORK.  Just before fork, the parent
+ *  takes a snapshot under the lock, and in the child, the snapshot
+ *  becomes the excluded list for the client's init-process to see.
+ */
+#define MONITOR_FORK_MAX_REGIONS  64
+
+static struct monitor_fork_region monitor_fork_region[MONITOR_FORK_MAX_REGIONS];
+static struct monitor_fork_region monitor_fork_snapshot[MONITOR_FORK_MAX_REGIONS];
+static struct monitor_fork_region monitor_fork_excluded[MONITOR_FORK_MAX_REGIONS];
+static int monitor_num_fork_regions = 0;
+static int monitor_num_fork_snapshot = 0;
+static int monitor_num_fork_excluded = 0;
+static spinlock_t monitor_fork_region_lock = SPINLOCK_UNLOCKED;
+
+/*
+ *  Streams from our popen() that are still open, for pclose() and so
+ *  later popen() children can close them.  The lock is not held
+ *  across the spawn, so a new stream stays close-on-exec while any
+ *  popen() is spawning (mp_cloexec), else that child could get it.
+ */
+struct monitor_popen {
+    FILE  *mp_fp;
+    pid_t  mp_pid;
+    int    mp_cloexec;
+    struct monitor_popen *mp_next;
+};
+
+static struct monitor_popen *monitor_popen_list = NULL;
+static spinlock_t monitor_popen_lock = SPINLOCK_UNLOCKED;
+static int monitor_popen_spawning = 0;
+
+/*
+ *  Parse one of the exec filter env vars into filter.  The strings
+ *  are copied once and never freed.
+ */
+static void
+monitor_exec_filter_init(struct monitor_exec_filter *filter, const char *name)
+{
+    struct monitor_exec_pattern *pat;
+    char *str, *buf, *tok;
+    int len, star;
+
+    filter->ef_num = 0;
+    str = getenv(name);
+    if (str == NULL || str[0] == 0) {
+	return;
+    }
+    buf = (*real_malloc)(strlen(str) + 1);
+    if (buf == NULL) {
+	MONITOR_WARN("malloc failed, ignoring %s\n", name);
+	return;
+    }
+    strcpy(buf, str);
+
+    for (tok = buf; *tok != 0; tok += len) {
+	tok += strspn(tok, ":,");
+	len = strcspn(tok, ":,");
+	if (len == 0) {
+	    continue;
+	}
+	if (filter->ef_num >= MONITOR_EXEC_MAX_PATTERNS) {
+	    MONITOR_WARN("too many patterns in %s (max %d)\n",
+			 name, MONITOR_EXEC_MAX_PATTERNS);
+	    break;
+	}
+	pat = &filter->ef_pat[filter->ef_num];
+	if (tok[len] != 0) {
+	    tok[len++] = 0;
+	}
+	pat->ep_str = tok;
+	pat->ep_len = strlen(tok);
+	star = strcspn(tok, "*?[");
+	if (tok[star] == 0) {
+	    pat->ep_type = MONITOR_PAT_EXACT;
+	}
+	else if (star == pat->ep_len - 1 && tok[star] == '*') {
+	    pat->ep_type = MONITOR_PAT_PREFIX;
+	    pat->ep_len--;
+	}
+	else if (tok[0] == '*' && tok[1 + strcspn(tok + 1, "*?[")] == 0) {
+	    pat->ep_type = MONITOR_PAT_SUFFIX;
+	    pat->ep_str++;
+	    pat->ep_len--;
+	}
+	else {
+	    pat->ep_type = MONITOR_PAT_GLOB;
+	}
+	MONITOR_DEBUG("%s: %s (type %d)\n", name, tok, pat->ep_type);
+	filter->ef_num++;
+    }
+}
+
+/*
+ *  Returns: 1 if basename base (length len) matches any of the
+ *  patterns in filter, else 0.
+ */
+static int
+monitor_exec_filter_match(struct monitor_exec_filter *filter,
+			  const char *base, int len)
+{
+    struct monitor_exec_pattern *pat;
+    int k;
+
+    for (k = 0; k < filter->ef_num; k++) {
+	pat = &filter->ef_pat[k];
+	switch (pat->ep_type) {
+	case MONITOR_PAT_EXACT:
+	    if (len == pat->ep_len && memcmp(base, pat->ep_str, len) == 0)
+		return (1);
+	    break;
+	case MONITOR_PAT_PREFIX:
+	    if (len >= pat->ep_len && memcmp(base, pat->ep_str, pat->ep_len) == 0)
+		return (1);
+	    break;
+	case MONITOR_PAT_SUFFIX:
+	    if (len >= pat->ep_len
+		&& memcmp(base + len - pat->ep_len, pat->ep_str, pat->ep_len) == 0)
+		return (1);
+	    break;
+	default:
+	    if (fnmatch(pat->ep_str, base, 0) == 0)
+		return (1);
+	    break;
+	}
+    }
+    return (0);
+}
+
+/*
+ *  Returns: 1 if the new program at path should run without
+ *  LD_PRELOAD, according to the exec filter, else 0.
+ */
+static int
+monitor_exec_excluded(const char *path)
+{
+    const char *base;
+    int len;
+
+    if (! monitor_exec_filter_used || path == NULL) {
+	return (0);
+    }
+    base = strrchr(path, '/');
+    base = (base != NULL) ? base + 1 : path;
+    len = strlen(base);
+
+    if (monitor_exec_filter_match(&monitor_exec_exclude, base, len)
+	|| (monitor_exec_include.ef_num > 0
+	    && ! monitor_exec_filter_match(&monitor_exec_include, base, len))) {
+	MONITOR_DEBUG("excluded from monitoring: %s\n", path);
+	return (1);
+    }
+    return (0);
+}
+
 /*
  *----------------------------------------------------------------------
  *  INTERNAL HELPER FUNCTIONS
@@ -122,6 +365,8 @@ void
 monitor_fork_init(void)
 {
     static int init_done = 0;
+    char *str;
+    int msec;
 
     if (init_done)
 	return;
@@ -134,9 +379,28 @@ monitor_fork_init(void)
     MONITOR_GET_REAL_NAME_WRAP(real_sigaction, sigaction);
     MONITOR_GET_REAL_NAME_WRAP(real_sigprocmask, sigprocmask);
     MONITOR_GET_REAL_NAME_WRAP(real_system, system);
+    MONITOR_GET_REAL_NAME_WRAP(real_posix_spawn, posix_spawn);
+    MONITOR_GET_REAL_NAME_WRAP(real_popen, popen);
+    MONITOR_GET_REAL_NAME_WRAP(real_pclose, pclose);
+    MONITOR_GET_REAL_NAME(real_malloc, malloc);
 
     override_system = (getenv(NO_SYSTEM_OVERRIDE) == NULL);
 
+    monitor_exec_filter_init(&monitor_exec_include, "MONITOR_EXEC_INCLUDE");
+    monitor_exec_filter_init(&monitor_exec_exclude, "MONITOR_EXEC_EXCLUDE");
+    monitor_exec_filter_used = (monitor_exec_include.ef_num > 0
+				|| monitor_exec_exclude.ef_num > 0);
+
+    str = getenv("MONITOR_LAZY_FORK");
+    if (str != NULL) {
+	if (sscanf(str, "%d", &msec) < 1 || msec < 0) {
+	    MONITOR_WARN("bad value for MONITOR_LAZY_FORK: %s\n", str);
+	} else {
+	    monitor_lazy_fork_msec = msec;
+	    MONITOR_DEBUG("lazy fork init-process, lifetime: %d msec\n", msec);
+	}
+    }
+
     init_done = 1;
 }
 
@@ -198,6 +462,38 @@ monitor_copy_environ(char *const oldenv[])
     return newenv;
 }
 
+/*
+ *  Returns: a malloc'd copy of envp without LD_PRELOAD, or NULL if
+ *  malloc fails.  Unlike monitor_copy_environ(), this is for a parent
+ *  that keeps running (posix_spawn), possibly with other threads
+ *  spawning at the same time, so each call gets its own array and
+ *  the caller frees it.
+ */
+static char **
+monitor_alloc_environ(char *const oldenv[])
+{
+    char **newenv;
+    int k, n;
+
+    for (n = 0; oldenv[n] != NULL; n++) {
+    }
+    newenv = (*real_malloc)((n + 1) * sizeof(char *));
+    if (newenv == NULL) {
+	MONITOR_WARN1("malloc failed, new program keeps LD_PRELOAD\n");
+	return (NULL);
+    }
+    n = 0;
+    for (k = 0; oldenv[k] != NULL; k++) {
+	if (strstr(oldenv[k], "LD_PRELOAD") == NULL) {
+	    newenv[n] = oldenv[k];
+	    n++;
+	}
+    }
+    newenv[n] = NULL;
+
+    return (newenv);
+}
+
 /*
  *  Copy the execl() argument list of first_arg followed by arglist
  *  into an argv array, including the terminating NULL.  If envp is
@@ -297,11 +593,156 @@ monitor_is_executable(const char *file)
  */
 
 /*
- *  Override fork() and vfork().
+ *  Start and stop the lazy fork lifetime timer.  The child is single
+ *  threaded until the deferred init-process runs, so the timer signal
+ *  goes to the process, and we put back the old action when done.
+ *  The signal is separate from the shootdown signal, which the lazy
+ *  init-thread timer uses.
+ */
+static void monitor_lazy_fork_handler(int sig);
+
+static void
+monitor_start_lazy_fork_timer(void)
+{
+#ifdef MONITOR_USE_FORK_TIMER
+    struct sigaction action;
+    struct sigevent sev;
+    struct itimerspec its;
+    int timer;
+
+    if (monitor_lazy_fork_msec <= 0) {
+	return;
+    }
+    monitor_lazy_fork_signal = monitor_fork_timer_signal();
+    action.sa_handler = monitor_lazy_fork_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if (monitor_lazy_fork_signal <= 0
+	|| (*real_sigaction)(monitor_lazy_fork_signal, &action,
+			     &monitor_lazy_fork_old_action) != 0) {
+	MONITOR_WARN1("unable to install lazy fork timer signal\n");
+	monitor_lazy_fork_signal = -1;
+	return;
+    }
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = monitor_lazy_fork_signal;
+    if (syscall(SYS_timer_create, CLOCK_MONOTONIC, &sev, &timer) != 0) {
+	MONITOR_DEBUG1("timer_create failed\n");
+	(*real_sigaction)(monitor_lazy_fork_signal,
+			  &monitor_lazy_fork_old_action, NULL);
+	monitor_lazy_fork_signal = -1;
+	return;
+    }
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = monitor_lazy_fork_msec / 1000;
+    its.it_value.tv_nsec = (monitor_lazy_fork_msec % 1000) * 1000000;
+    monitor_lazy_fork_timer = timer;
+    syscall(SYS_timer_settime, timer, 0, &its, NULL);
+#endif
+}
+
+static void
+monitor_stop_lazy_fork_timer(void)
+{
+#ifdef MONITOR_USE_FORK_TIMER
+    if (monitor_lazy_fork_timer >= 0) {
+	syscall(SYS_timer_delete, monitor_lazy_fork_timer);
+	monitor_lazy_fork_timer = -1;
+    }
+    if (monitor_lazy_fork_signal > 0) {
+	(*real_sigaction)(monitor_lazy_fork_signal,
+			  &monitor_lazy_fork_old_action, NULL);
+	monitor_lazy_fork_signal = -1;
+    }
+#endif
+}
+
+/*
+ *  Run the deferred init-process callback, if it's still pending or
+ *  due.  Called from fork(), pthread_create() and exit, never from a
+ *  signal handler.
+ */
+void
+monitor_fork_lazy_init(void)
+{
+    long state;
+
+    for (;;) {
+	state = monitor_lazy_fork_state;
+	if (state != MONITOR_LAZY_FORK_PENDING
+	    && state != MONITOR_LAZY_FORK_DUE) {
+	    return;
+	}
+	if (compare_and_swap(&monitor_lazy_fork_state, state,
+			     MONITOR_LAZY_FORK_NONE) == state) {
+	    break;
+	}
+    }
+    monitor_stop_lazy_fork_timer();
+    MONITOR_DEBUG1("running deferred init-process\n");
+    monitor_begin_process_fcn(monitor_lazy_fork_data, MONITOR_FORK_LAZY);
+}
+
+/*
+ *  The lifetime timer interrupts arbitrary code (maybe inside malloc
+ *  or stdio), so it can't run the client's init-process.  It only
+ *  marks the child as long-lived.
+ */
+static void
+monitor_lazy_fork_handler(int sig)
+{
+    compare_and_swap(&monitor_lazy_fork_state, MONITOR_LAZY_FORK_PENDING,
+		     MONITOR_LAZY_FORK_DUE);
+}
+
+/*
+ *  Called from monitor's signal handlers before the client's handler.
+ *  Same as the timer, a client signal only marks the child as due.
+ */
+void
+monitor_fork_lazy_due(void)
+{
+    compare_and_swap(&monitor_lazy_fork_state, MONITOR_LAZY_FORK_PENDING,
+		     MONITOR_LAZY_FORK_DUE);
+}
+
+/*
+ *  At exit or exec, a child with init-process still pending skips all
+ *  of the fini callbacks (and shootdown), and stays that way.  If the
+ *  lifetime timer has marked it due, then run init-process now, so
+ *  the fini callbacks follow.
  *
- *  Note: vfork must be immediately followed by exec and can't even
- *  return from our override function.  Thus, we have to use the real
- *  fork (not the real vfork) in both cases.
+ *  Returns: 1 if the exit callbacks should be skipped, else 0.
+ */
+int
+monitor_fork_lazy_skip(void)
+{
+    long state;
+
+    for (;;) {
+	state = monitor_lazy_fork_state;
+	if (state == MONITOR_LAZY_FORK_DUE) {
+	    monitor_fork_lazy_init();
+	    return (0);
+	}
+	if (state != MONITOR_LAZY_FORK_PENDING) {
+	    return (state == MONITOR_LAZY_FORK_SKIPPED);
+	}
+	if (compare_and_swap(&monitor_lazy_fork_state,
+			     MONITOR_LAZY_FORK_PENDING,
+			     MONITOR_LAZY_FORK_SKIPPED)
+	    == MONITOR_LAZY_FORK_PENDING) {
+	    monitor_stop_lazy_fork_timer();
+	    MONITOR_DEBUG1("short-lived child, skipping callbacks\n");
+	    return (1);
+	}
+    }
+}
+
+/*
+ *  Override fork(), and vfork() on platforms without the real vfork
+ *  below.
  */
 static pid_t
 monitor_fork(void)
@@ -310,9 +751,12 @@ monitor_fork(void)
     pid_t ret;
 
     monitor_fork_init();
+    monitor_fork_lazy_init();
+    monitor_thread_lazy_init();
     MONITOR_DEBUG1("calling monitor_pre_fork() ...\n");
     user_data = monitor_pre_fork();
 
+    monitor_fork_regions_snapshot();
     ret = (*real_fork)();
     if (ret != 0) {
 	/* Parent process. */
@@ -325,8 +769,25 @@ monitor_fork(void)
     }
     else {
 	/* Child process. */
+	monitor_vfork_count = 0;
+	monitor_fork_regions_child();
+	monitor_trace_reset();
+	monitor_signal_stats_reset();
 	MONITOR_DEBUG("application forked, parent = %d\n", (int)getppid());
-	monitor_begin_process_fcn(user_data, TRUE);
+	if (monitor_lazy_fork_msec >= 0) {
+	    /*
+	     * Reset the thread list and user data now, so the child
+	     * doesn't see the parent's threads, and defer only the
+	     * callback.
+	     */
+	    MONITOR_DEBUG1("deferring monitor_init_process()\n");
+	    monitor_fork_child_reset(user_data);
+	    monitor_lazy_fork_data = user_data;
+	    monitor_lazy_fork_state = MONITOR_LAZY_FORK_PENDING;
+	    monitor_start_lazy_fork_timer();
+	} else {
+	    monitor_begin_process_fcn(user_data, TRUE);
+	}
     }
 
     return (ret);
@@ -338,11 +799,187 @@ MONITOR_WRAP_NAME(fork)(void)
     return monitor_fork();
 }
 
+#ifdef MONITOR_USE_REAL_VFORK
+/*
+ *  Override vfork() with a real vfork, so the child shares the
+ *  parent's address space (no page table copy).
+ *
+ *  The child returns from vfork() into the application's frame and
+ *  then runs on the same stack, so anything we leave on the stack
+ *  across the syscall is clobbered.  Like the libc vfork(), we keep
+ *  the return address (and user data) in registers that the syscall
+ *  preserves.  The parent runs monitor_post_fork() after the child
+ *  has exec'd or exited.  The child gets no callbacks here: if the new
+ *  program inherits LD_PRELOAD, then it starts its own monitor.
+ *
+ *  The child jumps back to the caller instead of using ret, same as
+ *  the glibc vfork.S.  The child shares the parent's shadow stack
+ *  (CET), so it must not pop the return address there, and the
+ *  parent's ret still matches its own call.
+ */
+static void * __attribute__ ((used))
+monitor_vfork_pre(void)
+{
+    monitor_fork_init();
+    monitor_vfork_parent = syscall(SYS_getpid);
+    fetch_and_add(&monitor_vfork_count, 1);
+
+    MONITOR_DEBUG1("calling monitor_pre_fork() ...\n");
+    return monitor_pre_fork();
+}
+
+static pid_t __attribute__ ((used))
+monitor_vfork_post(long ret, void *user_data)
+{
+    fetch_and_add(&monitor_vfork_count, -1);
+    if (ret < 0) {
+	errno = -ret;
+	ret = -1;
+	MONITOR_DEBUG("real vfork failed (%d): %s\n", errno, strerror(errno));
+    }
+    MONITOR_DEBUG1("calling monitor_post_fork() ...\n");
+    monitor_post_fork(ret, user_data);
+
+    return (ret);
+}
+
+#ifdef MONITOR_STATIC
+#define MONITOR_VFORK_NAME  "__wrap_vfork"
+#else
+#define MONITOR_VFORK_NAME  "vfork"
+#endif
+#define MONITOR_STR_HELP(x)  #x
+#define MONITOR_STR(x)  MONITOR_STR_HELP(x)
+
+asm (
+    ".text\n"
+    ".globl " MONITOR_VFORK_NAME "\n"
+    ".type " MONITOR_VFORK_NAME ", @function\n"
+    MONITOR_VFORK_NAME ":\n"
+    "	.cfi_startproc\n"
+    "	endbr64\n"
+    "	sub   $8, %rsp\n"
+    "	.cfi_adjust_cfa_offset 8\n"
+    "	call  monitor_vfork_pre\n"
+    "	add   $8, %rsp\n"
+    "	.cfi_adjust_cfa_offset -8\n"
+    "	mov   %rax, %rsi\n"
+    "	pop   %rdi\n"
+    "	.cfi_adjust_cfa_offset -8\n"
+    "	.cfi_register %rip, %rdi\n"
+    "	mov   $" MONITOR_STR(SYS_vfork) ", %eax\n"
+    "	syscall\n"
+    "	test  %rax, %rax\n"
+    "	jz    1f\n"
+    "	.cfi_remember_state\n"
+    "	push  %rdi\n"
+    "	.cfi_adjust_cfa_offset 8\n"
+    "	.cfi_offset %rip, -8\n"
+    "	mov   %rax, %rdi\n"
+    "	sub   $8, %rsp\n"
+    "	.cfi_adjust_cfa_offset 8\n"
+    "	call  monitor_vfork_post\n"
+    "	add   $8, %rsp\n"
+    "	.cfi_adjust_cfa_offset -8\n"
+    "	ret\n"
+    "	.cfi_restore_state\n"
+    "1:	jmp   *%rdi\n"
+    "	.cfi_endproc\n"
+    ".size " MONITOR_VFORK_NAME ", .-" MONITOR_VFORK_NAME "\n"
+);
+
+#else
+/*
+ *  Without a register-only vfork for this platform, we have to use
+ *  the real fork.
+ */
 pid_t
 MONITOR_WRAP_NAME(vfork)(void)
 {
     return monitor_fork();
 }
+#endif
+
+/*
+ *  Returns: 1 if we are the child of vfork() still sharing the
+ *  parent's memory (before exec or exit), else 0.
+ */
+int
+monitor_in_vfork_child(void)
+{
+    return (monitor_vfork_count > 0
+	    && syscall(SYS_getpid) != monitor_vfork_parent);
+}
+
+/*
+ *  Override posix_spawn() and posix_spawnp().  Libc launches the
+ *  child with clone(CLONE_VM | CLONE_VFORK) and execs it directly, so
+ *  the only callbacks are pre and post fork in the parent.  The new
+ *  program is monitored if its environment includes LD_PRELOAD.
+ */
+static int
+monitor_posix_spawn(posix_spawn_fcn_t *spawn_fcn, const char *who,
+		    pid_t *pid, const char *path,
+		    const posix_spawn_file_actions_t *file_actions,
+		    const posix_spawnattr_t *attrp,
+		    char *const argv[], char *const envp[])
+{
+    char **newenv = NULL;
+    void *user_data;
+    pid_t child = -1;
+    int ret;
+
+    MONITOR_DEBUG("(%s) path = %s\n", who, path);
+    if (monitor_exec_excluded(path)) {
+	newenv = monitor_alloc_environ(envp);
+	if (newenv != NULL) {
+	    envp = newenv;
+	}
+    }
+    MONITOR_DEBUG1("calling monitor_pre_fork() ...\n");
+    user_data = monitor_pre_fork();
+
+    ret = (*spawn_fcn)(&child, path, file_actions, attrp, argv, envp);
+    if (ret != 0) {
+	MONITOR_DEBUG("(%s) real spawn failed (%d): %s\n",
+		      who, ret, strerror(ret));
+	child = -1;
+    }
+    else if (pid != NULL) {
+	*pid = child;
+    }
+
+    free(newenv);
+
+    MONITOR_DEBUG1("calling monitor_post_fork() ...\n");
+    monitor_post_fork(child, user_data);
+
+    return (ret);
+}
+
+int
+MONITOR_WRAP_NAME(posix_spawn)(pid_t *pid, const char *path,
+			       const posix_spawn_file_actions_t *file_actions,
+			       const posix_spawnattr_t *attrp,
+			       char *const argv[], char *const envp[])
+{
+    monitor_fork_init();
+    return monitor_posix_spawn(real_posix_spawn, "posix_spawn", pid, path,
+			       file_actions, attrp, argv, envp);
+}
+
+int
+MONITOR_WRAP_NAME(posix_spawnp)(pid_t *pid, const char *file,
+				const posix_spawn_file_actions_t *file_actions,
+				const posix_spawnattr_t *attrp,
+				char *const argv[], char *const envp[])
+{
+    monitor_fork_init();
+    MONITOR_GET_REAL_NAME_WRAP(real_posix_spawnp, posix_spawnp);
+
+    return monitor_posix_spawn(real_posix_spawnp, "posix_spawnp", pid, file,
+			       file_actions, attrp, argv, envp);
+}
 
 /*
  *  Override execl() and execv().
@@ -368,7 +1005,11 @@ monitor_execv(const char *path, char *const argv[])
 	monitor_end_library_fcn();
 #endif
     }
-    ret = (*real_execv)(path, argv);
+    if (monitor_exec_excluded(path)) {
+	ret = (*real_execve)(path, argv, monitor_copy_environ(environ));
+    } else {
+	ret = (*real_execv)(path, argv);
+    }
 
     /* We only get here if real_execv fails. */
     if (is_exec) {
@@ -397,7 +1038,15 @@ monitor_execvp(const char *file, char *const argv[])
 	monitor_end_library_fcn();
 #endif
     }
-    ret = (*real_execvp)(file, argv);
+    /*
+     * Don't touch environ here, a vfork child shares it with the
+     * parent, and a successful exec would never put it back.
+     */
+    if (monitor_exec_excluded(file)) {
+	ret = execvpe(file, argv, monitor_copy_environ(environ));
+    } else {
+	ret = (*real_execvp)(file, argv);
+    }
 
     /* We only get here if real_execvp fails. */
     if (is_exec) {
@@ -426,6 +1075,9 @@ monitor_execve(const char *path, char *const argv[], char *const envp[])
 	monitor_end_library_fcn();
 #endif
     }
+    if (monitor_exec_excluded(path)) {
+	envp = monitor_copy_environ(envp);
+    }
     ret = (*real_execve)(path, argv, envp);
 
     /* We only get here if real_execve fails. */
@@ -514,22 +1166,26 @@ MONITOR_WRAP_NAME(execve)(const char *path, char *const argv[],
  *  functions) and client support (without callbacks).  Stevens
  *  describes the issues with signals and how to do this.
  *
- *  This allows us to do three things: (1) replace vfork() with fork,
- *  (2) provide pre/post_fork() callbacks, and (3) selectively monitor
- *  or not the child process.  Note: the libc system() does a direct
- *  syscall for fork, thus bypassing our override.
+ *  This allows us to do three things: (1) launch the shell with
+ *  posix_spawn(), which uses clone(CLONE_VM | CLONE_VFORK) and so
+ *  avoids copying the page tables of a large process, (2) provide
+ *  pre/post_fork() callbacks, and (3) selectively monitor or not the
+ *  child process.  Note: the libc system() does a direct syscall for
+ *  fork, thus bypassing our override.
  */
 #define SHELL  "/bin/sh"
 static int
 monitor_system(const char *command, int callback)
 {
     struct sigaction ign_act, old_int, old_quit;
-    sigset_t sigchld_set, old_set;
+    sigset_t sigchld_set, old_set, default_set;
+    posix_spawnattr_t attr;
     void *user_data = NULL;
+    char **newenv = NULL;
     char *arglist[4];
     char *who;
     pid_t pid;
-    int status;
+    int ret, status;
 
     monitor_fork_init();
     who = (callback ? "appl" : "client");
@@ -559,29 +1215,47 @@ monitor_system(const char *command, int callback)
     (*real_sigaction)(SIGQUIT, &ign_act, &old_quit);
     (*real_sigprocmask)(SIG_BLOCK, &sigchld_set, &old_set);
 
-    pid = (*real_fork)();
-    if (pid < 0) {
-	/* Fork failed. */
-	MONITOR_DEBUG("(%s) real fork failed\n", who);
-	status = -1;
+    /*
+     * The child gets back the old signal mask, and SIGINT and SIGQUIT
+     * revert to default unless they were already ignored.  (Caught
+     * signals are reset to default by exec anyway.)
+     */
+    sigemptyset(&default_set);
+    if (old_int.sa_handler != SIG_IGN) {
+	sigaddset(&default_set, SIGINT);
     }
-    else if (pid == 0) {
-	/* Child process. */
-	MONITOR_DEBUG("(%s) child process about to exec, parent = %d\n",
-		      who, getppid());
-	(*real_sigaction)(SIGINT, &old_int, NULL);
-	(*real_sigaction)(SIGQUIT, &old_quit, NULL);
-	(*real_sigprocmask)(SIG_SETMASK, &old_set, NULL);
-	arglist[0] = SHELL;
-	arglist[1] = "-c";
-	arglist[2] = (char *)command;
-	arglist[3] = NULL;
-	(*real_execve)(SHELL, arglist,
-		       callback ? environ : monitor_copy_environ(environ));
-	monitor_real_exit(127);
+    if (old_quit.sa_handler != SIG_IGN) {
+	sigaddset(&default_set, SIGQUIT);
+    }
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &default_set);
+    posix_spawnattr_setsigmask(&attr, &old_set);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    arglist[0] = SHELL;
+    arglist[1] = "-c";
+    arglist[2] = (char *)command;
+    arglist[3] = NULL;
+    /*
+     * The client's shell runs without monitor.  The env array is
+     * per-call, other threads may be spawning at the same time.
+     */
+    if (! callback) {
+	newenv = monitor_alloc_environ(environ);
+    }
+    ret = (*real_posix_spawn)(&pid, SHELL, NULL, &attr, arglist,
+			      newenv != NULL ? newenv : environ);
+    posix_spawnattr_destroy(&attr);
+    free(newenv);
+
+    if (ret != 0) {
+	/* Same as the shell failing to exec, exit(127). */
+	MONITOR_DEBUG("(%s) real posix_spawn failed (%d): %s\n",
+		      who, ret, strerror(ret));
+	pid = -1;
+	status = 127 << 8;
     }
     else {
-	/* Parent process. */
 	while (waitpid(pid, &status, 0) < 0) {
 	    if (errno != EINTR) {
 		status = -1;
@@ -602,6 +1276,159 @@ monitor_system(const char *command, int callback)
     return (status);
 }
 
+/*
+ *  Reimplement popen() with posix_spawn() for the same reasons as
+ *  system().  The parent's end of the pipe is close-on-exec only with
+ *  the 'e' mode flag.  As POSIX requires, the child closes the streams
+ *  from earlier popen()s.  The close list is made under the list lock,
+ *  but the spawn runs without it.
+ */
+static FILE *
+monitor_popen(const char *command, const char *type)
+{
+    posix_spawn_file_actions_t actions;
+    struct monitor_popen *mp, *node;
+    char *arglist[4];
+    void *user_data;
+    FILE *fp;
+    pid_t pid;
+    int fds[2], parent_fd, child_fd, child_std, is_read, ret;
+
+    MONITOR_DEBUG("command = %s, type = %s\n", command, type);
+    if (command == NULL || type == NULL
+	|| (type[0] != 'r' && type[0] != 'w')) {
+	errno = EINVAL;
+	return (NULL);
+    }
+    is_read = (type[0] == 'r');
+
+    mp = (*real_malloc)(sizeof(struct monitor_popen));
+    if (mp == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+    if (pipe(fds) != 0) {
+	free(mp);
+	return (NULL);
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    parent_fd = is_read ? fds[0] : fds[1];
+    child_fd = is_read ? fds[1] : fds[0];
+    child_std = is_read ? STDOUT_FILENO : STDIN_FILENO;
+
+    MONITOR_DEBUG1("calling monitor_pre_fork() ...\n");
+    user_data = monitor_pre_fork();
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, child_fd, child_std);
+    spinlock_lock(&monitor_popen_lock);
+    for (node = monitor_popen_list; node != NULL; node = node->mp_next) {
+	posix_spawn_file_actions_addclose(&actions, fileno(node->mp_fp));
+    }
+    monitor_popen_spawning++;
+    spinlock_unlock(&monitor_popen_lock);
+
+    arglist[0] = SHELL;
+    arglist[1] = "-c";
+    arglist[2] = (char *)command;
+    arglist[3] = NULL;
+    ret = (*real_posix_spawn)(&pid, SHELL, &actions, NULL, arglist, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(child_fd);
+
+    fp = NULL;
+    if (ret != 0) {
+	MONITOR_DEBUG("real posix_spawn failed (%d): %s\n", ret, strerror(ret));
+	pid = -1;
+    }
+    else {
+	fp = fdopen(parent_fd, is_read ? "r" : "w");
+	if (fp == NULL) {
+	    ret = errno;
+	}
+    }
+
+    /*
+     * Clear close-on-exec for the new stream now, or else for all
+     * the waiting streams when the last spawn finishes.
+     */
+    spinlock_lock(&monitor_popen_lock);
+    monitor_popen_spawning--;
+    if (fp != NULL) {
+	mp->mp_fp = fp;
+	mp->mp_pid = pid;
+	mp->mp_cloexec = (strchr(type, 'e') == NULL);
+	mp->mp_next = monitor_popen_list;
+	monitor_popen_list = mp;
+    }
+    if (monitor_popen_spawning == 0) {
+	for (node = monitor_popen_list; node != NULL; node = node->mp_next) {
+	    if (node->mp_cloexec) {
+		fcntl(fileno(node->mp_fp), F_SETFD, 0);
+		node->mp_cloexec = 0;
+	    }
+	}
+    }
+    spinlock_unlock(&monitor_popen_lock);
+
+    if (fp == NULL) {
+	close(parent_fd);
+	free(mp);
+	if (pid > 0) {
+	    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+	    }
+	}
+	errno = ret;
+    }
+
+    MONITOR_DEBUG1("calling monitor_post_fork() ...\n");
+    monitor_post_fork(pid, user_data);
+
+    return (fp);
+}
+
+/*
+ *  Returns: the child's exit status, or else -1 on error.
+ */
+static int
+monitor_pclose(FILE *fp)
+{
+    struct monitor_popen *mp, **prev;
+    pid_t pid;
+    int status;
+
+    spinlock_lock(&monitor_popen_lock);
+    for (prev = &monitor_popen_list; *prev != NULL; prev = &(*prev)->mp_next) {
+	if ((*prev)->mp_fp == fp)
+	    break;
+    }
+    mp = *prev;
+    if (mp != NULL) {
+	*prev = mp->mp_next;
+    }
+    spinlock_unlock(&monitor_popen_lock);
+
+    if (mp == NULL) {
+	/* Not from our popen(). */
+	MONITOR_DEBUG("not our stream: %p\n", fp);
+	return (*real_pclose)(fp);
+    }
+    pid = mp->mp_pid;
+    free(mp);
+
+    fclose(fp);
+    while (waitpid(pid, &status, 0) < 0) {
+	if (errno != EINTR) {
+	    status = -1;
+	    break;
+	}
+    }
+    MONITOR_DEBUG("pid = %d, status = %d\n", (int)pid, status);
+
+    return (status);
+}
+
 int
 MONITOR_WRAP_NAME(system)(const char *command)
 {
@@ -620,6 +1447,25 @@ MONITOR_WRAP_NAME(system)(const char *command)
     return ret;
 }
 
+FILE *
+MONITOR_WRAP_NAME(popen)(const char *command, const char *type)
+{
+    monitor_fork_init();
+
+    if (! override_system) {
+	MONITOR_DEBUG("popen (no override): %s\n", command);
+	return (*real_popen)(command, type);
+    }
+    return monitor_popen(command, type);
+}
+
+int
+MONITOR_WRAP_NAME(pclose)(FILE *fp)
+{
+    monitor_fork_init();
+    return monitor_pclose(fp);
+}
+
 /*
  *----------------------------------------------------------------------
  *  CLIENT SUPPORT FUNCTIONS
@@ -654,3 +1500,163 @@ monitor_real_system(const char *command)
 {
     return monitor_system(command, FALSE);
 }
+
+/*
+ *  Set the lazy init-process policy for future fork children, msec
+ *  is the lifetime before the deferred init-process runs on its own
+ *  (0 for none), or -1 to run init-process right away (the default).
+ *
+ *  Returns: the old value.
+ */
+int
+monitor_set_lazy_fork(int msec)
+{
+    int old;
+
+    monitor_fork_init();
+    old = monitor_lazy_fork_msec;
+    monitor_lazy_fork_msec = (msec < 0) ? -1 : msec;
+    MONITOR_DEBUG("lifetime: %d msec (was %d)\n", monitor_lazy_fork_msec, old);
+
+    return (old);
+}
+
+/*
+ *  Mark the client region at addr (page-aligned) for len bytes as
+ *  MADV_DONTFORK, so fork() doesn't copy its page tables and the child
+ *  doesn't get it.  Registering the same addr again replaces len.
+ *
+ *  Returns: 0 on success, else -1 with errno set.
+ */
+int
+monitor_fork_exclude(void *addr, size_t len)
+{
+    size_t old_len;
+    int k, save_errno;
+
+    if (addr == NULL || len == 0) {
+	errno = EINVAL;
+	return (FAILURE);
+    }
+    spinlock_lock(&monitor_fork_region_lock);
+    for (k = 0; k < monitor_num_fork_regions; k++) {
+	if (monitor_fork_region[k].fr_addr == addr)
+	    break;
+    }
+    if (k == MONITOR_FORK_MAX_REGIONS) {
+	spinlock_unlock(&monitor_fork_region_lock);
+	MONITOR_DEBUG("too many regions (max %d)\n", MONITOR_FORK_MAX_REGIONS);
+	errno = ENOMEM;
+	return (FAILURE);
+    }
+    /*
+     * Put back the old range first, in case the new one is shorter.
+     * If the new range fails, then keep the old one.
+     */
+    old_len = (k < monitor_num_fork_regions) ? monitor_fork_region[k].fr_len : 0;
+    if (old_len > 0) {
+	madvise(addr, old_len, MADV_DOFORK);
+    }
+    if (madvise(addr, len, MADV_DONTFORK) != 0) {
+	save_errno = errno;
+	if (old_len > 0) {
+	    madvise(addr, old_len, MADV_DONTFORK);
+	}
+	spinlock_unlock(&monitor_fork_region_lock);
+	MONITOR_DEBUG("madvise failed: addr = %p, len = %ld, errno = %d\n",
+		      addr, (long) len, save_errno);
+	errno = save_errno;
+	return (FAILURE);
+    }
+    monitor_fork_region[k].fr_addr = addr;
+    monitor_fork_region[k].fr_len = len;
+    if (k == monitor_num_fork_regions) {
+	monitor_num_fork_regions++;
+    }
+    spinlock_unlock(&monitor_fork_region_lock);
+    MONITOR_DEBUG("addr = %p, len = %ld\n", addr, (long) len);
+
+    return (SUCCESS);
+}
+
+/*
+ *  Undo monitor_fork_exclude() for the region at addr, the region
+ *  will be copied to future children.
+ *
+ *  Returns: 0 on success, else -1 if addr is not registered.
+ */
+int
+monitor_fork_include(void *addr)
+{
+    int k, ret;
+
+    spinlock_lock(&monitor_fork_region_lock);
+    for (k = 0; k < monitor_num_fork_regions; k++) {
+	if (monitor_fork_region[k].fr_addr == addr)
+	    break;
+    }
+    if (k == monitor_num_fork_regions) {
+	spinlock_unlock(&monitor_fork_region_lock);
+	errno = EINVAL;
+	return (FAILURE);
+    }
+    ret = madvise(addr, monitor_fork_region[k].fr_len, MADV_DOFORK);
+    monitor_num_fork_regions--;
+    monitor_fork_region[k] = monitor_fork_region[monitor_num_fork_regions];
+    spinlock_unlock(&monitor_fork_region_lock);
+    MONITOR_DEBUG("addr = %p, ret = %d\n", addr, ret);
+
+    return (ret == 0 ? SUCCESS : FAILURE);
+}
+
+/*
+ *  In a fork child, copy up to max of the regions that were excluded
+ *  from this process into regions.  The list is set before the
+ *  child's monitor_init_process() callback, so the client can remake
+ *  its buffers there (or lazily).
+ *
+ *  Returns: the number of excluded regions, which may exceed max.
+ */
+int
+monitor_get_fork_excluded(struct monitor_fork_region *regions, int max)
+{
+    int k;
+
+    for (k = 0; k < monitor_num_fork_excluded && k < max; k++) {
+	regions[k] = monitor_fork_excluded[k];
+    }
+    return (monitor_num_fork_excluded);
+}
+
+/*
+ *  Called in the parent just before fork.  Copy the registered regions
+ *  under the lock, so the child never sees an entry that another
+ *  thread was in the middle of changing.  (We can't hold the lock
+ *  across fork, an atfork handler may register a region.)
+ */
+void
+monitor_fork_regions_snapshot(void)
+{
+    spinlock_lock(&monitor_fork_region_lock);
+    memcpy(monitor_fork_snapshot, monitor_fork_region,
+	   monitor_num_fork_regions * sizeof(struct monitor_fork_region));
+    monitor_num_fork_snapshot = monitor_num_fork_regions;
+    spinlock_unlock(&monitor_fork_region_lock);
+}
+
+/*
+ *  Called in the child after fork.  The registered regions don't
+ *  exist here, so the parent's snapshot becomes the excluded list,
+ *  and the child starts with no registered regions.  Also, reset the
+ *  lock in case another thread held it at the time of fork.
+ */
+void
+monitor_fork_regions_child(void)
+{
+    memcpy(monitor_fork_excluded, monitor_fork_snapshot,
+	   monitor_num_fork_snapshot * sizeof(struct monitor_fork_region));
+    monitor_num_fork_excluded = monitor_num_fork_snapshot;
+    monitor_num_fork_snapshot = 0;
+    monitor_num_fork_regions = 0;
+    spinlock_unlock(&monitor_fork_region_lock);
+}
@@ -0,0 +1,154 @@
+/*
+ *  Libmonitor futex wait and wake.
+ *
+ *  Copyright (c) 2007-2023, Rice University.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ *  * Neither the name of Rice University (RICE) nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ *  This software is provided by RICE and contributors "as is" and any
+ *  express or implied warranties, including, but not limited to, the
+ *  implied warranties of merchantability and fitness for a particular
+ *  purpose are disclaimed. In no event shall RICE or contributors be
+ *  liable for any direct, indirect, incidental, special, exemplary, or
+ *  consequential damages (including, but not limited to, procurement of
+ *  substitute goods or services; loss of use, data, or profits; or
+ *  business interruption) however caused and on any theory of liability,
+ *  whether in contract, strict liability, or tort (including negligence
+ *  or otherwise) arising in any way out of the use of this software, even
+ *  if advised of the possibility of such damage.
+ *
+ *  $Id$
+ */
+
+/*
+ *  A futex is an int in memory that one thread can sleep on until
+ *  another thread changes it and calls wake.  Waiters always re-check
+ *  their condition after waking, so a spurious or missed wakeup only
+ *  costs time, never correctness.
+ *
+ *  On systems without futexes, wait falls back to polling with
+ *  usleep() and wake does nothing.
+ */
+
+#ifndef  _MONITOR_FUTEX_
+#define  _MONITOR_FUTEX_
+
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef FUTEX_WAIT_PRIVATE
+#define FUTEX_WAIT_PRIVATE  FUTEX_WAIT
+#define FUTEX_WAKE_PRIVATE  FUTEX_WAKE
+#endif
+
+#define MONITOR_FUTEX_POLL_USEC  1000
+
+/*
+ *  Sleep while *addr == val, for at most timeout (relative), or
+ *  forever if timeout is NULL.  Safe to call in a signal handler.
+ */
+static inline void
+monitor_futex_wait(volatile int *addr, int val, const struct timespec *timeout)
+{
+#if defined(__linux__) && defined(SYS_futex)
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+#else
+    long usec = MONITOR_FUTEX_POLL_USEC;
+
+    if (timeout != NULL && timeout->tv_sec == 0
+	&& timeout->tv_nsec / 1000 < usec) {
+	usec = timeout->tv_nsec / 1000;
+    }
+    if (*addr == val)
+	usleep(usec);
+#endif
+}
+
+/*
+ *  Wake all threads sleeping on addr.  Safe to call in a signal
+ *  handler.
+ */
+static inline void
+monitor_futex_wake(volatile int *addr)
+{
+#if defined(__linux__) && defined(SYS_futex)
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 0x7fffffff, NULL, NULL, 0);
+#endif
+}
+
+/*
+ *  Returns: the current CLOCK_MONOTONIC time in nanoseconds, or else
+ *  the time of day if there is no monotonic clock.
+ */
+static inline long long
+monitor_clock_nsec(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+	return ((long long) ts.tv_sec * 1000000000LL + ts.tv_nsec);
+#endif
+    {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long) tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL);
+    }
+}
+
+/*
+ *  Returns: the cycle counter (time stamp counter) for timing short
+ *  intervals, or else nanoseconds if there is no cycle counter.
+ */
+static inline unsigned long long
+monitor_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return (((unsigned long long) hi << 32) | lo);
+#elif defined(__aarch64__)
+    unsigned long long val;
+
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (val));
+    return (val);
+#else
+    return (monitor_clock_nsec());
+#endif
+}
+
+/*
+ *  Convert a relative time in nanoseconds to a timespec.
+ */
+static inline void
+monitor_nsec_to_timespec(long long nsec, struct timespec *ts)
+{
+    if (nsec < 0)
+	nsec = 0;
+    ts->tv_sec = nsec / 1000000000LL;
+    ts->tv_nsec = nsec % 1000000000LL;
+}
+
+#endif  /* _MONITOR_FUTEX_ */
@@ -53,6 +53,7 @@
 #ifdef MONITOR_DYNAMIC
 #include <dlfcn.h>
 #endif
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -61,6 +62,7 @@
 
 #include "common.h"
 #include "atomic.h"
+#include "futex.h"
 #include "monitor.h"
 #include "pthread_h.h"
 
@@ -144,9 +146,42 @@ static char **monitor_envp = NULL;
 
 volatile static char monitor_init_library_called = 0;
 volatile static char monitor_fini_library_called = 0;
-volatile static char monitor_fini_process_done = 0;
 volatile static long monitor_end_process_cookie = 0;
 
+/*
+ *  Futexes for the exit race losers: fini-process is done, and
+ *  library fini (the destructor) is done.  The exit guard is the
+ *  most time (in seconds) that a loser waits for library fini, set
+ *  by MONITOR_EXIT_GUARD.
+ */
+#define MONITOR_EXIT_GUARD  2.0
+
+volatile static int monitor_fini_process_done = 0;
+volatile static int monitor_fini_library_done = 0;
+static long long monitor_exit_guard = 0;
+
+/*
+ *  Start and end times (nsec) of the startup and shutdown phases,
+ *  plus time in the client callbacks.  The base is monitor's first
+ *  entry.  MONITOR_TIMING is a file prefix for the report at exit.
+ */
+struct monitor_phase {
+    volatile long long  ph_begin;
+    volatile long long  ph_end;
+    volatile long  ph_client;
+    volatile long  ph_calls;
+};
+
+static struct monitor_phase monitor_phase[MONITOR_NUM_PHASES];
+static long long monitor_phase_base = 0;
+static char *monitor_timing_prefix = NULL;
+volatile static long monitor_timing_done = 0;
+
+static const char *monitor_phase_name[MONITOR_NUM_PHASES] = {
+    "init_library", "init_process", "at_main", "first_thread",
+    "shootdown", "fini_process", "fini_library",
+};
+
 extern char monitor_main_fence1;
 extern char monitor_main_fence2;
 extern char monitor_main_fence3;
@@ -154,6 +189,115 @@ extern char monitor_main_fence4;
 
 static struct monitor_thread_node monitor_main_tn;
 
+/*
+ *----------------------------------------------------------------------
+ *  PHASE TIMING
+ *----------------------------------------------------------------------
+ */
+
+/*
+ *  Only the first time through a phase counts, so begin and end are
+ *  no-ops if the phase has already started or finished.
+ */
+void
+monitor_phase_begin(int phase)
+{
+    long long now = monitor_clock_nsec();
+
+    if (monitor_phase_base == 0) {
+	monitor_phase_base = now;
+    }
+    if (monitor_phase[phase].ph_begin == 0) {
+	monitor_phase[phase].ph_begin = now;
+    }
+}
+
+void
+monitor_phase_end(int phase)
+{
+    if (monitor_phase[phase].ph_begin != 0
+	&& monitor_phase[phase].ph_end == 0) {
+	monitor_phase[phase].ph_end = monitor_clock_nsec();
+    }
+}
+
+/*
+ *  Add the time since start to the phase's client time.  Shootdown
+ *  runs the fini-thread callbacks in several threads at once.
+ */
+void
+monitor_phase_client(int phase, long long start)
+{
+    if (monitor_phase[phase].ph_begin != 0
+	&& monitor_phase[phase].ph_end == 0) {
+	fetch_and_add(&monitor_phase[phase].ph_client,
+		      (long) (monitor_clock_nsec() - start));
+	fetch_and_add(&monitor_phase[phase].ph_calls, 1);
+    }
+}
+
+/*
+ *  Start over in a new process (fork), the child's phases are
+ *  relative to the fork.
+ */
+static void
+monitor_phase_reset(void)
+{
+    memset(monitor_phase, 0, sizeof(monitor_phase));
+    monitor_phase_base = monitor_clock_nsec();
+    monitor_timing_done = 0;
+}
+
+/*
+ *  Write the phase times (msec) to the file prefix.pid, once per
+ *  process image.  Append, so that an exec keeps the earlier report.
+ */
+static void
+monitor_timing_report(void)
+{
+    struct monitor_phase_time pt;
+    char buf[4096];
+    int fd, len, phase;
+
+    if (monitor_timing_prefix == NULL
+	|| compare_and_swap(&monitor_timing_done, 0, 1) != 0) {
+	return;
+    }
+    snprintf(buf, sizeof(buf), "%s.%d", monitor_timing_prefix, (int) getpid());
+    fd = open(buf, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+	MONITOR_WARN("unable to open timing file: %s\n", buf);
+	return;
+    }
+
+    len = snprintf(buf, sizeof(buf), "monitor timing: pid %d, %s\n"
+		   "%-14s %12s %12s %12s %12s %6s\n",
+		   (int) getpid(),
+		   (monitor_argv != NULL && monitor_argv[0] != NULL)
+		   ? monitor_argv[0] : "(unknown)",
+		   "phase (msec)", "start", "total", "monitor", "client", "calls");
+    for (phase = 0; phase < MONITOR_NUM_PHASES; phase++) {
+	if (len >= (int) sizeof(buf) - 100) {
+	    break;
+	}
+	if (monitor_get_phase_time(phase, &pt) != SUCCESS) {
+	    len += snprintf(&buf[len], sizeof(buf) - len, "%-14s %12s\n",
+			    monitor_phase_name[phase], "-");
+	    continue;
+	}
+	len += snprintf(&buf[len], sizeof(buf) - len,
+			"%-14s %12.3f %12.3f %12.3f %12.3f %6ld\n",
+			monitor_phase_name[phase], pt.pt_start / 1000000.0,
+			pt.pt_total / 1000000.0,
+			(pt.pt_total - pt.pt_client) / 1000000.0,
+			pt.pt_client / 1000000.0, pt.pt_calls);
+    }
+    if (write(fd, buf, len) != len) {
+	MONITOR_WARN1("unable to write timing file\n");
+    }
+    close(fd);
+}
+
 /*
  *----------------------------------------------------------------------
  *  INIT FUNCTIONS
@@ -170,16 +314,59 @@ monitor_early_init(void)
 {
     MONITOR_RUN_ONCE(early_init);
 
+    if (monitor_phase_base == 0) {
+	monitor_phase_base = monitor_clock_nsec();
+    }
     if (! monitor_debug) {
 	if (getenv("MONITOR_DEBUG") != NULL)
 	    monitor_debug = 1;
     }
-    MONITOR_DEBUG1("\n");
+    monitor_trace_init();
 
     memset(&monitor_main_tn, 0, sizeof(struct monitor_thread_node));
     monitor_main_tn.tn_magic = MONITOR_TN_MAGIC;
     monitor_main_tn.tn_tid = 0;
     monitor_main_tn.tn_is_main = 1;
+    MONITOR_DEBUG1("\n");
+}
+
+/*
+ *  Allow MONITOR_EXIT_GUARD to set the number of seconds (may be
+ *  fractional, 0 for none) that a thread that loses the exit race
+ *  waits for the winner to finish library fini.
+ */
+static void
+monitor_exit_guard_init(void)
+{
+    char *str;
+    double secs;
+
+    secs = MONITOR_EXIT_GUARD;
+    str = getenv("MONITOR_EXIT_GUARD");
+    if (str != NULL) {
+	if (sscanf(str, "%lf", &secs) < 1 || secs < 0.0) {
+	    MONITOR_WARN("bad value for MONITOR_EXIT_GUARD: %s\n", str);
+	    secs = MONITOR_EXIT_GUARD;
+	}
+    }
+    monitor_exit_guard = (long long) (secs * 1000000000.0);
+    MONITOR_DEBUG("exit guard: %g sec\n", secs);
+}
+
+/*
+ *  Allow MONITOR_TIMING to set the file prefix for the timing report
+ *  at exit.
+ */
+static void
+monitor_timing_init(void)
+{
+    char *str;
+
+    str = getenv("MONITOR_TIMING");
+    if (str != NULL && str[0] != 0) {
+	monitor_timing_prefix = str;
+	MONITOR_DEBUG("timing report: %s\n", str);
+    }
 }
 
 /*
@@ -193,6 +380,8 @@ monitor_normal_init(void)
 
     monitor_early_init();
     MONITOR_DEBUG("%s rev %d\n", PACKAGE_STRING, SVN_REVISION);
+    monitor_exit_guard_init();
+    monitor_timing_init();
 
     /*
      * Always get _exit() first so that we have a way to exit if
@@ -227,25 +416,56 @@ monitor_normal_init(void)
 static void
 monitor_begin_library_fcn(void)
 {
+    long long start;
+
     MONITOR_RUN_ONCE(begin_library);
 
+    monitor_phase_begin(MONITOR_PHASE_INIT_LIBRARY);
     MONITOR_DEBUG1("\n");
     monitor_normal_init();
 
     MONITOR_DEBUG1("calling monitor_init_library() ...\n");
+    start = monitor_clock_nsec();
     monitor_init_library();
+    monitor_phase_client(MONITOR_PHASE_INIT_LIBRARY, start);
     monitor_init_library_called = 1;
+    monitor_phase_end(MONITOR_PHASE_INIT_LIBRARY);
+}
+
+/*
+ *  Reset the process state in the child after fork(): the parent's
+ *  threads are gone, and the phase times start over.  A lazy fork
+ *  child runs this right away and init-process later.
+ */
+void
+monitor_fork_child_reset(void *user_data)
+{
+    monitor_reset_thread_list(&monitor_main_tn);
+    monitor_main_tn.tn_user_data = user_data;
+    monitor_phase_reset();
 }
 
 void
 monitor_end_library_fcn(void)
 {
-    if (monitor_fini_library_called)
+    long long start;
+
+    if (monitor_fini_library_called || monitor_in_vfork_child()
+	|| monitor_fork_lazy_skip())
 	return;
 
+    monitor_phase_begin(MONITOR_PHASE_FINI_LIBRARY);
     MONITOR_DEBUG1("calling monitor_fini_library() ...\n");
+    start = monitor_clock_nsec();
     monitor_fini_library();
+    monitor_phase_client(MONITOR_PHASE_FINI_LIBRARY, start);
     monitor_fini_library_called = 1;
+    monitor_trace_dump();
+    monitor_phase_end(MONITOR_PHASE_FINI_LIBRARY);
+    monitor_timing_report();
+
+    monitor_fini_library_done = 1;
+    monitor_futex_wake(&monitor_fini_library_done);
 }
 
 /*
@@ -256,6 +476,7 @@ void
 monitor_begin_process_fcn(void *user_data, int is_fork)
 {
     static long monitor_init_process_called = 0;
+    long long start;
 
     monitor_normal_init();
 
@@ -265,8 +486,9 @@ monitor_begin_process_fcn(void *user_data, int is_fork)
     if (is_fork) {
 	/* Fork() always runs the init process callback.
 	 */
-	monitor_reset_thread_list(&monitor_main_tn);
-	monitor_main_tn.tn_user_data = user_data;
+	if (is_fork != MONITOR_FORK_LAZY) {
+	    monitor_fork_child_reset(user_data);
+	}
     }
     else if (val) {
 	/* If already called, then skip the init process callback.
@@ -275,13 +497,51 @@ monitor_begin_process_fcn(void *user_data, int is_fork)
     }
 
     monitor_fini_library_called = 0;
+    monitor_fini_library_done = 0;
     monitor_fini_process_done = 0;
 
     monitor_begin_library_fcn();
+    monitor_main_altstack_init();
 
+    monitor_phase_begin(MONITOR_PHASE_INIT_PROCESS);
     MONITOR_DEBUG1("calling monitor_init_process() ...\n");
+    start = monitor_clock_nsec();
     monitor_main_tn.tn_user_data =
 	monitor_init_process(&monitor_argc, monitor_argv, user_data);
+    monitor_phase_client(MONITOR_PHASE_INIT_PROCESS, start);
+
+    /*
+     * Timers aren't inherited across fork, so restart sampling in
+     * the child.
+     */
+    if (is_fork) {
+	monitor_sample_thread_init();
+    }
+    monitor_phase_end(MONITOR_PHASE_INIT_PROCESS);
+}
+
+/*
+ *  Wait for the exit race winner to finish library fini, for at most
+ *  the exit guard.  Only the dynamic case has a library destructor.
+ */
+static void
+monitor_exit_guard_wait(void)
+{
+#ifdef MONITOR_DYNAMIC
+    struct timespec ts;
+    long long deadline, left;
+
+    deadline = monitor_clock_nsec() + monitor_exit_guard;
+    while (! monitor_fini_library_done) {
+	left = deadline - monitor_clock_nsec();
+	if (left <= 0) {
+	    MONITOR_DEBUG1("exit guard expired\n");
+	    break;
+	}
+	monitor_nsec_to_timespec(left, &ts);
+	monitor_futex_wait(&monitor_fini_library_done, 0, &ts);
+    }
+#endif
 }
 
 /*
@@ -289,20 +549,41 @@ monitor_begin_process_fcn(void *user_data, int is_fork)
  *  them here.  The first thread to get here invokes the callback
  *  functions, and the others wait for that to finish.
  *
+ *  The losers sleep on a futex until fini-process is done, so they
+ *  continue as soon as the winner wakes them.
+ *
  *  Note: there is a race condition in the system exit() between
  *  _IO_cleanup() and doing output from monitor's library fini
  *  destructor (in debug mode) that can (rarely) result in a segfault.
- *  Here, we avoid the race by delaying the losing threads a few extra
- *  seconds.  But, we can't block them forever because that would
+ *  Here, we avoid the race by also waiting for the winner to finish
+ *  library fini.  But, we can't block them forever because that would
  *  deadlock if the application calls exit() from its own exit
- *  handler.  (It shouldn't do that, but it might.)
+ *  handler.  (It shouldn't do that, but it might.)  So, this wait is
+ *  bounded by the exit guard.
  */
 void
 monitor_end_process_fcn(int how)
 {
     struct monitor_thread_node *tn = monitor_get_tn();
+    long long start;
     long prev;
 
+    /*
+     * A vfork child shares our memory until it execs or exits, so
+     * leave the exit callbacks to the parent.
+     */
+    if (monitor_in_vfork_child()) {
+	MONITOR_DEBUG("vfork child exiting (how = %d)\n", how);
+	return;
+    }
+    /*
+     * A fork child that exits before its deferred init-process gets
+     * no callbacks at all (lazy fork).
+     */
+    if (monitor_fork_lazy_skip()) {
+	return;
+    }
+
     prev = compare_and_swap(&monitor_end_process_cookie, 0, 1);
     if (prev == 0) {
 	/*
@@ -312,13 +593,28 @@ monitor_end_process_fcn(int how)
 	if (tn != NULL) {
 	    tn->tn_exit_win = 1;
 	}
+	monitor_phase_begin(MONITOR_PHASE_SHOOTDOWN);
 	MONITOR_DEBUG("calling monitor_begin_process_exit (how = %d) ...\n", how);
+	start = monitor_clock_nsec();
 	monitor_begin_process_exit(how);
+	monitor_phase_client(MONITOR_PHASE_SHOOTDOWN, start);
 
+	monitor_sample_stop();
+	monitor_event_stop();
 	monitor_thread_shootdown();
+	monitor_phase_end(MONITOR_PHASE_SHOOTDOWN);
 
+	monitor_phase_begin(MONITOR_PHASE_FINI_PROCESS);
 	MONITOR_DEBUG("calling monitor_fini_process (how = %d) ...\n", how);
+	start = monitor_clock_nsec();
 	monitor_fini_process(how, monitor_main_tn.tn_user_data);
+	monitor_phase_client(MONITOR_PHASE_FINI_PROCESS, start);
+	monitor_signal_stats_report();
+	monitor_phase_end(MONITOR_PHASE_FINI_PROCESS);
+#ifdef MONITOR_STATIC
+	/* No library fini in the static case. */
+	monitor_timing_report();
+#endif
     }
     else if (tn != NULL && tn->tn_exit_win) {
 	/*
@@ -334,12 +630,13 @@ monitor_end_process_fcn(int how)
 	 */
 	MONITOR_DEBUG("delay second thread trying to exit (how = %d)\n", how);
 	while (! monitor_fini_process_done) {
-	    usleep(MONITOR_POLL_USLEEP_TIME);
+	    monitor_futex_wait(&monitor_fini_process_done, 0, NULL);
 	}
-	sleep(2);
+	monitor_exit_guard_wait();
     }
 
     monitor_fini_process_done = 1;
+    monitor_futex_wake(&monitor_fini_process_done);
     MONITOR_DEBUG1("resume system exit\n");
 }
 
@@ -425,6 +722,32 @@ monitor_initialize(void)
     monitor_begin_process_fcn(NULL, FALSE);
 }
 
+/*
+ *  Copy the times for one startup or shutdown phase into pt.
+ *
+ *  Returns: 0 if the phase has finished, else -1.
+ */
+int
+monitor_get_phase_time(int phase, struct monitor_phase_time *pt)
+{
+    struct monitor_phase *ph;
+
+    if (phase < 0 || phase >= MONITOR_NUM_PHASES || pt == NULL) {
+	return (FAILURE);
+    }
+    memset(pt, 0, sizeof(*pt));
+    ph = &monitor_phase[phase];
+    if (ph->ph_begin == 0 || ph->ph_end == 0) {
+	return (FAILURE);
+    }
+    pt->pt_start = ph->ph_begin - monitor_phase_base;
+    pt->pt_total = ph->ph_end - ph->ph_begin;
+    pt->pt_client = ph->ph_client;
+    pt->pt_calls = ph->ph_calls;
+
+    return (SUCCESS);
+}
+
 /*
  *  Client access to the real _exit().
  *
@@ -448,6 +771,7 @@ monitor_real_sigprocmask(int how, const sigset_t *set,
 			 sigset_t *oldset)
 {
     monitor_normal_init();
+    monitor_sigmask_shadow_reset();
     return (*real_sigprocmask)(how, set, oldset);
 }
 
@@ -466,10 +790,16 @@ monitor_real_fork(void)
     MONITOR_GET_REAL_NAME_WRAP(real_fork, fork);
     MONITOR_DEBUG1("(real)\n");
 
+    monitor_fork_regions_snapshot();
     pid_t ret = (*real_fork)();
     if (ret == 0) {
 	/* child process */
+	monitor_trace_reset();
+	monitor_signal_stats_reset();
+	monitor_phase_reset();
+	monitor_fork_regions_child();
 	monitor_reset_thread_list(&monitor_main_tn);
+	monitor_sample_thread_init();
     }
     return ret;
 #else
@@ -503,6 +833,7 @@ monitor_get_addr_main(void)
 int
 monitor_main(int argc, char **argv, char **envp  AUXVEC_DECL )
 {
+    long long start;
     int ret;
 
     MONITOR_ASM_LABEL(monitor_main_fence1);
@@ -515,7 +846,12 @@ monitor_main(int argc, char **argv, char **envp  AUXVEC_DECL )
     monitor_main_tn.tn_stack_bottom = alloca(8);
     strncpy(monitor_main_tn.tn_stack_bottom, "stakbot", 8);
     monitor_begin_process_fcn(NULL, FALSE);
+
+    monitor_phase_begin(MONITOR_PHASE_AT_MAIN);
+    start = monitor_clock_nsec();
     monitor_at_main();
+    monitor_phase_client(MONITOR_PHASE_AT_MAIN, start);
+    monitor_phase_end(MONITOR_PHASE_AT_MAIN);
 
     MONITOR_ASM_LABEL(monitor_main_fence2);
 #ifdef MONITOR_STATIC
@@ -677,18 +1013,109 @@ monitor_is_threaded(void)
     return (0);
 }
 
+int __attribute__ ((weak))
+monitor_in_vfork_child(void)
+{
+    return (0);
+}
+
+void __attribute__ ((weak))
+monitor_fork_regions_snapshot(void)
+{
+    return;
+}
+
+void __attribute__ ((weak))
+monitor_fork_regions_child(void)
+{
+    return;
+}
+
+void __attribute__ ((weak))
+monitor_fork_lazy_init(void)
+{
+    return;
+}
+
+void __attribute__ ((weak))
+monitor_fork_lazy_due(void)
+{
+    return;
+}
+
+int __attribute__ ((weak))
+monitor_fork_lazy_skip(void)
+{
+    return (0);
+}
+
+int __attribute__ ((weak))
+monitor_set_lazy_fork(int msec)
+{
+    return (-1);
+}
+
+int __attribute__ ((weak))
+monitor_fork_exclude(void *addr, size_t len)
+{
+    return (FAILURE);
+}
+
+int __attribute__ ((weak))
+monitor_fork_include(void *addr)
+{
+    return (FAILURE);
+}
+
+int __attribute__ ((weak))
+monitor_get_fork_excluded(struct monitor_fork_region *regions, int max)
+{
+    return (0);
+}
+
 void * __attribute__ ((weak))
 monitor_get_user_data(void)
 {
     return (monitor_main_tn.tn_user_data);
 }
 
+void * __attribute__ ((weak))
+monitor_get_user_slot(int slot)
+{
+    if (slot < 0 || slot >= MONITOR_USER_SLOTS) {
+	return (NULL);
+    }
+    return (monitor_main_tn.tn_user_slot[slot]);
+}
+
+int __attribute__ ((weak))
+monitor_set_user_slot(int slot, void *data)
+{
+    if (slot < 0 || slot >= MONITOR_USER_SLOTS) {
+	return (FAILURE);
+    }
+    monitor_main_tn.tn_user_slot[slot] = data;
+    return (SUCCESS);
+}
+
 int __attribute__ ((weak))
 monitor_get_thread_num(void)
 {
     return (0);
 }
 
+int __attribute__ ((weak))
+monitor_get_thread_index(void)
+{
+    return (0);
+}
+
+int __attribute__ ((weak))
+monitor_get_max_thread_index(void)
+{
+    return (1);
+}
+
 void * __attribute__ ((weak))
 monitor_get_addr_thread_start(void)
 {
@@ -743,6 +1170,72 @@ monitor_sigaction(int sig, monitor_sighandler_t *handler,
     return (FAILURE);
 }
 
+int __attribute__ ((weak))
+monitor_sigaction_add(int sig, monitor_sighandler_t *handler, int priority)
+{
+    MONITOR_DEBUG1("(weak)\n");
+    return (FAILURE);
+}
+
+int __attribute__ ((weak))
+monitor_sigaction_remove(int sig, monitor_sighandler_t *handler)
+{
+    MONITOR_DEBUG1("(weak)\n");
+    return (FAILURE);
+}
+
+int __attribute__ ((weak))
+monitor_sample_start(int sig, int clock, long period_usec, int flags)
+{
+    MONITOR_DEBUG1("(weak)\n");
+    return (FAILURE);
+}
+
+void __attribute__ ((weak))
+monitor_sample_stop(void)
+{
+    return;
+}
+
+int __attribute__ ((weak))
+monitor_sample_pause(void)
+{
+    return (FAILURE);
+}
+
+int __attribute__ ((weak))
+monitor_sample_resume(void)
+{
+    return (FAILURE);
+}
+
+int __attribute__ ((weak))
+monitor_event_start(int sig, int event, long period)
+{
+    MONITOR_DEBUG1("(weak)\n");
+    return (FAILURE);
+}
+
+void __attribute__ ((weak))
+monitor_event_stop(void)
+{
+    return;
+}
+
+void * __attribute__ ((weak))
+monitor_event_ring(size_t *size)
+{
+    return (NULL);
+}
+
+int __attribute__ ((weak))
+monitor_get_signal_stats(int sig, int thread_index,
+			 struct monitor_signal_stats *stats)
+{
+    MONITOR_DEBUG1("(weak)\n");
+    return (FAILURE);
+}
+
 int __attribute__ ((weak))
 monitor_unwind_thread_bottom_frame(void *addr)
 {
@@ -759,6 +1252,102 @@ monitor_get_tn(void)
     return &monitor_main_tn;
 }
 
+void __attribute__ ((weak))
+monitor_broadcast_relay(int sig, siginfo_t *info)
+{
+    return;
+}
+
+void __attribute__ ((weak))
+monitor_thread_lazy_init(void)
+{
+    return;
+}
+
+void __attribute__ ((weak))
+monitor_thread_lazy_due(void)
+{
+    return;
+}
+
+void __attribute__ ((weak))
+monitor_sample_thread_init(void)
+{
+    return;
+}
+
+void __attribute__ ((weak))
+monitor_main_altstack_init(void)
+{
+    return;
+}
+
+int __attribute__ ((weak))
+monitor_client_signals_used(void)
+{
+    return (0);
+}
+
+int __attribute__ ((weak))
+monitor_client_signal_handled(int sig)
+{
+    return (0);
+}
+
+int __attribute__ ((weak))
+monitor_sigmask_filter_used(void)
+{
+    return (0);
+}
+
+void __attribute__ ((weak))
+monitor_sigmask_shadow_reset(void)
+{
+    return;
+}
+
+int __attribute__ ((weak))
+monitor_sigmask_shadow_enter(void)
+{
+    return (0);
+}
+
+void __attribute__ ((weak))
+monitor_sigmask_shadow_leave(int gen)
+{
+    return;
+}
+
+size_t __attribute__ ((weak))
+monitor_signal_altstack_size(void)
+{
+    return (0);
+}
+
+void __attribute__ ((weak))
+monitor_signal_stats_swallow(int sig)
+{
+    return;
+}
+
+void __attribute__ ((weak))
+monitor_signal_stats_retire(void *block)
+{
+    return;
+}
+
+void __attribute__ ((weak))
+monitor_signal_stats_reset(void)
+{
+    return;
+}
+
+void __attribute__ ((weak))
+monitor_signal_stats_report(void)
+{
+    return;
+}
+
 void __attribute__ ((weak))
 monitor_reset_thread_list(struct monitor_thread_node *main_tn)
 {
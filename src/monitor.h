@@ -46,6 +46,72 @@ enum { MONITOR_EXIT_NORMAL = 1, MONITOR_EXIT_SIGNAL, MONITOR_EXIT_EXEC };
 
 #define MONITOR_IGNORE_NEW_THREAD  ((void *) -1)
 
+/*
+ *  Client signal handlers run in order of priority, lowest first,
+ *  until one returns 0.  monitor_sigaction() uses the default.
+ */
+#define MONITOR_SIG_PRIO_DEFAULT  0
+
+/*
+ *  Clocks and flags for monitor_sample_start().
+ */
+enum { MONITOR_SAMPLE_CPUTIME = 1, MONITOR_SAMPLE_REALTIME,
+       MONITOR_SAMPLE_MONOTONIC };
+
+#define MONITOR_SAMPLE_STAGGER  0x01
+
+/*
+ *  Software events for monitor_event_start().
+ */
+enum { MONITOR_EVENT_TASK_CLOCK = 1, MONITOR_EVENT_CPU_CLOCK,
+       MONITOR_EVENT_PAGE_FAULTS, MONITOR_EVENT_CONTEXT_SWITCHES };
+
+/*
+ *  Signal delivery stats from monitor_get_signal_stats().
+ */
+struct monitor_signal_stats {
+    unsigned long  ss_delivered;     /* signals that reached monitor */
+    unsigned long  ss_client_calls;  /* runs of the client handlers */
+    unsigned long  ss_declined;      /* client returned non-zero */
+    unsigned long  ss_swallowed;     /* taken from sigwait, not returned */
+    unsigned long long  ss_client_cycles;  /* time in client handlers */
+};
+
+/*
+ *  Client memory left out of fork() children, see
+ *  monitor_fork_exclude() and monitor_get_fork_excluded().
+ */
+struct monitor_fork_region {
+    void   *fr_addr;
+    size_t  fr_len;
+};
+
+/*
+ *  Startup and shutdown phases for monitor_get_phase_time().
+ */
+enum { MONITOR_PHASE_INIT_LIBRARY = 0, MONITOR_PHASE_INIT_PROCESS,
+       MONITOR_PHASE_AT_MAIN, MONITOR_PHASE_FIRST_THREAD,
+       MONITOR_PHASE_SHOOTDOWN, MONITOR_PHASE_FINI_PROCESS,
+       MONITOR_PHASE_FINI_LIBRARY, MONITOR_NUM_PHASES };
+
+/*
+ *  Times are in nanoseconds, start is relative to monitor's first
+ *  entry (normally the library constructor).  Client time is summed
+ *  over all threads, so it can exceed total for shootdown.
+ */
+struct monitor_phase_time {
+    long long  pt_start;   /* when the phase began */
+    long long  pt_total;   /* wall time for the phase */
+    long long  pt_client;  /* time in client callbacks */
+    long       pt_calls;   /* number of client callbacks */
+};
+
+/*
+ *  Number of per-thread pointer slots owned by the client, see
+ *  monitor_get_user_slot() and monitor_set_user_slot().
+ */
+#define MONITOR_USER_SLOTS  4
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -100,12 +166,37 @@ extern int monitor_real_pthread_sigmask(int how, const sigset_t *set,
 					sigset_t *oldset);
 extern int monitor_sigaction(int sig, monitor_sighandler_t *handler,
 			     int flags, struct sigaction *act);
+extern int monitor_sigaction_add(int sig, monitor_sighandler_t *handler,
+				 int priority);
+extern int monitor_sigaction_remove(int sig, monitor_sighandler_t *handler);
 extern int monitor_broadcast_signal(int sig);
+extern int monitor_sample_start(int sig, int clock, long period_usec,
+				int flags);
+extern void monitor_sample_stop(void);
+extern int monitor_sample_pause(void);
+extern int monitor_sample_resume(void);
+extern int monitor_event_start(int sig, int event, long period);
+extern void monitor_event_stop(void);
+extern void *monitor_event_ring(size_t *size);
+extern int monitor_trace_dump(void);
+extern int monitor_get_signal_stats(int sig, int thread_index,
+				    struct monitor_signal_stats *stats);
+extern int monitor_set_lazy_fork(int msec);
+extern int monitor_fork_exclude(void *addr, size_t len);
+extern int monitor_fork_include(void *addr);
+extern int monitor_get_fork_excluded(struct monitor_fork_region *regions,
+				     int max);
+extern int monitor_get_phase_time(int phase,
+				  struct monitor_phase_time *pt);
 extern int monitor_is_threaded(void);
 extern void *monitor_get_addr_main(void);
 extern void *monitor_get_addr_thread_start(void);
 extern void *monitor_get_user_data(void);
+extern void *monitor_get_user_slot(int slot);
+extern int monitor_set_user_slot(int slot, void *data);
 extern int monitor_get_thread_num(void);
+extern int monitor_get_thread_index(void);
+extern int monitor_get_max_thread_index(void);
 extern void *monitor_stack_bottom(void);
 extern int monitor_in_start_func_wide(void *addr);
 extern int monitor_in_start_func_narrow(void *addr);
@@ -46,24 +46,43 @@
  *
  *    monitor_is_threaded
  *    monitor_get_user_data
+ *    monitor_get_user_slot
+ *    monitor_set_user_slot
  *    monitor_get_thread_num
+ *    monitor_get_thread_index
+ *    monitor_get_max_thread_index
  *    monitor_stack_bottom
  *    monitor_in_start_func_wide
  *    monitor_in_start_func_narrow
  *    monitor_real_pthread_sigmask
  *    monitor_broadcast_signal
+ *    monitor_sample_start
+ *    monitor_sample_stop
+ *    monitor_sample_pause
+ *    monitor_sample_resume
+ *    monitor_event_start
+ *    monitor_event_stop
+ *    monitor_event_ring
  *    monitor_get_addr_thread_start
  */
 
 #include "config.h"
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 #include <alloca.h>
 #ifdef MONITOR_DYNAMIC
 #include <dlfcn.h>
 #endif
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -73,9 +92,9 @@
 
 #include "common.h"
 #include "monitor.h"
+#include "atomic.h"
+#include "futex.h"
 #include "pthread_h.h"
-#include "queue.h"
-#include "spinlock.h"
 
 /*
  *----------------------------------------------------------------------
@@ -84,7 +103,66 @@
  */
 
 #define MONITOR_TN_ARRAY_SIZE  600
-#define MONITOR_SHOOTDOWN_TIMEOUT  10
+#define MONITOR_SHOOTDOWN_TIMEOUT  10.0
+
+/*
+ *  Broadcast relay: fan-out per thread, the fewest threads that use
+ *  the relay, the most threads in one relay (more are signaled
+ *  directly), and the number of relay records in flight.
+ */
+#if defined(SYS_gettid) && defined(SYS_tgkill) && defined(SYS_rt_tgsigqueueinfo)
+#define MONITOR_USE_RELAY  1
+#endif
+#define MONITOR_RELAY_FANOUT     4
+#define MONITOR_RELAY_MIN       16
+#define MONITOR_RELAY_MAX     4096
+#define MONITOR_RELAY_RING       4
+
+#define MONITOR_RELAY_PEND_BITS  13
+#define MONITOR_RELAY_PEND_MASK  ((1L << MONITOR_RELAY_PEND_BITS) - 1)
+#define MONITOR_RELAY_GEN_MASK   0x3ffffL
+#define MONITOR_SI_RELAY        (-0x6d)
+
+/*
+ *  Per-thread timers for lazy init-thread, from raw syscalls so we
+ *  don't need librt.
+ */
+#if defined(MONITOR_USE_RELAY) && defined(SYS_timer_create) \
+    && defined(SYS_timer_settime) && defined(SYS_timer_delete)
+#define MONITOR_USE_THREAD_TIMER  1
+#endif
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id  _sigev_un._tid
+#endif
+
+/*
+ *  The CPU-time clock for kernel thread tid (what
+ *  pthread_getcpuclockid() returns on Linux), so we can make a CPU
+ *  timer for a thread from another thread.
+ */
+#define MONITOR_THREAD_CPUCLOCK(tid)  ((~(clockid_t) (tid) << 3) | 6)
+
+/*
+ *  Per-thread perf_event software events with mmap ring buffers.
+ *  F_SETSIG and F_SETOWN_EX are only visible with _GNU_SOURCE.
+ */
+#if defined(MONITOR_USE_RELAY) && defined(SYS_perf_event_open) \
+    && defined(PERF_EVENT_IOC_ENABLE)
+#define MONITOR_USE_PERF_EVENTS  1
+#endif
+#ifndef F_SETSIG
+#define F_SETSIG  10
+#endif
+#ifndef F_SETOWN_EX
+#define F_SETOWN_EX  15
+#endif
+#define MONITOR_OWNER_TID  0
+#define MONITOR_EVENT_RING_PAGES  8
+
+struct monitor_owner_ex {
+    int    type;
+    pid_t  pid;
+};
 
 /*
  *  On some systems, pthread_equal() and pthread_cleanup_push/pop()
@@ -133,7 +211,6 @@ typedef int   sigprocmask_fcn_t(int, const sigset_t *, sigset_t *);
 typedef int   sigwaitinfo_fcn_t(const sigset_t *, siginfo_t *);
 typedef int   sigtimedwait_fcn_t(const sigset_t *, siginfo_t *,
 				 const struct timespec *);
-typedef void *malloc_fcn_t(size_t);
 
 #ifdef MONITOR_STATIC
 extern pthread_create_fcn_t  __real_pthread_create;
@@ -166,77 +243,257 @@ static sigaction_fcn_t    *real_sigaction;
 static sigprocmask_fcn_t  *real_pthread_sigmask;
 static sigwaitinfo_fcn_t  *real_sigwaitinfo;
 static sigtimedwait_fcn_t *real_sigtimedwait;
-static malloc_fcn_t  *real_malloc = NULL;
 
 /*
- *  The global thread mutex protects monitor's list of threads and
- *  related state variables.  The values inside a single node don't
- *  really need a mutex.
+ *  The thread registry is a lock-free, singly-linked list of every
+ *  thread node that monitor has handed out.  Nodes are pushed onto
+ *  the head with compare and swap and never removed (except in the
+ *  child after fork), so walking the list is always safe.  A node is
+ *  reused by changing tn_state: FREE -> CLAIMED (pthread_create) ->
+ *  ACTIVE (thread begins) -> RETIRED (thread ends) -> FREE.
+ *
+ *  Walking the list to signal other threads (broadcast, shootdown)
+ *  is a read-side section protected by a two-slot epoch counter.  A
+ *  retired node does not go back to FREE until the epoch has
+ *  advanced twice past its retirement, so no reader can still be
+ *  holding the thread's pthread_t.  Readers never wait, so they are
+ *  safe from inside a signal handler.
+ *
+ *  Nodes come from a slab of chunks: one static chunk and then chunks
+ *  from mmap(), linked through tc_prev so that the child after fork
+ *  can unmap them.  Nodes are cache-line aligned, so tc_pos gets its
+ *  own line.
+ *
+ *  Note: After monitor begins exit cleanup, then we don't retire any
+ *  thread nodes.  Instead, we set the tn_* variables to indicate the
+ *  thread status and when it has finished.
+ */
+struct monitor_tn_chunk {
+    volatile long  tc_pos;
+    struct monitor_tn_chunk *tc_prev;
+    struct monitor_thread_node  tc_node[MONITOR_TN_ARRAY_SIZE];
+};
+
+static struct monitor_tn_chunk monitor_init_tn_chunk;
+static struct monitor_tn_chunk * volatile monitor_tn_chunk = &monitor_init_tn_chunk;
+
+static struct monitor_thread_node * volatile monitor_thread_registry = NULL;
+
+/*
+ *  Free nodes are also on a stack through tn_free_next, so a new
+ *  thread doesn't have to scan the whole registry for one.  Pop runs
+ *  inside a registry read section and a node is only pushed back
+ *  after a grace period, so a node can't be popped and pushed again
+ *  while another thread is still in the middle of a pop (no ABA).
  *
- *  Note: After monitor begins exit cleanup, then we don't insert or
- *  delete any new thread nodes into the list.  Instead, we set the
- *  tn_* variables to indicate the thread status and when it has
- *  finished.
+ *  Retired nodes wait out the grace period on a second stack, also
+ *  through tn_free_next, stamped with the epoch when they retired.
+ *  The next pthread_create() moves the ones that are past it to the
+ *  free list, so nobody waits for the epoch to advance.
+ */
+static struct monitor_thread_node * volatile monitor_free_list = NULL;
+static struct monitor_thread_node * volatile monitor_retired_list = NULL;
+
+/*
+ *  Alternate signal stacks (MONITOR_ALTSTACK_SIZE) come from mmap
+ *  regions of MONITOR_ALTSTACK_BATCH stacks, each with a guard page
+ *  below it.  The first page of the region holds the next free
+ *  position.  A stack stays with its thread node and is reused with
+ *  the node, so regions are never unmapped (not even at fork, where
+ *  this thread may be using one).
  */
-#define MONITOR_THREAD_LOCK     spinlock_lock(&monitor_thread_lock)
-#define MONITOR_THREAD_TRYLOCK  spinlock_trylock(&monitor_thread_lock)
-#define MONITOR_THREAD_UNLOCK   spinlock_unlock(&monitor_thread_lock)
+#define MONITOR_ALTSTACK_BATCH  32
 
-static spinlock_t monitor_thread_lock = SPINLOCK_UNLOCKED;
+struct monitor_altstack_region {
+    volatile long  ar_pos;
+};
 
-static struct monitor_thread_node monitor_init_tn_array[MONITOR_TN_ARRAY_SIZE];
-static struct monitor_thread_node *monitor_tn_array = &monitor_init_tn_array[0];
-static int monitor_tn_array_pos = 0;
+static struct monitor_altstack_region * volatile monitor_altstack_region = NULL;
+static size_t monitor_altstack_size = 0;
+static size_t monitor_altstack_pagesize = 4096;
 
-static LIST_HEAD(, monitor_thread_node) monitor_thread_list;
-static LIST_HEAD(, monitor_thread_node) monitor_free_list;
+volatile static long monitor_registry_epoch = 0;
+volatile static long monitor_registry_readers[2] = { 0, 0 };
 
-volatile static int  monitor_thread_num = 0;
-volatile static char monitor_in_exit_cleanup = 0;
+volatile static long monitor_thread_num = 0;
+volatile static long monitor_thread_index_num = 1;
+volatile static long monitor_in_exit_cleanup = 0;
 
-/***  End of mutex-protected variables.  ***/
+/*
+ *  Shootdown waits on monitor_shootdown_futex until the count of
+ *  outstanding fini-thread callbacks drops to zero.  A thread is
+ *  counted once (tn_fini_wait) and the thread that finishes the last
+ *  callback does the wakeup.
+ */
+volatile static long monitor_fini_outstanding = 0;
+volatile static int  monitor_shootdown_futex = 0;
+static long long monitor_shootdown_timeout = 0;
 
 static pthread_key_t monitor_pthread_key;
 
+#ifdef MONITOR_USE_TLS
+static __thread struct monitor_thread_node *monitor_my_tn
+    __attribute__ ((tls_model ("initial-exec"))) = NULL;
+#endif
+
 volatile static char monitor_has_used_threads = 0;
 volatile static char monitor_thread_support_done = 0;
 volatile static char monitor_fini_thread_done = 0;
 static int shootdown_signal = 0;
 
+/*
+ *  The thread callbacks that the client overrides.  If none, and the
+ *  client has no signal handlers (so it won't broadcast or sample),
+ *  then pthread_create() passes straight through to the real
+ *  function.  Debug mode always takes the full path.
+ */
+static int monitor_thread_cb = MONITOR_CB_ALL_THREAD;
+
+/*
+ *  Lazy init-thread (MONITOR_LAZY_INIT_THREAD): -1 for off, else the
+ *  lifetime in msec after which a thread gets init-thread anyway (0
+ *  for no limit).
+ */
+static int monitor_lazy_msec = -1;
+static int monitor_lazy_signal = -1;
+
+/*
+ *  Sampling timers from monitor_sample_start(): the signal (-1 for
+ *  off), clock type, period in nsec and flags.  Each thread's timer
+ *  is in tn_sample_timer as the timer id + 1 (0 for none).
+ */
+static volatile int monitor_sample_signal = -1;
+static int monitor_sample_clock = 0;
+static long long monitor_sample_period = 0;
+static int monitor_sample_flags = 0;
+
+/*
+ *  Software events from monitor_event_start(): the overflow signal
+ *  (-1 for off), perf event config, sample period and the ring size
+ *  in pages (not counting the header page).  Each thread's event is
+ *  in tn_event_fd as the fd + 1 and its ring in tn_event_ring.
+ */
+static volatile long monitor_event_started = 0;
+static volatile int monitor_event_signal = -1;
+static int monitor_event_config = 0;
+static long monitor_event_period = 0;
+static int monitor_event_pages = MONITOR_EVENT_RING_PAGES;
+
+#ifdef MONITOR_USE_RELAY
+/*
+ *  One broadcast's list of threads.  Thread i in the list relays the
+ *  signal to threads FANOUT*(i+1) through FANOUT*(i+1)+FANOUT-1.  The
+ *  relay value in si_value holds the generation and the index.
+ *
+ *  mr_state is the generation (high bits) and the number of entries
+ *  not yet accounted for (low bits), or 0 if the record is free.
+ *  Each entry is accounted for once, either by its own thread after
+ *  it relays, or by its parent if the parent couldn't signal it.  So
+ *  the record (and the thread nodes in it) stays pinned until the
+ *  whole tree is done, and a new broadcast can't overwrite it.  If
+ *  the record is still busy, the next broadcast that wants it signals
+ *  every thread directly.
+ */
+struct monitor_relay {
+    volatile long  mr_state;
+    int    mr_sig;
+    int    mr_num;
+    pid_t  mr_tid[MONITOR_RELAY_MAX];
+    struct monitor_thread_node *mr_tn[MONITOR_RELAY_MAX];
+};
+
+static struct monitor_relay monitor_relay_ring[MONITOR_RELAY_RING];
+volatile static long monitor_relay_gen = 0;
+#endif
+
 extern char monitor_thread_fence1;
 extern char monitor_thread_fence2;
 extern char monitor_thread_fence3;
 extern char monitor_thread_fence4;
 
+static void monitor_registry_push(struct monitor_thread_node *);
+static void monitor_mark_fini_done(struct monitor_thread_node *);
+static void monitor_reclaim_tn_chunks(void);
+static void monitor_shootdown_track(struct monitor_thread_node *);
+static void monitor_lazy_handler(int);
+static void monitor_altstack_init(void);
+static void monitor_sample_delete(struct monitor_thread_node *);
+static void monitor_event_release(struct monitor_thread_node *, int);
+
 /*
  *----------------------------------------------------------------------
  *  INTERNAL THREAD FUNCTIONS
  *----------------------------------------------------------------------
  */
 
+/*
+ *  Returns: the kernel thread id, or 0 if not available.
+ */
+static inline pid_t
+monitor_gettid(void)
+{
+#ifdef MONITOR_USE_RELAY
+    return (pid_t) syscall(SYS_gettid);
+#else
+    return (0);
+#endif
+}
+
+/*
+ *  Set the calling thread's node in both the TLS pointer and the
+ *  thread-specific data.
+ *
+ *  Returns: 0 on success, or else the pthread_setspecific() error.
+ */
+static int
+monitor_set_my_tn(struct monitor_thread_node *tn)
+{
+#ifdef MONITOR_USE_TLS
+    monitor_my_tn = tn;
+#endif
+    return (*real_pthread_setspecific)(monitor_pthread_key, tn);
+}
+
 /*
  *  Note: there is a tiny window where a thread exists but its thread-
  *  specific data is not yet set, so it's not really an error for
  *  getspecific to fail.  But bad magic implies an internal error.
+ *
+ *  The TLS pointer is only set by monitor itself, so we trust it
+ *  without checking the magic number.  This is the path that runs
+ *  inside the client's signal handlers.
  */
-struct monitor_thread_node *
-monitor_get_tn(void)
+static inline struct monitor_thread_node *
+monitor_fast_get_tn(void)
 {
     struct monitor_thread_node *tn;
 
-    if (monitor_has_used_threads) {
-	tn = (*real_pthread_getspecific)(monitor_pthread_key);
-	if (tn != NULL && tn->tn_magic != MONITOR_TN_MAGIC) {
-	    MONITOR_WARN_NO_TID("bad magic in thread node: %p\n", tn);
-	    tn = NULL;
-	}
-    } else {
-	tn = monitor_get_main_tn();
+    if (! monitor_has_used_threads) {
+	return monitor_get_main_tn();
+    }
+
+#ifdef MONITOR_USE_TLS
+    tn = monitor_my_tn;
+    if (tn != NULL) {
+	return (tn);
+    }
+#endif
+
+    tn = (*real_pthread_getspecific)(monitor_pthread_key);
+    if (tn != NULL && tn->tn_magic != MONITOR_TN_MAGIC) {
+	MONITOR_WARN_NO_TID("bad magic in thread node: %p\n", tn);
+	tn = NULL;
     }
 
     return (tn);
 }
 
+struct monitor_thread_node *
+monitor_get_tn(void)
+{
+    return monitor_fast_get_tn();
+}
+
 static void
 monitor_thread_name_init(void)
 {
@@ -272,6 +529,73 @@ monitor_thread_name_init(void)
     MONITOR_GET_REAL_NAME_WRAP(real_sigtimedwait, sigtimedwait);
 }
 
+/*
+ *  Allow MONITOR_SHOOTDOWN_TIMEOUT to set the number of seconds (may
+ *  be fractional) that shootdown waits without any thread starting
+ *  its fini-thread callback before it gives up.
+ */
+static void
+monitor_shootdown_timeout_init(void)
+{
+    char *str;
+    double secs;
+
+    secs = MONITOR_SHOOTDOWN_TIMEOUT;
+    str = getenv("MONITOR_SHOOTDOWN_TIMEOUT");
+    if (str != NULL) {
+	if (sscanf(str, "%lf", &secs) < 1 || secs <= 0.0) {
+	    MONITOR_WARN("bad value for MONITOR_SHOOTDOWN_TIMEOUT: %s\n", str);
+	    secs = MONITOR_SHOOTDOWN_TIMEOUT;
+	}
+    }
+    monitor_shootdown_timeout = (long long) (secs * 1000000000.0);
+    MONITOR_DEBUG("shootdown timeout: %g sec\n", secs);
+}
+
+/*
+ *  Set up lazy init-thread from MONITOR_LAZY_INIT_THREAD.  If set,
+ *  then a new thread gets its monitor_init_thread() callback on the
+ *  first call to monitor_get_user_data() or client signal (sample)
+ *  in that thread.  A thread that exits first gets neither
+ *  init-thread nor fini-thread, unless it ran for longer than the
+ *  lifetime in msec (0 for no limit), and then it gets both at exit.
+ *
+ *  The lifetime timer uses the shootdown signal, which is otherwise
+ *  unused until exit.  It only marks the thread as due.
+ */
+static void
+monitor_lazy_init_setup(void)
+{
+    struct sigaction action;
+    char *str;
+    int msec;
+
+    str = getenv("MONITOR_LAZY_INIT_THREAD");
+    if (str == NULL) {
+	return;
+    }
+    if (sscanf(str, "%d", &msec) < 1 || msec < 0) {
+	MONITOR_WARN("bad value for MONITOR_LAZY_INIT_THREAD: %s\n", str);
+	return;
+    }
+    monitor_lazy_msec = msec;
+    MONITOR_DEBUG("lazy init-thread, lifetime: %d msec\n", msec);
+
+#ifdef MONITOR_USE_THREAD_TIMER
+    if (msec > 0) {
+	monitor_lazy_signal = monitor_shootdown_signal();
+	action.sa_handler = monitor_lazy_handler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	if (monitor_lazy_signal <= 0
+	    || (*real_sigaction)(monitor_lazy_signal, &action, NULL) != 0) {
+	    MONITOR_WARN1("unable to install lazy init-thread timer signal\n");
+	    monitor_lazy_signal = -1;
+	}
+    }
+#endif
+}
+
 /*
  *  Run in the main thread on the first call to pthread_create(),
  *  before any new threads are created.  Only called once from the
@@ -289,11 +613,17 @@ monitor_thread_list_init(void)
      */
     monitor_early_init();
     monitor_thread_name_init();
-
-    MONITOR_DEBUG1("\n");
-    LIST_INIT(&monitor_thread_list);
-    LIST_INIT(&monitor_free_list);
-    monitor_tn_array_pos = 0;
+    monitor_shootdown_timeout_init();
+    monitor_lazy_init_setup();
+    monitor_altstack_init();
+
+    monitor_thread_cb = monitor_debug ? MONITOR_CB_ALL_THREAD
+	: monitor_client_thread_callbacks();
+    MONITOR_DEBUG("client thread callbacks: 0x%x\n", monitor_thread_cb);
+    monitor_thread_registry = NULL;
+    monitor_registry_epoch = 0;
+    monitor_registry_readers[0] = 0;
+    monitor_registry_readers[1] = 0;
 
     ret = (*real_pthread_key_create)(&monitor_pthread_key, NULL);
     if (ret != 0) {
@@ -307,10 +637,17 @@ monitor_thread_list_init(void)
 	MONITOR_ERROR1("monitor_get_main_tn failed\n");
     }
     main_tn->tn_self = (*real_pthread_self)();
-    ret = (*real_pthread_setspecific)(monitor_pthread_key, main_tn);
+    main_tn->tn_ktid = getpid();
+    ret = monitor_set_my_tn(main_tn);
     if (ret != 0) {
 	MONITOR_ERROR("pthread_setspecific failed (%d)\n", ret);
     }
+    /*
+     * Main is always on the registry, but it never retires and it
+     * only gets fini-thread if another thread calls exit.
+     */
+    main_tn->tn_state = MONITOR_TN_ACTIVE;
+    monitor_registry_push(main_tn);
 }
 
 /*
@@ -324,10 +661,23 @@ void
 monitor_reset_thread_list(struct monitor_thread_node *main_tn)
 {
     struct monitor_thread_node *tn;
+#ifdef MONITOR_USE_RELAY
+    int k;
+#endif
 
+    /*
+     * The child doesn't inherit the parent's timers or event rings,
+     * but it does inherit the event fds, so close them.
+     */
+    main_tn->tn_sample_timer = 0;
+    monitor_event_release(main_tn, 0);
     if (! monitor_has_used_threads)
 	return;
 
+    for (tn = monitor_thread_registry; tn != NULL; tn = tn->tn_next) {
+	monitor_event_release(tn, 0);
+    }
+
     MONITOR_DEBUG1("\n");
     /*
      * The thread that fork()ed is now the main thread.
@@ -342,16 +692,32 @@ monitor_reset_thread_list(struct monitor_thread_node *main_tn)
 	main_tn->tn_tid = 0;
 	main_tn->tn_user_data = tn->tn_user_data;
 	main_tn->tn_stack_bottom = tn->tn_stack_bottom;
+	memcpy(main_tn->tn_user_slot, tn->tn_user_slot,
+	       sizeof(main_tn->tn_user_slot));
 	main_tn->tn_is_main = 1;
     }
+    main_tn->tn_ktid = getpid();
+#ifdef MONITOR_USE_TLS
+    monitor_my_tn = main_tn;
+#endif
     /*
-     * Free the thread list and the pthread key.  Technically, this
-     * could leak memory, but only if the process spawns more than 150
-     * threads before fork()ing.
+     * Free the thread registry, the node chunks and the pthread key.
+     * The other threads are gone, and the cleanup routine for this
+     * thread's old node won't touch it (it's not our node anymore).
      */
-    LIST_INIT(&monitor_thread_list);
-    LIST_INIT(&monitor_free_list);
-    monitor_tn_array_pos = 0;
+    monitor_thread_registry = NULL;
+    monitor_free_list = NULL;
+    monitor_retired_list = NULL;
+    monitor_reclaim_tn_chunks();
+    monitor_thread_index_num = 1;
+#ifdef MONITOR_USE_RELAY
+    for (k = 0; k < MONITOR_RELAY_RING; k++) {
+	monitor_relay_ring[k].mr_state = 0;
+    }
+#endif
+    monitor_registry_epoch = 0;
+    monitor_registry_readers[0] = 0;
+    monitor_registry_readers[1] = 0;
     if ((*real_pthread_key_delete)(monitor_pthread_key) != 0) {
 	MONITOR_WARN1("pthread_key_delete failed\n");
     }	
@@ -359,437 +725,1880 @@ monitor_reset_thread_list(struct monitor_thread_node *main_tn)
 }
 
 /*
- *  Try in order: (1) the free list, (2) the pre-allocated tn array,
- *  (3) malloc a new tn array.
+ *  Push a new node onto the head of the registry.  Nodes are never
+ *  popped, so there is no ABA problem.
  */
-static struct monitor_thread_node *
-monitor_make_thread_node(void)
+static void
+monitor_registry_push(struct monitor_thread_node *tn)
 {
-    struct monitor_thread_node *tn;
+    struct monitor_thread_node *head;
+
+    do {
+	head = monitor_thread_registry;
+	tn->tn_next = head;
+    } while (compare_and_swap_ptr((void * volatile *) &monitor_thread_registry,
+				  head, tn) != head);
+}
 
-    MONITOR_THREAD_LOCK;
+/*
+ *  Begin and end a read-side section for walking the registry.  The
+ *  reader counts itself in the slot for the current epoch and then
+ *  rechecks the epoch, so it can't slip in behind an advance.
+ *
+ *  Returns: the epoch to pass to monitor_registry_exit().
+ */
+static inline long
+monitor_registry_enter(void)
+{
+    long epoch;
 
-    tn = LIST_FIRST(&monitor_free_list);
-    if (tn != NULL) {
-	/* Use the head of the free list. */
-	LIST_REMOVE(tn, tn_links);
-    }
-    else if (monitor_tn_array_pos < MONITOR_TN_ARRAY_SIZE) {
-	/* Use the next element in the tn array. */
-	tn = &monitor_tn_array[monitor_tn_array_pos];
-	monitor_tn_array_pos++;
-    }
-    else {
-	/* Malloc a new tn array. */
-	MONITOR_GET_REAL_NAME(real_malloc, malloc);
-	monitor_tn_array =
-	    (*real_malloc)(MONITOR_TN_ARRAY_SIZE * sizeof(struct monitor_thread_node));
-	if (monitor_tn_array == NULL) {
-	    MONITOR_ERROR1("malloc failed\n");
+    for (;;) {
+	epoch = monitor_registry_epoch;
+	fetch_and_add(&monitor_registry_readers[epoch & 1], 1);
+	if (monitor_registry_epoch == epoch) {
+	    return (epoch);
 	}
-	tn = &monitor_tn_array[0];
-	monitor_tn_array_pos = 1;
+	fetch_and_add(&monitor_registry_readers[epoch & 1], -1);
     }
+}
 
-    memset(tn, 0, sizeof(struct monitor_thread_node));
-    tn->tn_magic = MONITOR_TN_MAGIC;
-    tn->tn_tid = -1;
-
-    MONITOR_THREAD_UNLOCK;
-    return (tn);
+static inline void
+monitor_registry_exit(long epoch)
+{
+    fetch_and_add(&monitor_registry_readers[epoch & 1], -1);
 }
 
 /*
- *  Returns: 0 on success, or 1 if at exit cleanup and thus we don't
- *  allow any new threads.
+ *  Advance the epoch from E to E+1 if there are no readers left from
+ *  epoch E-1 (same slot as E+1).
+ *
+ *  Returns: the current epoch.
  */
-static int
-monitor_link_thread_node(struct monitor_thread_node *tn)
+static long
+monitor_registry_advance(void)
 {
-    MONITOR_THREAD_LOCK;
+    long epoch = monitor_registry_epoch;
 
-    if (monitor_in_exit_cleanup) {
-	MONITOR_THREAD_UNLOCK;
-	return (1);
+    if (monitor_registry_readers[(epoch + 1) & 1] == 0) {
+	compare_and_swap(&monitor_registry_epoch, epoch, epoch + 1);
     }
-    tn->tn_tid = ++monitor_thread_num;
-    LIST_INSERT_HEAD(&monitor_thread_list, tn, tn_links);
-
-    MONITOR_THREAD_UNLOCK;
-    return (0);
+    return (monitor_registry_epoch);
 }
 
+/*
+ *  Reset a reused node for a new thread.  Fresh nodes from the slab
+ *  are already zero, and pthread_create() and monitor_begin_thread()
+ *  overwrite the rest, so this is only the fields that a thread
+ *  leaves behind.  Other threads may be walking through tn_next.
+ */
 static void
-monitor_unlink_thread_node(struct monitor_thread_node *tn)
+monitor_reset_thread_node(struct monitor_thread_node *tn)
 {
-    MONITOR_THREAD_LOCK;
-    /*
-     * Don't delete the thread node if in exit cleanup, just mark the
-     * node as finished.
-     */
-    if (monitor_in_exit_cleanup) {
-	tn->tn_fini_started = 1;
-	tn->tn_fini_done = 1;
-    } else {
-	LIST_REMOVE(tn, tn_links);
-	memset(tn, 0, sizeof(struct monitor_thread_node));
-	LIST_INSERT_HEAD(&monitor_free_list, tn, tn_links);
+    int k;
+
+    tn->tn_thread_info = NULL;
+    for (k = 0; k < MONITOR_USER_SLOTS; k++) {
+	tn->tn_user_slot[k] = NULL;
     }
-    MONITOR_THREAD_UNLOCK;
+    tn->tn_fini_wait = 0;
+    tn->tn_init_state = MONITOR_INIT_DONE;
+    tn->tn_has_timer = 0;
+    tn->tn_ignore_threads = 0;
+    tn->tn_passthru = 0;
+    tn->tn_appl_started = 0;
+    tn->tn_fini_started = 0;
+    tn->tn_fini_done = 0;
+    tn->tn_exit_win = 0;
+    tn->tn_block_shootdown = 0;
 }
 
-static void
-monitor_shootdown_handler(int sig)
+/*
+ *  Returns: a new zero-filled chunk from mmap().
+ */
+static struct monitor_tn_chunk *
+monitor_new_tn_chunk(void)
 {
-    struct monitor_thread_node *tn;
-    int old_state;
+    struct monitor_tn_chunk *chunk;
 
-    tn = (*real_pthread_getspecific)(monitor_pthread_key);
-    if (tn == NULL) {
-	MONITOR_WARN1("unable to deliver monitor_fini_thread callback: "
-		      "pthread_getspecific() failed\n");
-	return;
-    }
-    if (tn->tn_magic != MONITOR_TN_MAGIC) {
-	MONITOR_WARN1("unable to deliver monitor_fini_thread callback: "
-		      "bad magic in thread node\n");
-	return;
-    }
-    if (!tn->tn_appl_started || tn->tn_fini_started || tn->tn_block_shootdown) {
-	/* fini-thread has already run, or else we don't want it to run. */
-	return;
-    }
-    if (monitor_fini_thread_done) {
-	MONITOR_WARN("unable to deliver monitor_fini_thread callback (tid %d): "
-		     "monitor_fini_process() has begun\n", tn->tn_tid);
-	return;
+    chunk = mmap(NULL, sizeof(struct monitor_tn_chunk), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (chunk == MAP_FAILED) {
+	MONITOR_ERROR1("mmap failed\n");
     }
-
-    (*real_pthread_setcancelstate)(PTHREAD_CANCEL_DISABLE, &old_state);
-    tn->tn_fini_started = 1;
-    MONITOR_DEBUG("calling monitor_fini_thread(data = %p), tid = %d ...\n",
-		  tn->tn_user_data, tn->tn_tid);
-    monitor_fini_thread(tn->tn_user_data);
-    tn->tn_fini_done = 1;
-    (*real_pthread_setcancelstate)(old_state, NULL);
+    return (chunk);
 }
 
-#if 0
 /*
- *  Call monitor_thread_support.
+ *  Unmap all the chunks from mmap() and go back to the static chunk.
+ *  Only safe when no other threads can be using any node.
  */
-static inline void
-monitor_call_thread_support(void)
+static void
+monitor_reclaim_tn_chunks(void)
 {
-    if (monitor_thread_support_done) {
-	MONITOR_WARN1("attempted to call thread support twice\n");
-	return;
+    struct monitor_tn_chunk *chunk, *prev;
+
+    for (chunk = monitor_tn_chunk; chunk != &monitor_init_tn_chunk; chunk = prev) {
+	prev = chunk->tc_prev;
+	munmap(chunk, sizeof(struct monitor_tn_chunk));
     }
-    MONITOR_DEBUG1("calling monitor_init_thread_support() ...\n");
-    monitor_init_thread_support();
-    monitor_thread_support_done = 1;
+    memset(&monitor_init_tn_chunk, 0, sizeof(struct monitor_tn_chunk));
+    monitor_tn_chunk = &monitor_init_tn_chunk;
 }
 
 /*
- *  Called from main.c at begin process time to release threads
- *  waiting on deferred thread support.
+ *  Returns: a node from the free list, or else NULL if empty.
  */
-void
-monitor_thread_release(void)
+static struct monitor_thread_node *
+monitor_free_list_pop(void)
 {
-    if (monitor_has_used_threads)
-	monitor_call_thread_support();
+    struct monitor_thread_node *tn, *next;
+    long epoch;
 
-    monitor_has_reached_main = 1;
+    epoch = monitor_registry_enter();
+    do {
+	tn = monitor_free_list;
+	if (tn == NULL) {
+	    break;
+	}
+	next = tn->tn_free_next;
+    } while (compare_and_swap_ptr((void * volatile *) &monitor_free_list,
+				  tn, next) != tn);
+    monitor_registry_exit(epoch);
+
+    return (tn);
+}
+
+static void
+monitor_node_stack_push(struct monitor_thread_node * volatile *list,
+			struct monitor_thread_node *tn)
+{
+    struct monitor_thread_node *head;
+
+    do {
+	head = *list;
+	tn->tn_free_next = head;
+    } while (compare_and_swap_ptr((void * volatile *) list, head, tn) != head);
 }
-#endif
 
 /*
- *  Called from main.c at end process time for possible thread cleanup.
- *  Note: main doesn't know if application is threaded or not.
+ *  Put a RETIRED node on the retired list, stamped with the current
+ *  epoch.  The node is no longer reachable from the free list, so any
+ *  pop that could still see it began by this epoch.
  */
-void
-monitor_thread_shootdown(void)
+static void
+monitor_retired_list_push(struct monitor_thread_node *tn)
 {
-    struct timeval last, now;
-    struct monitor_thread_node *tn, *my_tn, *main_tn;
-    struct sigaction my_action;
-    sigset_t empty_set;
-    pthread_t self;
-    int num_started, num_unstarted, last_started;
-    int num_finished, num_unfinished, old_state;
+    tn->tn_retire_epoch = monitor_registry_epoch;
+    monitor_node_stack_push(&monitor_retired_list, tn);
+}
 
-    if (! monitor_has_used_threads) {
-	MONITOR_DEBUG1("(no threads)\n");
-	return;
-    }
+/*
+ *  Take the whole retired list and move every node that is two
+ *  epochs past its retirement to the free list, and put the rest
+ *  back.  Taking the whole list (swap to NULL) doesn't read through
+ *  the head, so it has no ABA problem.
+ */
+static void
+monitor_retired_list_drain(void)
+{
+    struct monitor_thread_node *tn, *next;
+    long epoch;
 
-    (*real_pthread_setcancelstate)(PTHREAD_CANCEL_DISABLE, &old_state);
+    do {
+	tn = monitor_retired_list;
+	if (tn == NULL) {
+	    return;
+	}
+    } while (compare_and_swap_ptr((void * volatile *) &monitor_retired_list,
+				  tn, NULL) != tn);
+
+    epoch = monitor_registry_advance();
+    for (; tn != NULL; tn = next) {
+	next = tn->tn_free_next;
+	if (epoch >= tn->tn_retire_epoch + 2) {
+	    tn->tn_state = MONITOR_TN_FREE;
+	    monitor_node_stack_push(&monitor_free_list, tn);
+	} else {
+	    monitor_node_stack_push(&monitor_retired_list, tn);
+	}
+    }
+}
 
-    MONITOR_THREAD_LOCK;
-    monitor_in_exit_cleanup = 1;
-    MONITOR_THREAD_UNLOCK;
+/*
+ *  Try in order: (1) pop a node from the free list, (2) the next
+ *  node in the current chunk, (3) mmap a new chunk.  A new node is
+ *  pushed onto the registry in the CLAIMED state.
+ */
+static struct monitor_thread_node *
+monitor_make_thread_node(void)
+{
+    struct monitor_tn_chunk *chunk, *new_chunk;
+    struct monitor_thread_node *tn;
+    long pos;
+
+    monitor_retired_list_drain();
+    tn = monitor_free_list_pop();
+    if (tn != NULL) {
+	tn->tn_state = MONITOR_TN_CLAIMED;
+	monitor_reset_thread_node(tn);
+	tn->tn_tid = -1;
+	return (tn);
+    }
+
+    for (;;) {
+	chunk = monitor_tn_chunk;
+	pos = fetch_and_add(&chunk->tc_pos, 1);
+	if (pos < MONITOR_TN_ARRAY_SIZE) {
+	    tn = &chunk->tc_node[pos];
+	    break;
+	}
+	/*
+	 * Map a new chunk.  If another thread beat us to it, then
+	 * unmap ours and try again.
+	 */
+	new_chunk = monitor_new_tn_chunk();
+	new_chunk->tc_pos = 1;
+	new_chunk->tc_prev = chunk;
+	if (compare_and_swap_ptr((void * volatile *) &monitor_tn_chunk,
+				 chunk, new_chunk) == chunk) {
+	    tn = &new_chunk->tc_node[0];
+	    break;
+	}
+	munmap(new_chunk, sizeof(struct monitor_tn_chunk));
+    }
+
+    tn->tn_state = MONITOR_TN_CLAIMED;
+    tn->tn_magic = MONITOR_TN_MAGIC;
+    tn->tn_tid = -1;
+    tn->tn_index = fetch_and_add(&monitor_thread_index_num, 1);
+    monitor_registry_push(tn);
+
+    return (tn);
+}
+
+/*
+ *  Return a node that never became active (pthread_create failed).
+ *  It still goes through the grace period, another thread may be in
+ *  a free list pop that read it.
+ */
+static void
+monitor_free_thread_node(struct monitor_thread_node *tn)
+{
+    tn->tn_state = MONITOR_TN_RETIRED;
+    monitor_retired_list_push(tn);
+}
+
+/*
+ *  Make the node visible to broadcast and shootdown.
+ *
+ *  Returns: 0 on success, or 1 if at exit cleanup and thus we don't
+ *  allow any new threads.
+ */
+static int
+monitor_link_thread_node(struct monitor_thread_node *tn)
+{
+    tn->tn_tid = fetch_and_add(&monitor_thread_num, 1) + 1;
+    compare_and_swap(&tn->tn_state, MONITOR_TN_CLAIMED, MONITOR_TN_ACTIVE);
+
+    /*
+     * Pairs with shootdown: either we see the exit flag here, or
+     * else shootdown sees this node as active (but not started).
+     */
+    if (monitor_in_exit_cleanup) {
+	tn->tn_fini_started = 1;
+	tn->tn_fini_done = 1;
+	return (1);
+    }
+
+    return (0);
+}
+
+/*
+ *  Get the alternate signal stack size from signal.c, rounded up to
+ *  whole pages.
+ */
+static void
+monitor_altstack_init(void)
+{
+    size_t size;
+    long pagesize;
+
+    size = monitor_signal_altstack_size();
+    if (size == 0) {
+	return;
+    }
+#ifdef _SC_PAGESIZE
+    if ((pagesize = sysconf(_SC_PAGESIZE)) > 0) {
+	monitor_altstack_pagesize = pagesize;
+    }
+#endif
+    pagesize = monitor_altstack_pagesize;
+    monitor_altstack_size = ((size + pagesize - 1) / pagesize) * pagesize;
+}
+
+/*
+ *  Map a new region of alternate stacks and protect the guard pages.
+ *
+ *  Returns: the region, or else NULL if out of memory.
+ */
+static struct monitor_altstack_region *
+monitor_new_altstack_region(void)
+{
+    struct monitor_altstack_region *region;
+    size_t stride = monitor_altstack_size + monitor_altstack_pagesize;
+    char *guard;
+    int k;
+
+    region = mmap(NULL, monitor_altstack_pagesize + MONITOR_ALTSTACK_BATCH * stride,
+		  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (region == MAP_FAILED) {
+	MONITOR_WARN1("mmap failed: no alternate signal stack\n");
+	return (NULL);
+    }
+    guard = (char *) region + monitor_altstack_pagesize;
+    for (k = 0; k < MONITOR_ALTSTACK_BATCH; k++) {
+	mprotect(guard + k * stride, monitor_altstack_pagesize, PROT_NONE);
+    }
+    return (region);
+}
+
+/*
+ *  Returns: an unused alternate stack from the current region, or
+ *  from a new region if that one is used up.
+ */
+static void *
+monitor_altstack_get(void)
+{
+    struct monitor_altstack_region *region, *new_region;
+    size_t stride = monitor_altstack_size + monitor_altstack_pagesize;
+    long pos;
+
+    for (;;) {
+	region = monitor_altstack_region;
+	if (region != NULL) {
+	    pos = fetch_and_add(&region->ar_pos, 1);
+	    if (pos < MONITOR_ALTSTACK_BATCH) {
+		break;
+	    }
+	}
+	new_region = monitor_new_altstack_region();
+	if (new_region == NULL) {
+	    return (NULL);
+	}
+	new_region->ar_pos = 1;
+	if (compare_and_swap_ptr((void * volatile *) &monitor_altstack_region,
+				 region, new_region) == region) {
+	    region = new_region;
+	    pos = 0;
+	    break;
+	}
+	munmap(new_region, monitor_altstack_pagesize
+	       + MONITOR_ALTSTACK_BATCH * stride);
+    }
+
+    return ((char *) region + monitor_altstack_pagesize + pos * stride
+	    + monitor_altstack_pagesize);
+}
+
+/*
+ *  Give the new thread its node's alternate signal stack, so client
+ *  handlers (SA_ONSTACK) don't run on the application's stack.
+ */
+static void
+monitor_altstack_setup(struct monitor_thread_node *tn)
+{
+    stack_t ss;
+
+    if (monitor_altstack_size == 0) {
+	return;
+    }
+    if (tn->tn_altstack == NULL) {
+	tn->tn_altstack = monitor_altstack_get();
+	if (tn->tn_altstack == NULL) {
+	    return;
+	}
+    }
+    ss.ss_sp = tn->tn_altstack;
+    ss.ss_size = monitor_altstack_size;
+    ss.ss_flags = 0;
+    if (sigaltstack(&ss, NULL) != 0) {
+	MONITOR_WARN("sigaltstack failed, tid = %d\n", tn->tn_tid);
+    }
+}
+
+/*
+ *  Called from monitor_begin_process_fcn() to give the main thread an
+ *  alternate stack from the same pool.  If main already has one (the
+ *  application's, or inherited from the thread that forked), then
+ *  leave it alone.
+ */
+void
+monitor_main_altstack_init(void)
+{
+    stack_t ss;
+
+    monitor_altstack_init();
+    if (monitor_altstack_size == 0) {
+	return;
+    }
+    if (sigaltstack(NULL, &ss) == 0 && !(ss.ss_flags & SS_DISABLE)) {
+	MONITOR_DEBUG1("main already has an alternate signal stack\n");
+	return;
+    }
+    monitor_altstack_setup(monitor_get_main_tn());
+}
+
+/*
+ *  Stop using the alternate stack before the node (and its stack)
+ *  can be reused.  If we're still on it (exit from inside a
+ *  handler), then leave the stack behind.
+ */
+static void
+monitor_altstack_release(struct monitor_thread_node *tn)
+{
+    stack_t ss;
+
+    if (tn->tn_altstack == NULL) {
+	return;
+    }
+    ss.ss_sp = NULL;
+    ss.ss_size = 0;
+    ss.ss_flags = SS_DISABLE;
+    if (sigaltstack(&ss, NULL) != 0) {
+	tn->tn_altstack = NULL;
+    }
+}
+
+/*
+ *  Retire the node, it goes back on the free list after a grace
+ *  period.
+ */
+static void
+monitor_unlink_thread_node(struct monitor_thread_node *tn)
+{
+
+    /*
+     * Don't retire the thread node if in exit cleanup, just mark the
+     * node as finished.
+     */
+    if (monitor_in_exit_cleanup) {
+	tn->tn_fini_started = 1;
+	monitor_mark_fini_done(tn);
+	return;
+    }
+
+    /*
+     * The node is about to be reused, so the exiting thread must
+     * not find it anymore.
+     */
+    monitor_altstack_release(tn);
+    monitor_event_release(tn, 1);
+    monitor_signal_stats_retire(tn->tn_sig_stats);
+    monitor_set_my_tn(NULL);
+    compare_and_swap(&tn->tn_state, MONITOR_TN_ACTIVE, MONITOR_TN_RETIRED);
+    monitor_retired_list_push(tn);
+}
+
+/*
+ *  If exit cleanup began before this thread finished init-thread,
+ *  then shootdown may have passed over us, so add ourself to its
+ *  wait count and take the signal now.  The CAS is a read of the
+ *  exit flag that is ordered after our stores.
+ */
+static void
+monitor_late_shootdown_check(struct monitor_thread_node *tn)
+{
+    if (tn->tn_init_state == MONITOR_INIT_DONE
+	&& compare_and_swap(&monitor_in_exit_cleanup, 1, 1)
+	&& shootdown_signal > 0
+	&& !monitor_fini_thread_done) {
+	monitor_shootdown_track(tn);
+	(*real_pthread_kill)(tn->tn_self, shootdown_signal);
+    }
+}
+
+/*
+ *  Start and stop the lazy init-thread lifetime timer.  The timer
+ *  sends monitor_lazy_signal to this thread only.
+ */
+static void
+monitor_start_lazy_timer(struct monitor_thread_node *tn)
+{
+#ifdef MONITOR_USE_THREAD_TIMER
+    struct sigevent sev;
+    struct itimerspec its;
+    int timer;
+
+    if (monitor_lazy_signal <= 0 || tn->tn_ktid <= 0) {
+	return;
+    }
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = monitor_lazy_signal;
+    sev.sigev_notify_thread_id = tn->tn_ktid;
+    if (syscall(SYS_timer_create, CLOCK_MONOTONIC, &sev, &timer) != 0) {
+	MONITOR_DEBUG1("timer_create failed\n");
+	return;
+    }
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = monitor_lazy_msec / 1000;
+    its.it_value.tv_nsec = (monitor_lazy_msec % 1000) * 1000000;
+    tn->tn_lazy_timer = timer;
+    tn->tn_has_timer = 1;
+    syscall(SYS_timer_settime, timer, 0, &its, NULL);
+#endif
+}
+
+/*
+ *  Only the caller that clears tn_has_timer deletes the timer, so the
+ *  id is deleted once (it may belong to another thread afterwards).
+ */
+static void
+monitor_stop_lazy_timer(struct monitor_thread_node *tn)
+{
+#ifdef MONITOR_USE_THREAD_TIMER
+    if (tn->tn_has_timer
+	&& compare_and_swap(&tn->tn_has_timer, 1, 0) == 1) {
+	syscall(SYS_timer_delete, tn->tn_lazy_timer);
+    }
+#endif
+}
+
+/*
+ *  Run the deferred monitor_init_thread() callback in the calling
+ *  thread, if it's still pending or due.  This is only called at a
+ *  point where the thread enters monitor: monitor_get_user_data(),
+ *  pthread_create() or fork() after a client signal or the lifetime
+ *  timer, or thread and process exit.
+ */
+static void
+monitor_run_lazy_init(struct monitor_thread_node *tn)
+{
+    long state;
+
+    for (;;) {
+	state = tn->tn_init_state;
+	if (state != MONITOR_INIT_PENDING && state != MONITOR_INIT_DUE) {
+	    return;
+	}
+	if (compare_and_swap(&tn->tn_init_state, state,
+			     MONITOR_INIT_RUNNING) == state) {
+	    break;
+	}
+    }
+    monitor_stop_lazy_timer(tn);
+
+    MONITOR_DEBUG("calling monitor_init_thread(tid = %d, data = %p) ...\n",
+		  tn->tn_tid, tn->tn_user_data);
+    tn->tn_user_data = monitor_init_thread(tn->tn_tid, tn->tn_user_data);
+
+    compare_and_swap(&tn->tn_init_state, MONITOR_INIT_RUNNING, MONITOR_INIT_DONE);
+    monitor_late_shootdown_check(tn);
+}
+
+/*
+ *  The lifetime timer interrupts arbitrary code (maybe inside malloc),
+ *  so it can't run the client's init-thread.  It only marks the
+ *  thread as due, and the callback runs at the next entry or at exit.
+ */
+static void
+monitor_lazy_handler(int sig)
+{
+    struct monitor_thread_node *tn;
+
+    tn = monitor_fast_get_tn();
+    if (tn != NULL) {
+	compare_and_swap(&tn->tn_init_state, MONITOR_INIT_PENDING,
+			 MONITOR_INIT_DUE);
+    }
+}
+
+/*
+ *  Called from monitor's signal handlers before the client's handler.
+ *  Like the lifetime timer, this only marks a pending init-thread as
+ *  due, the callback runs at the thread's next synchronous entry.
+ */
+void
+monitor_thread_lazy_due(void)
+{
+    struct monitor_thread_node *tn;
+
+    if (monitor_lazy_msec < 0) {
+	return;
+    }
+    tn = monitor_fast_get_tn();
+    if (tn != NULL) {
+	compare_and_swap(&tn->tn_init_state, MONITOR_INIT_PENDING,
+			 MONITOR_INIT_DUE);
+    }
+}
+
+/*
+ *  Called from pthread_create() and fork() to run a lazy init-thread
+ *  in the calling thread if it's due.  Not safe in a signal handler.
+ */
+void
+monitor_thread_lazy_init(void)
+{
+    struct monitor_thread_node *tn;
+
+    if (monitor_lazy_msec < 0) {
+	return;
+    }
+    tn = monitor_fast_get_tn();
+    if (tn != NULL && tn->tn_init_state == MONITOR_INIT_DUE) {
+	monitor_run_lazy_init(tn);
+    }
+}
+
+/*
+ *  Drop one count from the outstanding fini-threads, and wake up
+ *  shootdown if this was the last one.  Safe in a signal handler.
+ */
+static void
+monitor_shootdown_release(void)
+{
+    if (fetch_and_add(&monitor_fini_outstanding, -1) == 1) {
+	monitor_shootdown_futex++;
+	monitor_futex_wake(&monitor_shootdown_futex);
+    }
+}
+
+/*
+ *  Add tn to the outstanding fini-threads that shootdown waits for.
+ *  The node is counted at most once at a time: whoever clears
+ *  tn_fini_wait from 1 to 0 (this function or the thread finishing
+ *  its fini-thread) drops the count.
+ */
+static void
+monitor_shootdown_track(struct monitor_thread_node *tn)
+{
+    fetch_and_add(&monitor_fini_outstanding, 1);
+    if (compare_and_swap(&tn->tn_fini_wait, 0, 1) != 0) {
+	/* already counted */
+	monitor_shootdown_release();
+	return;
+    }
+    if (tn->tn_fini_done && compare_and_swap(&tn->tn_fini_wait, 1, 0) == 1) {
+	monitor_shootdown_release();
+    }
+}
+
+/*
+ *  Mark that tn's fini-thread callback has finished and tell
+ *  shootdown if it's waiting for this thread.
+ */
+static void
+monitor_mark_fini_done(struct monitor_thread_node *tn)
+{
+    tn->tn_fini_done = 1;
+    if (compare_and_swap(&tn->tn_fini_wait, 1, 0) == 1) {
+	monitor_shootdown_release();
+    }
+}
+
+static void
+monitor_shootdown_handler(int sig)
+{
+    struct monitor_thread_node *tn;
+    long long start;
+    int old_state, shadow_gen;
+
+    tn = monitor_fast_get_tn();
+    if (tn == NULL) {
+	MONITOR_WARN1("unable to deliver monitor_fini_thread callback: "
+		      "unable to find thread node\n");
+	return;
+    }
+    if (tn->tn_init_state == MONITOR_INIT_DUE && tn->tn_appl_started
+	&& !tn->tn_block_shootdown && !monitor_fini_thread_done) {
+	monitor_run_lazy_init(tn);
+    }
+    if (!tn->tn_appl_started || tn->tn_fini_started || tn->tn_block_shootdown
+	|| tn->tn_init_state != MONITOR_INIT_DONE) {
+	/* fini-thread has already run, or else we don't want it to run. */
+	return;
+    }
+    if (monitor_fini_thread_done) {
+	MONITOR_WARN("unable to deliver monitor_fini_thread callback (tid %d): "
+		     "monitor_fini_process() has begun\n", tn->tn_tid);
+	return;
+    }
+
+    (*real_pthread_setcancelstate)(PTHREAD_CANCEL_DISABLE, &old_state);
+    tn->tn_fini_started = 1;
+    MONITOR_DEBUG("calling monitor_fini_thread(data = %p), tid = %d ...\n",
+		  tn->tn_user_data, tn->tn_tid);
+    shadow_gen = monitor_sigmask_shadow_enter();
+    start = monitor_clock_nsec();
+    monitor_fini_thread(tn->tn_user_data);
+    monitor_phase_client(MONITOR_PHASE_SHOOTDOWN, start);
+    monitor_sigmask_shadow_leave(shadow_gen);
+    monitor_mark_fini_done(tn);
+    (*real_pthread_setcancelstate)(old_state, NULL);
+}
+
+#if 0
+/*
+ *  Call monitor_thread_support.
+ */
+static inline void
+monitor_call_thread_support(void)
+{
+    if (monitor_thread_support_done) {
+	MONITOR_WARN1("attempted to call thread support twice\n");
+	return;
+    }
+    MONITOR_DEBUG1("calling monitor_init_thread_support() ...\n");
+    monitor_init_thread_support();
+    monitor_thread_support_done = 1;
+}
+
+/*
+ *  Called from main.c at begin process time to release threads
+ *  waiting on deferred thread support.
+ */
+void
+monitor_thread_release(void)
+{
+    if (monitor_has_used_threads)
+	monitor_call_thread_support();
+
+    monitor_has_reached_main = 1;
+}
+#endif
+
+/*
+ *  Called from main.c at end process time for possible thread cleanup.
+ *  Note: main doesn't know if application is threaded or not.
+ */
+void
+monitor_thread_shootdown(void)
+{
+    struct monitor_thread_node *tn, *my_tn, *main_tn;
+    struct sigaction my_action;
+    struct timespec wait_time;
+    sigset_t empty_set;
+    pthread_t self;
+    long long now, deadline;
+    int num_started, num_unstarted, last_unstarted;
+    int num_signaled, gen, old_state, include_main;
+    long epoch;
+
+    if (! monitor_has_used_threads) {
+	MONITOR_DEBUG1("(no threads)\n");
+	return;
+    }
+    if (monitor_thread_cb == 0) {
+	/* no fini-thread callback to deliver */
+	compare_and_swap(&monitor_in_exit_cleanup, 0, 1);
+	return;
+    }
+
+    (*real_pthread_setcancelstate)(PTHREAD_CANCEL_DISABLE, &old_state);
+
+    /*
+     * Install the signal handler for thread shootdown before setting
+     * the exit flag, new threads use the signal as soon as they see
+     * the flag.  Note: the signal handler is process-wide.
+     */
+    shootdown_signal = monitor_shootdown_signal();
+    MONITOR_DEBUG("using signal: %d\n", shootdown_signal);
+    sigemptyset(&empty_set);
+    my_action.sa_handler = monitor_shootdown_handler;
+    my_action.sa_mask = empty_set;
+    my_action.sa_flags = SA_RESTART;
+    if ((*real_sigaction)(shootdown_signal, &my_action, NULL) != 0) {
+	MONITOR_ERROR1("sigaction failed\n");
+    }
+
+    compare_and_swap(&monitor_in_exit_cleanup, 0, 1);
     MONITOR_DEBUG1("(threads)\n");
 
-    /*
-     * Install the signal handler for thread shootdown.
-     * Note: the signal handler is process-wide.
-     */
-    shootdown_signal = monitor_shootdown_signal();
-    MONITOR_DEBUG("using signal: %d\n", shootdown_signal);
-    sigemptyset(&empty_set);
-    my_action.sa_handler = monitor_shootdown_handler;
-    my_action.sa_mask = empty_set;
-    my_action.sa_flags = SA_RESTART;
-    if ((*real_sigaction)(shootdown_signal, &my_action, NULL) != 0) {
-	MONITOR_ERROR1("sigaction failed\n");
+    /*
+     * If shootdown is called from non-main thread, then cheat and
+     * treat main as a started thread.  Main gets a fini-thread
+     * callback and the current thread gets both fini-thread and
+     * fini-process.  Otherwise, main is skipped in the registry.
+     */
+    self = (*real_pthread_self)();
+    main_tn = monitor_get_main_tn();
+    include_main = ! PTHREAD_EQUAL(self, main_tn->tn_self);
+    if (include_main) {
+	main_tn->tn_appl_started = 1;
+	main_tn->tn_fini_started = 0;
+	main_tn->tn_fini_done = 0;
+	main_tn->tn_fini_wait = 0;
+    }
+
+    /*
+     * Walk through the list of unfinished threads once, count them
+     * as outstanding and send each one a signal to force it into its
+     * fini_thread function.  But don't signal ourself.  We hold one
+     * extra count during the walk so that the count can't reach zero
+     * until we're done.
+     */
+    my_tn = NULL;
+    num_signaled = 0;
+    monitor_fini_outstanding = 1;
+    epoch = monitor_registry_enter();
+    for (tn = monitor_thread_registry; tn != NULL; tn = tn->tn_next) {
+	if (tn->tn_state != MONITOR_TN_ACTIVE
+	    || (tn->tn_is_main && !include_main)) {
+	    continue;
+	}
+	if (PTHREAD_EQUAL(self, tn->tn_self)) {
+	    my_tn = tn;
+	    continue;
+	}
+	if (tn->tn_appl_started && !tn->tn_fini_done
+	    && (tn->tn_init_state == MONITOR_INIT_DONE
+		|| tn->tn_init_state == MONITOR_INIT_DUE)) {
+	    monitor_shootdown_track(tn);
+	    if (!tn->tn_fini_started) {
+		(*real_pthread_kill)(tn->tn_self, shootdown_signal);
+		num_signaled++;
+	    }
+	}
+    }
+    monitor_registry_exit(epoch);
+    MONITOR_DEBUG("signaled: %d, outstanding: %ld\n",
+		  num_signaled, monitor_fini_outstanding - 1);
+
+    /*
+     * Sleep until the last fini-thread finishes.  Add a timeout: if
+     * no more threads start their fini-thread within the timeout,
+     * then give up.  Progress means receiving the signal in the other thread,
+     * the fini thread callback can take as long as it likes.
+     */
+    gen = monitor_shootdown_futex;
+    monitor_shootdown_release();
+    deadline = monitor_clock_nsec() + monitor_shootdown_timeout;
+    last_unstarted = num_signaled;
+    while (monitor_fini_outstanding > 0) {
+	now = monitor_clock_nsec();
+	if (now >= deadline) {
+	    num_started = 0;
+	    num_unstarted = 0;
+	    epoch = monitor_registry_enter();
+	    for (tn = monitor_thread_registry; tn != NULL; tn = tn->tn_next) {
+		if (tn->tn_state == MONITOR_TN_ACTIVE && tn->tn_fini_wait) {
+		    if (tn->tn_fini_started)
+			num_started++;
+		    else
+			num_unstarted++;
+		}
+	    }
+	    monitor_registry_exit(epoch);
+	    MONITOR_DEBUG("started: %d, unstarted: %d\n",
+			  num_started, num_unstarted);
+	    if (num_unstarted > 0 && num_unstarted >= last_unstarted) {
+		MONITOR_WARN("timeout exceeded (%g): unable to deliver "
+			     "monitor_fini_thread() to %d threads\n",
+			     monitor_shootdown_timeout / 1000000000.0,
+			     num_unstarted);
+		break;
+	    }
+	    last_unstarted = num_unstarted;
+	    deadline = now + monitor_shootdown_timeout;
+	    continue;
+	}
+	monitor_nsec_to_timespec(deadline - now, &wait_time);
+	monitor_futex_wait(&monitor_shootdown_futex, gen, &wait_time);
+	gen = monitor_shootdown_futex;
+    }
+    monitor_fini_thread_done = 1;
+
+    /*
+     * See if we need to run fini_thread from this thread.  A lazy
+     * init-thread that is due runs first.
+     */
+    if (my_tn != NULL && my_tn->tn_init_state == MONITOR_INIT_DUE) {
+	monitor_run_lazy_init(my_tn);
+    }
+    if (my_tn != NULL && !my_tn->tn_fini_started
+	&& my_tn->tn_init_state == MONITOR_INIT_DONE) {
+	my_tn->tn_fini_started = 1;
+	MONITOR_DEBUG("calling monitor_fini_thread(data = %p), tid = %d ...\n",
+		      my_tn->tn_user_data, my_tn->tn_tid);
+	now = monitor_clock_nsec();
+	monitor_fini_thread(my_tn->tn_user_data);
+	monitor_phase_client(MONITOR_PHASE_SHOOTDOWN, now);
+	my_tn->tn_fini_done = 1;
+    }
+
+    (*real_pthread_setcancelstate)(old_state, NULL);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *  CLIENT SUPPORT FUNCTIONS
+ *----------------------------------------------------------------------
+ */
+
+/*
+ *  Returns: 1 if the application has called pthread_create().
+ */
+int
+monitor_is_threaded(void)
+{
+    return (monitor_has_used_threads);
+}
+
+/*
+ *  Returns: the client's data pointer from monitor_init_process() or
+ *  monitor_init_thread(), or else NULL on error.
+ */
+void *
+monitor_get_user_data(void)
+{
+    struct monitor_thread_node *tn;
+
+    tn = monitor_fast_get_tn();
+    if (tn == NULL) {
+	MONITOR_DEBUG1("unable to find thread node\n");
+	return (NULL);
+    }
+    if (tn->tn_init_state != MONITOR_INIT_DONE) {
+	monitor_run_lazy_init(tn);
+    }
+    return (tn->tn_user_data);
+}
+
+/*
+ *  Per-thread pointer slots for the client, separate from the user
+ *  data from monitor_init_thread().  These are safe to use from
+ *  inside a signal handler.
+ *
+ *  Returns: the value in the calling thread's slot, or else NULL on
+ *  error.
+ */
+void *
+monitor_get_user_slot(int slot)
+{
+    struct monitor_thread_node *tn;
+
+    if (slot < 0 || slot >= MONITOR_USER_SLOTS) {
+	return (NULL);
+    }
+    tn = monitor_fast_get_tn();
+    return (tn == NULL) ? NULL : tn->tn_user_slot[slot];
+}
+
+/*
+ *  Returns: 0 on success, or else -1 if invalid slot number or no
+ *  thread node.
+ */
+int
+monitor_set_user_slot(int slot, void *data)
+{
+    struct monitor_thread_node *tn;
+
+    if (slot < 0 || slot >= MONITOR_USER_SLOTS) {
+	return (FAILURE);
+    }
+    tn = monitor_fast_get_tn();
+    if (tn == NULL) {
+	MONITOR_DEBUG1("unable to find thread node\n");
+	return (FAILURE);
+    }
+    tn->tn_user_slot[slot] = data;
+    return (SUCCESS);
+}
+
+/*
+ *  Returns: the calling thread's tid number, or else -1 on error.
+ */
+int
+monitor_get_thread_num(void)
+{
+    struct monitor_thread_node *tn;
+
+    tn = monitor_fast_get_tn();
+    return (tn == NULL) ? -1 : tn->tn_tid;
+}
+
+/*
+ *  Thread numbers (tids) always increase, but thread indices are
+ *  dense: an index belongs to a thread node and is recycled with the
+ *  node when a thread exits.  Main is index 0, and every live thread
+ *  has an index less than monitor_get_max_thread_index(), so a client
+ *  can keep per-thread data in a flat array.  The index is already
+ *  set in monitor_init_thread().
+ *
+ *  Returns: the calling thread's index, or else -1 on error.
+ */
+int
+monitor_get_thread_index(void)
+{
+    struct monitor_thread_node *tn;
+
+    tn = monitor_fast_get_tn();
+    return (tn == NULL) ? -1 : tn->tn_index;
+}
+
+/*
+ *  Returns: one more than the largest thread index handed out so
+ *  far, this grows with the most threads alive at one time.
+ */
+int
+monitor_get_max_thread_index(void)
+{
+    return (monitor_thread_index_num);
+}
+
+/*
+ *  Returns: the address of the pthread start routine for the current
+ *  thread, or else NULL on error.
+ */
+void *
+monitor_get_addr_thread_start(void)
+{
+    struct monitor_thread_node *tn;
+
+    tn = monitor_get_tn();
+    return (tn == NULL) ? NULL : tn->tn_start_routine;
+}
+
+/*
+ *  Returns: 1 if address is at the bottom of the thread's call stack,
+ *  else 0.
+ */
+int
+monitor_unwind_thread_bottom_frame(void *addr)
+{
+    return (&monitor_thread_fence1 <= (char *) addr
+	    && (char *) addr <= &monitor_thread_fence4);
+}
+
+/*
+ *  Returns: an address inside the thread's bottom stack frame,
+ *  or else NULL if an error occurred.
+ */
+void *
+monitor_stack_bottom(void)
+{
+    struct monitor_thread_node *tn;
+
+    tn = monitor_get_tn();
+    if (tn == NULL) {
+	MONITOR_DEBUG1("unable to find thread node\n");
+	return (NULL);
+    }
+    return (tn->tn_stack_bottom);
+}
+
+/*
+ *  Returns: 1 if address is anywhere within the function body of
+ *  monitor_main() or monitor_begin_thread().
+ */
+int
+monitor_in_start_func_wide(void *addr)
+{
+    return monitor_in_main_start_func_wide(addr) ||
+	(&monitor_thread_fence1 <= (char *) addr
+	 && (char *) addr <= &monitor_thread_fence4);
+}
+
+/*
+ *  Returns: 1 if address is within the function body of monitor_main()
+ *  or monitor_begin_thread() at the point where it calls the
+ *  application.
+ */
+int
+monitor_in_start_func_narrow(void *addr)
+{
+    return monitor_in_main_start_func_narrow(addr) ||
+	(&monitor_thread_fence2 <= (char *) addr 
+	 && (char *) addr <= &monitor_thread_fence3);
+}
+
+/*
+ *  Client access to the real pthread_sigmask().
+ */
+int
+monitor_real_pthread_sigmask(int how, const sigset_t *set,
+			     sigset_t *oldset)
+{
+    monitor_thread_name_init();
+    monitor_sigmask_shadow_reset();
+    return (*real_pthread_sigmask)(how, set, oldset);
+}
+
+#ifdef MONITOR_USE_RELAY
+/*
+ *  Send sig to kernel thread tid in this process, with relay value
+ *  val in si_value, or else a plain tgkill() if val is zero.  The
+ *  relay uses its own si_code, so sigqueue() from the application
+ *  (always SI_QUEUE) can't look like a relay.  The kernel allows any
+ *  negative si_code except SI_TKILL from another thread.
+ *
+ *  Returns: 0 on success, or -1 if the thread is gone.
+ */
+static int
+monitor_relay_send(pid_t pid, pid_t tid, int sig, int val)
+{
+    siginfo_t info;
+
+    if (val == 0) {
+	return syscall(SYS_tgkill, pid, tid, sig);
+    }
+    memset(&info, 0, sizeof(info));
+    info.si_signo = sig;
+    info.si_code = MONITOR_SI_RELAY;
+    info.si_pid = pid;
+    info.si_uid = getuid();
+    info.si_value.sival_int = val;
+    return syscall(SYS_rt_tgsigqueueinfo, pid, tid, sig, &info);
+}
+
+static inline int
+monitor_relay_value(long gen, int index)
+{
+    return (int) ((gen << 12) | index);
+}
+
+static inline long
+monitor_relay_state_gen(long state)
+{
+    return (state >> MONITOR_RELAY_PEND_BITS) & MONITOR_RELAY_GEN_MASK;
+}
+
+/*
+ *  Returns: the relay record for generation gen, claimed and marked
+ *  busy until it's published, or NULL if it's still busy from an
+ *  earlier broadcast.
+ */
+static struct monitor_relay *
+monitor_relay_claim(long gen)
+{
+    struct monitor_relay *mr;
+
+    mr = &monitor_relay_ring[gen % MONITOR_RELAY_RING];
+    if (mr->mr_state != 0
+	|| compare_and_swap(&mr->mr_state, 0, (gen << MONITOR_RELAY_PEND_BITS)
+			    | MONITOR_RELAY_PEND_MASK) != 0) {
+	return (NULL);
+    }
+    return (mr);
+}
+
+/*
+ *  Account for num entries of generation gen, and free the record
+ *  when the last one is done.
+ */
+static void
+monitor_relay_done(struct monitor_relay *mr, long gen, long num)
+{
+    long state, new_state;
+
+    for (;;) {
+	state = mr->mr_state;
+	if (monitor_relay_state_gen(state) != gen
+	    || (state & MONITOR_RELAY_PEND_MASK) < num) {
+	    return;
+	}
+	new_state = state - num;
+	if ((new_state & MONITOR_RELAY_PEND_MASK) == 0) {
+	    new_state = 0;
+	}
+	if (compare_and_swap(&mr->mr_state, state, new_state) == state) {
+	    return;
+	}
+    }
+}
+
+/*
+ *  Signal the children of entry parent (-1 for the roots).  A child
+ *  that is no longer a running thread, or that can't take a relay,
+ *  is skipped and we take over its children.  Our own entry is not yet
+ *  accounted for, so the record can't be reused under us, and we're
+ *  inside the registry epoch, so the nodes can't be reused while we
+ *  check them.
+ *
+ *  Returns: the number of entries that we accounted for.
+ */
+static long
+monitor_relay_children(struct monitor_relay *mr, long gen, pid_t pid,
+		       int sig, int parent)
+{
+    struct monitor_thread_node *tn;
+    long num = 0;
+    pid_t tid;
+    int first, k;
+
+    first = MONITOR_RELAY_FANOUT * (parent + 1);
+    for (k = first; k < first + MONITOR_RELAY_FANOUT && k < mr->mr_num; k++) {
+	tn = mr->mr_tn[k];
+	tid = mr->mr_tid[k];
+	if (tn != NULL && tn->tn_state == MONITOR_TN_ACTIVE
+	    && tn->tn_ktid == tid
+	    && (tn->tn_is_main || (tn->tn_appl_started && !tn->tn_fini_started))) {
+	    if (monitor_relay_send(pid, tid, sig, monitor_relay_value(gen, k)) == 0) {
+		continue;
+	    }
+	    /* RT queue full (EAGAIN), send it plain and relay for it. */
+	    monitor_relay_send(pid, tid, sig, 0);
+	}
+	num += 1 + monitor_relay_children(mr, gen, pid, sig, k);
+    }
+    return (num);
+}
+
+/*
+ *  Called at the start of monitor's signal handlers.  If this signal
+ *  came from a broadcast relay, then pass it on to our children in
+ *  the relay tree before handling it.
+ */
+void
+monitor_broadcast_relay(int sig, siginfo_t *info)
+{
+    struct monitor_relay *mr;
+    pid_t pid;
+    long gen, epoch, num;
+    int val, index, save_errno;
+
+    if (info == NULL || info->si_code != MONITOR_SI_RELAY) {
+	return;
+    }
+    pid = getpid();
+    val = info->si_value.sival_int;
+    if (info->si_pid != pid || val <= 0) {
+	return;
+    }
+    gen = (val >> 12) & MONITOR_RELAY_GEN_MASK;
+    index = val & 0xfff;
+    mr = &monitor_relay_ring[gen % MONITOR_RELAY_RING];
+
+    if (monitor_relay_state_gen(mr->mr_state) != gen
+	|| mr->mr_sig != sig || index >= mr->mr_num) {
+	return;
     }
+    save_errno = errno;
+    epoch = monitor_registry_enter();
+    num = monitor_relay_children(mr, gen, pid, sig, index);
+    monitor_registry_exit(epoch);
+
+    monitor_relay_done(mr, gen, num + 1);
+    errno = save_errno;
+}
+#endif
+
+/*
+ *  Send signal 'sig' to every thread except ourself.  Note: we call
+ *  this function from a signal handler, so to avoid deadlock, we
+ *  can't wait on a lock.  The registry walk is lock-free and the
+ *  epoch keeps every active thread's pthread_t valid until we're
+ *  done.
+ *
+ *  With many threads and a real-time signal, we signal only the
+ *  first few threads and each thread relays the signal to a fixed
+ *  number of others (from its signal handler), so the cost is spread
+ *  out and the last thread gets the signal after O(log n) steps.  A
+ *  thread that is slow to take the signal delays the threads below
+ *  it in the tree.  Non-RT signals are always sent directly: a second
+ *  one that arrives while the first is pending is dropped, and with
+ *  it the relay.
+ *
+ *  Returns: 0 on success.
+ */
+int
+monitor_broadcast_signal(int sig)
+{
+    struct monitor_thread_node *tn;
+    pthread_t self;
+    long epoch;
+#ifdef MONITOR_USE_RELAY
+    struct monitor_relay *mr = NULL;
+    pid_t pid;
+    long gen = 0;
+    int num, k;
+#endif
+
+    if (! monitor_has_used_threads)
+	return (SUCCESS);
 
+#ifdef MONITOR_USE_RELAY
     /*
-     * If shootdown is called from non-main thread, then cheat and put
-     * main on the thread list.  Main gets a fini-thread callback and
-     * the current thread gets both fini-thread and fini-process.
+     * Claim a relay record.  If it's still busy from another
+     * broadcast, then signal every thread directly.
      */
+    if (sig >= SIGRTMIN && sig <= SIGRTMAX) {
+	do {
+	    gen = (fetch_and_add(&monitor_relay_gen, 1) + 1)
+		& MONITOR_RELAY_GEN_MASK;
+	} while (gen == 0);
+	mr = monitor_relay_claim(gen);
+    }
+    num = 0;
+#endif
+
     self = (*real_pthread_self)();
-    main_tn = monitor_get_main_tn();
-    if (! PTHREAD_EQUAL(self, main_tn->tn_self)) {
-	main_tn->tn_appl_started = 1;
-	main_tn->tn_fini_started = 0;
-	main_tn->tn_fini_done = 0;
-	LIST_INSERT_HEAD(&monitor_thread_list, main_tn, tn_links);
+    epoch = monitor_registry_enter();
+    for (tn = monitor_thread_registry; tn != NULL; tn = tn->tn_next) {
+	if (tn->tn_state != MONITOR_TN_ACTIVE
+	    || PTHREAD_EQUAL(self, tn->tn_self)) {
+	    continue;
+	}
+	/* Always include main, even before it's started. */
+	if (tn->tn_is_main ||
+	    (tn->tn_appl_started && !tn->tn_fini_started)) {
+#ifdef MONITOR_USE_RELAY
+	    if (mr != NULL && tn->tn_ktid > 0 && num < MONITOR_RELAY_MAX) {
+		mr->mr_tid[num] = tn->tn_ktid;
+		mr->mr_tn[num] = tn;
+		num++;
+		continue;
+	    }
+#endif
+	    (*real_pthread_kill)(tn->tn_self, sig);
+	}
     }
 
+#ifdef MONITOR_USE_RELAY
     /*
-     * Walk through the list of unfinished threads, send a signal to
-     * force them into their fini_thread functions, and wait until
-     * they all finish.  But don't signal ourself.
-     *
-     * Add a timeout: if we make no progress for 10 consecutive
-     * seconds, then give up.  Progress means receiving the signal in
-     * the other thread, the fini thread callback can take as long as
-     * it likes.
+     * Signal a small list directly, or else publish the record with
+     * all num entries outstanding and signal the roots of the relay
+     * tree.  The relays check each node again inside their own
+     * registry epoch, since ours ends before they run.
      */
-    my_tn = NULL;
-    gettimeofday(&last, NULL);
-    last_started = 0;
-    for (;;) {
-	num_started = 0;
-	num_unstarted = 0;
-	num_finished = 0;
-	num_unfinished = 0;
-	for (tn = LIST_FIRST(&monitor_thread_list);
-	     tn != NULL;
-	     tn = LIST_NEXT(tn, tn_links))
-	{
-	    if (PTHREAD_EQUAL(self, tn->tn_self)) {
-		my_tn = tn;
-		continue;
-	    }
-	    if (tn->tn_appl_started) {
-		if (tn->tn_fini_started) {
-		    num_started++;
-		} else {
-		    (*real_pthread_kill)(tn->tn_self, shootdown_signal);
-		    num_unstarted++;
-		}
-		if (tn->tn_fini_done)
-		    num_finished++;
-		else
-		    num_unfinished++;
+    if (mr != NULL) {
+	pid = getpid();
+	if (num <= MONITOR_RELAY_MIN) {
+	    for (k = 0; k < num; k++) {
+		monitor_relay_send(pid, mr->mr_tid[k], sig, 0);
 	    }
+	    mr->mr_state = 0;
+	} else {
+	    mr->mr_sig = sig;
+	    mr->mr_num = num;
+	    memory_barrier();
+	    mr->mr_state = (gen << MONITOR_RELAY_PEND_BITS) | num;
+	    monitor_relay_done(mr, gen,
+			       monitor_relay_children(mr, gen, pid, sig, -1));
 	}
-	MONITOR_DEBUG("started: %d, unstarted: %d, finished: %d, unfinished: %d\n",
-		      num_started, num_unstarted, num_finished, num_unfinished);
-	if (num_unfinished == 0)
-	    break;
+    }
+#endif
+    monitor_registry_exit(epoch);
 
-	gettimeofday(&now, NULL);
-	if (num_started > last_started) {
-	    last = now;
-	    last_started = num_started;
-	} else if (now.tv_sec > last.tv_sec + MONITOR_SHOOTDOWN_TIMEOUT
-		   && num_unstarted > 0) {
-	    MONITOR_WARN("timeout exceeded (%d): unable to deliver "
-			 "monitor_fini_thread() to %d threads\n",
-			 MONITOR_SHOOTDOWN_TIMEOUT, num_unstarted);
-	    break;
-	}
-	usleep(MONITOR_POLL_USLEEP_TIME);
+    return (SUCCESS);
+}
+
+/*
+ *  Per-thread sampling timers.  The client registers a handler for
+ *  the signal with monitor_sigaction() and asks for a period and a
+ *  clock with monitor_sample_start().  Monitor then creates a timer
+ *  for each thread (now and as they start), recreates it in the child
+ *  after fork, and deletes it when the thread exits or when the
+ *  process starts exit cleanup.  The timer signals the thread that it
+ *  belongs to (SIGEV_THREAD_ID), so the handler can sample in place.
+ */
+#ifdef MONITOR_USE_THREAD_TIMER
+/*
+ *  Returns: the first expiration for tn's timer.  With
+ *  MONITOR_SAMPLE_STAGGER, threads start at different phases of the
+ *  period so they don't all take samples at the same time.
+ */
+static long long
+monitor_sample_phase(struct monitor_thread_node *tn)
+{
+    unsigned long hash;
+
+    if (! (monitor_sample_flags & MONITOR_SAMPLE_STAGGER)) {
+	return monitor_sample_period;
     }
-    monitor_fini_thread_done = 1;
+    hash = ((unsigned long) tn->tn_index * 2654435761UL) % 1024;
+    return (monitor_sample_period * (long long) (hash + 1)) / 1024;
+}
+
+static void
+monitor_sample_arm(int timer, long long first)
+{
+    struct itimerspec its;
+
+    monitor_nsec_to_timespec(monitor_sample_period, &its.it_interval);
+    monitor_nsec_to_timespec(first, &its.it_value);
+    syscall(SYS_timer_settime, timer, 0, &its, NULL);
+}
+
+/*
+ *  Create and arm the sampling timer for tn, unless it already has
+ *  one.  May be called from another thread (monitor_sample_start),
+ *  so the timer is published with compare and swap.
+ */
+static void
+monitor_sample_create(struct monitor_thread_node *tn)
+{
+    struct sigevent sev;
+    clockid_t clock;
+    pid_t ktid;
+    int sig, timer;
 
     /*
-     * See if we need to run fini_thread from this thread.
+     * Main's ktid is only set once the process is threaded.
      */
-    if (my_tn != NULL && !my_tn->tn_fini_started) {
-	my_tn->tn_fini_started = 1;
-	MONITOR_DEBUG("calling monitor_fini_thread(data = %p), tid = %d ...\n",
-		      my_tn->tn_user_data, my_tn->tn_tid);
-	monitor_fini_thread(my_tn->tn_user_data);
-	my_tn->tn_fini_done = 1;
+    ktid = tn->tn_is_main ? getpid() : tn->tn_ktid;
+    sig = monitor_sample_signal;
+    if (sig <= 0 || ktid <= 0 || tn->tn_sample_timer != 0) {
+	return;
+    }
+    if (monitor_sample_clock == MONITOR_SAMPLE_REALTIME) {
+	clock = CLOCK_REALTIME;
+    } else if (monitor_sample_clock == MONITOR_SAMPLE_MONOTONIC) {
+	clock = CLOCK_MONOTONIC;
+    } else {
+	clock = MONITOR_THREAD_CPUCLOCK(ktid);
+    }
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = sig;
+    sev.sigev_notify_thread_id = ktid;
+    if (syscall(SYS_timer_create, clock, &sev, &timer) != 0) {
+	MONITOR_DEBUG("timer_create failed, tid = %d\n", tn->tn_tid);
+	return;
+    }
+    if (compare_and_swap(&tn->tn_sample_timer, 0, timer + 1) != 0) {
+	syscall(SYS_timer_delete, timer);
+	return;
     }
+    monitor_sample_arm(timer, monitor_sample_phase(tn));
+}
 
-    (*real_pthread_setcancelstate)(old_state, NULL);
+/*
+ *  Delete tn's sampling timer, if any.  Whoever swaps out the timer
+ *  id deletes it, so it's deleted only once.
+ */
+static void
+monitor_sample_delete(struct monitor_thread_node *tn)
+{
+    long timer;
+
+    do {
+	timer = tn->tn_sample_timer;
+	if (timer == 0) {
+	    return;
+	}
+    } while (compare_and_swap(&tn->tn_sample_timer, timer, 0) != timer);
+
+    syscall(SYS_timer_delete, (int) (timer - 1));
+}
+#else
+static void
+monitor_sample_create(struct monitor_thread_node *tn)
+{
+    return;
+}
+
+static void
+monitor_sample_delete(struct monitor_thread_node *tn)
+{
+    return;
 }
+#endif
 
 /*
- *----------------------------------------------------------------------
- *  CLIENT SUPPORT FUNCTIONS
- *----------------------------------------------------------------------
+ *  Per-thread software events.  The client asks for an event with
+ *  monitor_event_start() and monitor opens a perf event for each
+ *  thread with its own mmap ring.  The kernel writes the samples to
+ *  the ring, and the client reads them in batches (from
+ *  monitor_event_ring) from any handler in that thread, eg, a
+ *  sampling timer, instead of taking one signal per sample.  If the
+ *  client asks for an overflow signal, then the kernel signals the
+ *  thread on every overflow.  The rings stay mapped until the thread
+ *  exits, so the client can drain them in fini-thread and
+ *  fini-process.
  */
+#ifdef MONITOR_USE_PERF_EVENTS
+static size_t
+monitor_event_ring_bytes(void)
+{
+    return (size_t) (monitor_event_pages + 1) * getpagesize();
+}
 
 /*
- *  Returns: 1 if the application has called pthread_create().
+ *  Open and map the event for tn, unless it already has one.  May
+ *  be called from another thread (monitor_event_start), so the fd is
+ *  published with compare and swap and the event starts disabled
+ *  until the ring is in place.
+ *
+ *  Returns: 0 on success, else the errno from perf_event_open, etc.
  */
-int
-monitor_is_threaded(void)
+static int
+monitor_event_open(struct monitor_thread_node *tn)
 {
-    return (monitor_has_used_threads);
+    struct perf_event_attr attr;
+    struct monitor_owner_ex owner;
+    pid_t ktid;
+    void *ring;
+    int sig, fd, err;
+
+    ktid = tn->tn_is_main ? getpid() : tn->tn_ktid;
+    sig = monitor_event_signal;
+    if (sig < 0 || ktid <= 0 || tn->tn_event_fd != 0) {
+	return (0);
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.size = sizeof(attr);
+    attr.config = monitor_event_config;
+    attr.sample_period = monitor_event_period;
+    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = syscall(SYS_perf_event_open, &attr, ktid, -1, -1, 0);
+    if (fd < 0) {
+	err = errno;
+	MONITOR_DEBUG("perf_event_open failed, tid = %d, errno = %d\n",
+		      tn->tn_tid, err);
+	return (err);
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    ring = mmap(NULL, monitor_event_ring_bytes(), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+	err = errno;
+	MONITOR_DEBUG("mmap of event ring failed, tid = %d, errno = %d\n",
+		      tn->tn_tid, err);
+	close(fd);
+	return (err);
+    }
+    owner.type = MONITOR_OWNER_TID;
+    owner.pid = ktid;
+    if (sig > 0 && (fcntl(fd, F_SETOWN_EX, &owner) != 0
+		    || fcntl(fd, F_SETSIG, sig) != 0
+		    || fcntl(fd, F_SETFL, O_ASYNC) != 0)) {
+	err = errno;
+	MONITOR_DEBUG("fcntl on event fd failed, tid = %d, errno = %d\n",
+		      tn->tn_tid, err);
+	munmap(ring, monitor_event_ring_bytes());
+	close(fd);
+	return (err);
+    }
+    if (compare_and_swap(&tn->tn_event_fd, 0, fd + 1) != 0) {
+	munmap(ring, monitor_event_ring_bytes());
+	close(fd);
+	return (0);
+    }
+    tn->tn_event_ring = ring;
+    memory_barrier();
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+
+    return (0);
 }
 
 /*
- *  Returns: the client's data pointer from monitor_init_process() or
- *  monitor_init_thread(), or else NULL on error.
+ *  Close tn's event, if any.  Whoever swaps out the fd closes it.
+ *  If unmap, then also unmap the ring, which is only safe from the
+ *  thread itself (or after it's gone), since its signal handler may
+ *  be reading the ring.  In the child after fork, the fds are
+ *  inherited but the rings are not (perf maps are not copied).
  */
-void *
-monitor_get_user_data(void)
+static void
+monitor_event_release(struct monitor_thread_node *tn, int unmap)
 {
-    struct monitor_thread_node *tn;
+    void *ring;
+    long fd;
 
-    tn = monitor_get_tn();
-    if (tn == NULL) {
-	MONITOR_DEBUG1("unable to find thread node\n");
-	return (NULL);
+    do {
+	fd = tn->tn_event_fd;
+	if (fd == 0) {
+	    return;
+	}
+    } while (compare_and_swap(&tn->tn_event_fd, fd, 0) != fd);
+
+    ring = tn->tn_event_ring;
+    tn->tn_event_ring = NULL;
+    close((int) (fd - 1));
+    if (unmap && ring != NULL) {
+	munmap(ring, monitor_event_ring_bytes());
     }
-    return (tn->tn_user_data);
 }
-
-/*
- *  Returns: the calling thread's tid number, or else -1 on error.
- */
-int
-monitor_get_thread_num(void)
+#else
+static int
+monitor_event_open(struct monitor_thread_node *tn)
 {
-    struct monitor_thread_node *tn;
+    return (ENOSYS);
+}
 
-    tn = monitor_get_tn();
-    return (tn == NULL) ? -1 : tn->tn_tid;
+static void
+monitor_event_release(struct monitor_thread_node *tn, int unmap)
+{
+    return;
 }
+#endif
 
 /*
- *  Returns: the address of the pthread start routine for the current
- *  thread, or else NULL on error.
+ *  Start the sampling timer and software event for the calling
+ *  thread, if they're on.  Called for new threads and in the child
+ *  after fork.
  */
-void *
-monitor_get_addr_thread_start(void)
+void
+monitor_sample_thread_init(void)
 {
     struct monitor_thread_node *tn;
 
+    if (monitor_sample_signal <= 0 && monitor_event_signal < 0) {
+	return;
+    }
     tn = monitor_get_tn();
-    return (tn == NULL) ? NULL : tn->tn_start_routine;
+    if (tn != NULL) {
+	monitor_sample_create(tn);
+	monitor_event_open(tn);
+    }
 }
 
 /*
- *  Returns: 1 if address is at the bottom of the thread's call stack,
- *  else 0.
+ *  Start sampling every thread with signal sig, every period_usec
+ *  microseconds of clock (MONITOR_SAMPLE_CPUTIME, REALTIME or
+ *  MONOTONIC).  This covers the current threads and every new thread.
+ *  Calling this again changes the period for new timers only.
+ *
+ *  Returns: 0 on success, -1 if the arguments are invalid or there
+ *  are no per-thread timers on this system.
  */
 int
-monitor_unwind_thread_bottom_frame(void *addr)
+monitor_sample_start(int sig, int clock, long period_usec, int flags)
 {
-    return (&monitor_thread_fence1 <= (char *) addr
-	    && (char *) addr <= &monitor_thread_fence4);
+#ifdef MONITOR_USE_THREAD_TIMER
+    struct monitor_thread_node *tn, *main_tn;
+    long epoch;
+
+    if (sig <= 0 || sig >= MONITOR_NSIG || period_usec <= 0
+	|| clock < MONITOR_SAMPLE_CPUTIME || clock > MONITOR_SAMPLE_MONOTONIC) {
+	MONITOR_DEBUG("invalid sample args: sig = %d, clock = %d, period = %ld\n",
+		      sig, clock, period_usec);
+	return (FAILURE);
+    }
+    MONITOR_DEBUG("sig = %d, clock = %d, period = %ld usec, flags = 0x%x\n",
+		  sig, clock, period_usec, flags);
+    monitor_sample_clock = clock;
+    monitor_sample_period = (long long) period_usec * 1000;
+    monitor_sample_flags = flags;
+    monitor_sample_signal = sig;
+
+    main_tn = monitor_get_main_tn();
+    monitor_sample_create(main_tn);
+    epoch = monitor_registry_enter();
+    for (tn = monitor_thread_registry; tn != NULL; tn = tn->tn_next) {
+	if (tn->tn_state == MONITOR_TN_ACTIVE && tn != main_tn) {
+	    monitor_sample_create(tn);
+	}
+    }
+    monitor_registry_exit(epoch);
+
+    return (SUCCESS);
+#else
+    MONITOR_DEBUG1("no per-thread timers\n");
+    return (FAILURE);
+#endif
 }
 
 /*
- *  Returns: an address inside the thread's bottom stack frame,
- *  or else NULL if an error occurred.
+ *  Stop sampling and delete every thread's timer.
  */
-void *
-monitor_stack_bottom(void)
+void
+monitor_sample_stop(void)
 {
     struct monitor_thread_node *tn;
+    long epoch;
 
-    tn = monitor_get_tn();
-    if (tn == NULL) {
-	MONITOR_DEBUG1("unable to find thread node\n");
-	return (NULL);
+    if (monitor_sample_signal <= 0) {
+	return;
     }
-    return (tn->tn_stack_bottom);
+    MONITOR_DEBUG1("\n");
+    monitor_sample_signal = -1;
+
+    monitor_sample_delete(monitor_get_main_tn());
+    epoch = monitor_registry_enter();
+    for (tn = monitor_thread_registry; tn != NULL; tn = tn->tn_next) {
+	monitor_sample_delete(tn);
+    }
+    monitor_registry_exit(epoch);
 }
 
 /*
- *  Returns: 1 if address is anywhere within the function body of
- *  monitor_main() or monitor_begin_thread().
+ *  Pause and resume the calling thread's sampling timer.
+ *
+ *  Returns: 0 on success, -1 if the thread has no timer.
  */
 int
-monitor_in_start_func_wide(void *addr)
+monitor_sample_pause(void)
 {
-    return monitor_in_main_start_func_wide(addr) ||
-	(&monitor_thread_fence1 <= (char *) addr
-	 && (char *) addr <= &monitor_thread_fence4);
+#ifdef MONITOR_USE_THREAD_TIMER
+    struct monitor_thread_node *tn;
+    struct itimerspec its;
+    long timer;
+
+    tn = monitor_get_tn();
+    if (tn == NULL || (timer = tn->tn_sample_timer) == 0) {
+	return (FAILURE);
+    }
+    memset(&its, 0, sizeof(its));
+    syscall(SYS_timer_settime, (int) (timer - 1), 0, &its, NULL);
+    return (SUCCESS);
+#else
+    return (FAILURE);
+#endif
 }
 
-/*
- *  Returns: 1 if address is within the function body of monitor_main()
- *  or monitor_begin_thread() at the point where it calls the
- *  application.
- */
 int
-monitor_in_start_func_narrow(void *addr)
+monitor_sample_resume(void)
 {
-    return monitor_in_main_start_func_narrow(addr) ||
-	(&monitor_thread_fence2 <= (char *) addr 
-	 && (char *) addr <= &monitor_thread_fence3);
+#ifdef MONITOR_USE_THREAD_TIMER
+    struct monitor_thread_node *tn;
+    long timer;
+
+    tn = monitor_get_tn();
+    if (tn == NULL || (timer = tn->tn_sample_timer) == 0) {
+	return (FAILURE);
+    }
+    monitor_sample_arm((int) (timer - 1), monitor_sample_period);
+    return (SUCCESS);
+#else
+    return (FAILURE);
+#endif
 }
 
 /*
- *  Client access to the real pthread_sigmask().
+ *  Sample every thread with software event (MONITOR_EVENT_TASK_CLOCK,
+ *  CPU_CLOCK, PAGE_FAULTS or CONTEXT_SWITCHES), one sample every
+ *  period events (nsec for the clocks), and signal sig on overflow
+ *  (0 for no signal).  The ring size in pages is from
+ *  MONITOR_EVENT_RING_PAGES (a power of 2).  The event is set once
+ *  per process, calling this again fails.
+ *
+ *  Returns: 0 on success, -1 if the arguments are invalid or perf
+ *  events are not available (no kernel support, or not allowed by
+ *  perf_event_paranoid), in which case the process runs without them.
  */
 int
-monitor_real_pthread_sigmask(int how, const sigset_t *set,
-			     sigset_t *oldset)
+monitor_event_start(int sig, int event, long period)
 {
-    monitor_thread_name_init();
-    return (*real_pthread_sigmask)(how, set, oldset);
+#ifdef MONITOR_USE_PERF_EVENTS
+    struct monitor_thread_node *tn, *self;
+    char *str;
+    long epoch;
+    int pages, err;
+
+    if (sig < 0 || sig >= MONITOR_NSIG || period <= 0) {
+	MONITOR_DEBUG("invalid event args: sig = %d, period = %ld\n",
+		      sig, period);
+	return (FAILURE);
+    }
+    switch (event) {
+    case MONITOR_EVENT_TASK_CLOCK:
+	monitor_event_config = PERF_COUNT_SW_TASK_CLOCK;
+	break;
+    case MONITOR_EVENT_CPU_CLOCK:
+	monitor_event_config = PERF_COUNT_SW_CPU_CLOCK;
+	break;
+    case MONITOR_EVENT_PAGE_FAULTS:
+	monitor_event_config = PERF_COUNT_SW_PAGE_FAULTS;
+	break;
+    case MONITOR_EVENT_CONTEXT_SWITCHES:
+	monitor_event_config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+	break;
+    default:
+	MONITOR_DEBUG("invalid event: %d\n", event);
+	return (FAILURE);
+    }
+    if (compare_and_swap(&monitor_event_started, 0, 1) != 0) {
+	MONITOR_DEBUG1("events already started\n");
+	return (FAILURE);
+    }
+    str = getenv("MONITOR_EVENT_RING_PAGES");
+    if (str != NULL && sscanf(str, "%d", &pages) == 1
+	&& pages > 0 && (pages & (pages - 1)) == 0) {
+	monitor_event_pages = pages;
+    }
+    MONITOR_DEBUG("sig = %d, event = %d, period = %ld, pages = %d\n",
+		  sig, event, period, monitor_event_pages);
+    monitor_event_period = period;
+    monitor_event_signal = sig;
+
+    /*
+     * Try the calling thread first, if that fails, then perf events
+     * are not usable here, so turn them off.
+     */
+    self = monitor_get_tn();
+    err = (self != NULL) ? monitor_event_open(self) : ENOSYS;
+    if (err != 0) {
+	MONITOR_DEBUG("perf events unavailable (errno = %d), "
+		      "continuing without them\n", err);
+	monitor_event_signal = -1;
+	return (FAILURE);
+    }
+    monitor_event_open(monitor_get_main_tn());
+    epoch = monitor_registry_enter();
+    for (tn = monitor_thread_registry; tn != NULL; tn = tn->tn_next) {
+	if (tn->tn_state == MONITOR_TN_ACTIVE) {
+	    monitor_event_open(tn);
+	}
+    }
+    monitor_registry_exit(epoch);
+
+    return (SUCCESS);
+#else
+    MONITOR_DEBUG1("no perf events\n");
+    return (FAILURE);
+#endif
 }
 
 /*
- *  Send signal 'sig' to every thread except ourself.  Note: we call
- *  this function from a signal handler, so to avoid deadlock, we
- *  can't wait on a lock.  Instead, we can only try the lock and fail
- *  if the trylock fails.
- *
- *  Returns: 0 on success, or -1 if trylock failed.
+ *  Stop the software events in every thread.  This only disables the
+ *  events, the rings stay mapped (until the thread exits) so the
+ *  client can read the last samples.
  */
-int
-monitor_broadcast_signal(int sig)
+void
+monitor_event_stop(void)
 {
+#ifdef MONITOR_USE_PERF_EVENTS
     struct monitor_thread_node *tn;
-    pthread_t self;
-
-    if (! monitor_has_used_threads)
-	return (SUCCESS);
+    long epoch, fd;
 
-    if (MONITOR_THREAD_TRYLOCK != 0)
-	return (FAILURE);
-
-    self = (*real_pthread_self)();
-    for (tn = LIST_FIRST(&monitor_thread_list);
-	 tn != NULL;
-	 tn = LIST_NEXT(tn, tn_links)) {
+    if (monitor_event_signal < 0) {
+	return;
+    }
+    MONITOR_DEBUG1("\n");
+    monitor_event_signal = -1;
 
-	if (!PTHREAD_EQUAL(self, tn->tn_self) &&
-	    tn->tn_appl_started && !tn->tn_fini_started) {
-	    (*real_pthread_kill)(tn->tn_self, sig);
+    fd = monitor_get_main_tn()->tn_event_fd;
+    if (fd != 0) {
+	ioctl((int) (fd - 1), PERF_EVENT_IOC_DISABLE, 0);
+    }
+    epoch = monitor_registry_enter();
+    for (tn = monitor_thread_registry; tn != NULL; tn = tn->tn_next) {
+	fd = tn->tn_event_fd;
+	if (fd != 0) {
+	    ioctl((int) (fd - 1), PERF_EVENT_IOC_DISABLE, 0);
 	}
     }
+    monitor_registry_exit(epoch);
+#endif
+}
 
-    tn = monitor_get_main_tn();
-    if (tn != NULL && !PTHREAD_EQUAL(self, tn->tn_self))
-	(*real_pthread_kill)(tn->tn_self, sig);
+/*
+ *  Returns: the calling thread's event ring (struct
+ *  perf_event_mmap_page), or NULL if none, and sets size to the
+ *  number of bytes in the data area that follows the header page.
+ *  Samples are PERF_SAMPLE_IP | TID | TIME records, the reader
+ *  consumes from data_tail to data_head and then stores data_tail.
+ */
+void *
+monitor_event_ring(size_t *size)
+{
+    struct monitor_thread_node *tn;
 
-    MONITOR_THREAD_UNLOCK;
-    return (SUCCESS);
+    tn = monitor_fast_get_tn();
+    if (tn == NULL || tn->tn_event_ring == NULL) {
+	return (NULL);
+    }
+    if (size != NULL) {
+	*size = (size_t) monitor_event_pages * getpagesize();
+    }
+    return (tn->tn_event_ring);
 }
 
 /*
@@ -825,6 +2634,15 @@ monitor_unblock_shootdown(void)
 	return;
     }
     tn->tn_block_shootdown = 0;
+
+    /*
+     * Shootdown only signals a thread once, so if it came while we
+     * were blocked, then send it again to ourself.
+     */
+    if (monitor_in_exit_cleanup && tn->tn_fini_wait && !tn->tn_fini_started
+	&& shootdown_signal > 0) {
+	(*real_pthread_kill)(tn->tn_self, shootdown_signal);
+    }
 }
 
 /*
@@ -910,11 +2728,40 @@ monitor_pthread_cleanup_routine(void *arg)
 		      "missing cleanup handler argument\n");
 	return;
     }
+    /*
+     * In the child after fork, this thread is now main and its old
+     * node may be unmapped, so don't touch it.
+     */
+    if (tn != monitor_fast_get_tn()) {
+	MONITOR_DEBUG1("thread node changed at fork: no fini-thread\n");
+	return;
+    }
     if (tn->tn_magic != MONITOR_TN_MAGIC) {
 	MONITOR_WARN1("unable to deliver monitor_fini_thread callback: "
 		      "bad magic in thread node\n");
 	return;
     }
+    monitor_sample_delete(tn);
+    if (tn->tn_passthru) {
+	monitor_unlink_thread_node(tn);
+	return;
+    }
+    /*
+     * Lazy init-thread: if init-thread never ran, then skip
+     * fini-thread too, unless the thread outlived the lifetime.
+     */
+    monitor_stop_lazy_timer(tn);
+    if (tn->tn_init_state == MONITOR_INIT_DUE) {
+	monitor_run_lazy_init(tn);
+    }
+    if (tn->tn_init_state != MONITOR_INIT_DONE
+	&& compare_and_swap(&tn->tn_init_state, MONITOR_INIT_PENDING,
+			    MONITOR_INIT_SKIPPED) == MONITOR_INIT_PENDING) {
+	MONITOR_DEBUG("skipping fini-thread (no init-thread), tid = %d\n",
+		      tn->tn_tid);
+	monitor_unlink_thread_node(tn);
+	return;
+    }
     if (!tn->tn_appl_started || tn->tn_fini_started || tn->tn_block_shootdown) {
 	/* fini-thread has already run, or else we don't want it to run. */
 	return;
@@ -929,7 +2776,7 @@ monitor_pthread_cleanup_routine(void *arg)
     MONITOR_DEBUG("calling monitor_fini_thread(data = %p), tid = %d ...\n",
 		  tn->tn_user_data, tn->tn_tid);
     monitor_fini_thread(tn->tn_user_data);
-    tn->tn_fini_done = 1;
+    monitor_mark_fini_done(tn);
 
     monitor_unlink_thread_node(tn);
 }
@@ -967,12 +2814,27 @@ monitor_begin_thread(void *arg)
      * Don't create any new threads after someone has called exit().
      */
     tn->tn_self = (*real_pthread_self)();
+    tn->tn_ktid = monitor_gettid();
+    /*
+     * The node may be reused, and monitor_sample_start() in another
+     * thread can see the old thread as active and make its timer
+     * after the old thread's exit path has already deleted it.  That
+     * timer targets the old ktid, and while tn_sample_timer is set,
+     * monitor_sample_thread_init() won't make one for us.  So delete
+     * anything left over before we start, same for the event.
+     */
+    monitor_sample_delete(tn);
+    monitor_event_release(tn, 1);
     tn->tn_stack_bottom = alloca(8);
     strncpy(tn->tn_stack_bottom, "stakbot", 8);
-    if ((*real_pthread_setspecific)(monitor_pthread_key, tn) != 0) {
+    if (monitor_set_my_tn(tn) != 0) {
 	MONITOR_ERROR1("pthread_setspecific failed\n");
     }
-    if (monitor_link_thread_node(tn) != 0) {
+    /*
+     * A pass-through thread runs even during exit cleanup, same as
+     * a thread with no node.
+     */
+    if (monitor_link_thread_node(tn) != 0 && ! tn->tn_passthru) {
 	MONITOR_DEBUG1("warning: trying to create new thread during "
 		       "exit cleanup: thread not started\n");
 	return (NULL);
@@ -980,13 +2842,31 @@ monitor_begin_thread(void *arg)
 
     PTHREAD_CLEANUP_PUSH(monitor_pthread_cleanup_routine, tn);
 
-    MONITOR_DEBUG("tid = %d, self = %p, start_routine = %p\n",
-		  tn->tn_tid, (void *)tn->tn_self, tn->tn_start_routine);
-    MONITOR_DEBUG("calling monitor_init_thread(tid = %d, data = %p) ...\n",
-		  tn->tn_tid, tn->tn_user_data);
-    tn->tn_user_data = monitor_init_thread(tn->tn_tid, tn->tn_user_data);
+    MONITOR_DEBUG("tid = %d, index = %d, self = %p, start_routine = %p\n",
+		  tn->tn_tid, tn->tn_index, (void *)tn->tn_self,
+		  tn->tn_start_routine);
 
+    /*
+     * A pass-through thread gets no callbacks and no alternate signal
+     * stack, but it's still started, so a later broadcast or
+     * monitor_sample_start() reaches it.  There is no shootdown with
+     * no thread callbacks.
+     */
+    if (! tn->tn_passthru) {
+	monitor_altstack_setup(tn);
+	if (monitor_lazy_msec >= 0) {
+	    MONITOR_DEBUG("deferring monitor_init_thread(tid = %d)\n", tn->tn_tid);
+	    tn->tn_init_state = MONITOR_INIT_PENDING;
+	    monitor_start_lazy_timer(tn);
+	} else {
+	    MONITOR_DEBUG("calling monitor_init_thread(tid = %d, data = %p) ...\n",
+			  tn->tn_tid, tn->tn_user_data);
+	    tn->tn_user_data = monitor_init_thread(tn->tn_tid, tn->tn_user_data);
+	}
+    }
+    monitor_sample_thread_init();
     tn->tn_appl_started = 1;
+    monitor_late_shootdown_check(tn);
     MONITOR_ASM_LABEL(monitor_thread_fence2);
     ret = (tn->tn_start_routine)(tn->tn_arg);
     MONITOR_ASM_LABEL(monitor_thread_fence3);
@@ -1061,11 +2941,19 @@ MONITOR_WRAP_NAME(pthread_create)(PTHREAD_CREATE_PARAM_LIST)
     struct monitor_thread_node *tn, *my_tn;
     struct monitor_thread_info mti;
     pthread_attr_t default_attr;
+    long long start;
     int ret, restore, destroy;
     size_t old_size;
 
     MONITOR_DEBUG1("\n");
 
+    /*
+     * A lazy fork child runs its deferred init-process before it
+     * creates any threads, and a due init-thread runs in the caller.
+     */
+    monitor_fork_lazy_init();
+    monitor_thread_lazy_init();
+
     /*
      * There is no race condition to get here first because until now,
      * there is only one thread.
@@ -1078,6 +2966,34 @@ MONITOR_WRAP_NAME(pthread_create)(PTHREAD_CREATE_PARAM_LIST)
 	monitor_has_used_threads = 1;
     }
 
+    /*
+     * If the client doesn't use any thread callbacks or signals, then
+     * the new thread is pass-through: it still gets a thread node for
+     * the thread num, user slots and stack bottom, but no callbacks,
+     * no stack size check and no alternate signal stack.
+     */
+    if (monitor_thread_cb == 0 && ! monitor_client_signals_used()) {
+	monitor_begin_process_fcn(NULL, FALSE);
+	monitor_phase_begin(MONITOR_PHASE_FIRST_THREAD);
+	my_tn = monitor_get_tn();
+	if (my_tn == NULL || my_tn->tn_ignore_threads) {
+	    ret = (*real_pthread_create)(thread, attr, start_routine, arg);
+	    monitor_phase_end(MONITOR_PHASE_FIRST_THREAD);
+	    return (ret);
+	}
+	tn = monitor_make_thread_node();
+	tn->tn_start_routine = start_routine;
+	tn->tn_arg = arg;
+	tn->tn_passthru = 1;
+	ret = (*real_pthread_create)(thread, attr, monitor_begin_thread,
+				     (void *)tn);
+	if (ret != 0) {
+	    monitor_free_thread_node(tn);
+	}
+	monitor_phase_end(MONITOR_PHASE_FIRST_THREAD);
+	return (ret);
+    }
+
     /*
      * Create a thread info struct for pthread_create() callback
      * function.  Note: this info is only available during the
@@ -1097,6 +3013,12 @@ MONITOR_WRAP_NAME(pthread_create)(PTHREAD_CREATE_PARAM_LIST)
      */
     monitor_begin_process_fcn(NULL, FALSE);
 
+    /*
+     * The first-thread phase starts after init process, in case this
+     * is the first entry into monitor.
+     */
+    monitor_phase_begin(MONITOR_PHASE_FIRST_THREAD);
+
     /*
      * If we are ignoring this thread, then call the real
      * pthread_create(), don't put it on the thread list and don't
@@ -1104,7 +3026,9 @@ MONITOR_WRAP_NAME(pthread_create)(PTHREAD_CREATE_PARAM_LIST)
      */
     if (my_tn == NULL || my_tn->tn_ignore_threads) {
 	MONITOR_DEBUG("launching ignored thread: start = %p\n", start_routine);
-	return (*real_pthread_create)(thread, attr, start_routine, arg);
+	ret = (*real_pthread_create)(thread, attr, start_routine, arg);
+	monitor_phase_end(MONITOR_PHASE_FIRST_THREAD);
+	return (ret);
     }
 
     /*
@@ -1114,7 +3038,11 @@ MONITOR_WRAP_NAME(pthread_create)(PTHREAD_CREATE_PARAM_LIST)
     if (! monitor_thread_support_done) {
 	MONITOR_DEBUG1("calling monitor_init_thread_support() ...\n");
 	monitor_thread_support_done = 1;
-	monitor_init_thread_support();
+	if (monitor_thread_cb & MONITOR_CB_THREAD_SUPPORT) {
+	    start = monitor_clock_nsec();
+	    monitor_init_thread_support();
+	    monitor_phase_client(MONITOR_PHASE_FIRST_THREAD, start);
+	}
     }
 
     /*
@@ -1122,16 +3050,23 @@ MONITOR_WRAP_NAME(pthread_create)(PTHREAD_CREATE_PARAM_LIST)
      * early, then the new thread will spin-wait until init_process
      * and thread_support are done.
      */
-    MONITOR_DEBUG("calling monitor_thread_pre_create(start_routine = %p) ...\n",
-		  start_routine);
-    void * user_data = monitor_thread_pre_create();
+    void * user_data = NULL;
+    if (monitor_thread_cb & MONITOR_CB_PRE_CREATE) {
+	MONITOR_DEBUG("calling monitor_thread_pre_create(start_routine = %p) ...\n",
+		      start_routine);
+	start = monitor_clock_nsec();
+	user_data = monitor_thread_pre_create();
+	monitor_phase_client(MONITOR_PHASE_FIRST_THREAD, start);
+    }
 
     /*
      * Allow the client to ignore this new thread.
      */
     if (user_data == MONITOR_IGNORE_NEW_THREAD) {
 	MONITOR_DEBUG("launching ignored thread: start = %p\n", start_routine);
-	return (*real_pthread_create)(thread, attr, start_routine, arg);
+	ret = (*real_pthread_create)(thread, attr, start_routine, arg);
+	monitor_phase_end(MONITOR_PHASE_FIRST_THREAD);
+	return (ret);
     }
 
     tn = monitor_make_thread_node();
@@ -1145,8 +3080,13 @@ MONITOR_WRAP_NAME(pthread_create)(PTHREAD_CREATE_PARAM_LIST)
      * one attribute struct for several threads (so we don't keep
      * increasing its size).
      */
-    attr = monitor_adjust_stack_size((pthread_attr_t *)attr, &default_attr,
-				     &restore, &destroy, &old_size);
+    if (monitor_thread_cb & MONITOR_CB_STACKSIZE) {
+	attr = monitor_adjust_stack_size((pthread_attr_t *)attr, &default_attr,
+					 &restore, &destroy, &old_size);
+    } else {
+	restore = 0;
+	destroy = 0;
+    }
 
     MONITOR_DEBUG("launching monitored thread: monitor = %p, start = %p\n",
 		  monitor_begin_thread, start_routine);
@@ -1162,16 +3102,22 @@ MONITOR_WRAP_NAME(pthread_create)(PTHREAD_CREATE_PARAM_LIST)
     if (ret != 0) {
 	MONITOR_DEBUG("real_pthread_create failed: start_routine = %p, ret = %d\n",
 		      start_routine, ret);
+	monitor_free_thread_node(tn);
     }
 
-    MONITOR_DEBUG("calling monitor_thread_post_create(start_routine = %p) ...\n",
-		  start_routine);
-    monitor_thread_post_create(tn->tn_user_data);
+    if (monitor_thread_cb & MONITOR_CB_POST_CREATE) {
+	MONITOR_DEBUG("calling monitor_thread_post_create(start_routine = %p) ...\n",
+		      start_routine);
+	start = monitor_clock_nsec();
+	monitor_thread_post_create(user_data);
+	monitor_phase_client(MONITOR_PHASE_FIRST_THREAD, start);
+    }
 
     /* The thread info struct's lifetime ends here. */
     if (my_tn != NULL) {
         my_tn->tn_thread_info = NULL;
     }
+    monitor_phase_end(MONITOR_PHASE_FIRST_THREAD);
 
     return (ret);
 }
@@ -1213,7 +3159,7 @@ MONITOR_WRAP_NAME(pthread_sigmask)(int how, const sigset_t *set,
     monitor_signal_init();
     monitor_thread_name_init();
 
-    if (set != NULL) {
+    if (set != NULL && monitor_sigmask_filter_used()) {
 	MONITOR_DEBUG1("\n");
 	my_set = *set;
 	monitor_remove_client_signals(&my_set, how);
@@ -1230,15 +3176,29 @@ MONITOR_WRAP_NAME(pthread_sigmask)(int how, const sigset_t *set,
  *----------------------------------------------------------------------
  */
 
+/*
+ *  The wrappers sit in the application's wait loop, so the common
+ *  case (a signal in 'set' that monitor doesn't care about) must not
+ *  pay for anything beyond the real call.  We resolve the real
+ *  functions once and only capture a context when a client handler
+ *  actually runs.
+ */
+#define MONITOR_SIGWAIT_INIT  do {		\
+    if (real_sigtimedwait == NULL) {		\
+	monitor_thread_name_init();		\
+    }						\
+} while (0)
+
 /*
  *  Returns: 1 if we handled the signal (and thus we restart sigwait),
  *  else 0 to pass the signal to the application.
  */
 static int
 monitor_sigwait_helper(const sigset_t *set, int sig, int sigwait_errno,
-		       siginfo_t *info, ucontext_t *context)
+		       siginfo_t *info)
 {
     struct monitor_thread_node *tn;
+    ucontext_t context;
     int old_state;
 
     /*
@@ -1252,38 +3212,53 @@ monitor_sigwait_helper(const sigset_t *set, int sig, int sigwait_errno,
     /*
      * End of process shootdown signal.
      */
-    tn = monitor_get_tn();
-    if (sig == shootdown_signal
-	&& monitor_in_exit_cleanup
-	&& !monitor_fini_thread_done
-	&& tn != NULL
-	&& tn->tn_appl_started
-	&& !tn->tn_fini_started
-	&& !tn->tn_block_shootdown)
-    {
-	(*real_pthread_setcancelstate)(PTHREAD_CANCEL_DISABLE, &old_state);
-	tn->tn_fini_started = 1;
-	MONITOR_DEBUG("calling monitor_fini_thread(data = %p), tid = %d ...\n",
-		      tn->tn_user_data, tn->tn_tid);
-	monitor_fini_thread(tn->tn_user_data);
-	tn->tn_fini_done = 1;
-	(*real_pthread_setcancelstate)(old_state, NULL);
-
-	return 1;
+    if (sig == shootdown_signal && monitor_in_exit_cleanup) {
+	tn = monitor_get_tn();
+	if (tn != NULL && tn->tn_init_state == MONITOR_INIT_DUE
+	    && !monitor_fini_thread_done) {
+	    monitor_run_lazy_init(tn);
+	}
+	if (!monitor_fini_thread_done
+	    && tn != NULL
+	    && tn->tn_appl_started
+	    && tn->tn_init_state == MONITOR_INIT_DONE
+	    && !tn->tn_fini_started
+	    && !tn->tn_block_shootdown)
+	{
+	    (*real_pthread_setcancelstate)(PTHREAD_CANCEL_DISABLE, &old_state);
+	    tn->tn_fini_started = 1;
+	    MONITOR_DEBUG("calling monitor_fini_thread(data = %p), tid = %d ...\n",
+			  tn->tn_user_data, tn->tn_tid);
+	    monitor_fini_thread(tn->tn_user_data);
+	    monitor_mark_fini_done(tn);
+	    (*real_pthread_setcancelstate)(old_state, NULL);
+	    monitor_signal_stats_swallow(sig);
+
+	    return 1;
+	}
     }
 
     /*
      * A signal for which the client has installed a handler via
-     * monitor_sigaction().
+     * monitor_sigaction().  The context is only needed by the
+     * client's handler, so we don't take it unless the client has a
+     * handler for this signal.
      */
-    if (monitor_sigwait_handler(sig, info, context) == 0) {
-	return 1;
+    if (monitor_client_signals_used()) {
+	if (monitor_client_signal_handled(sig)) {
+	    getcontext(&context);
+	}
+	if (monitor_sigwait_handler(sig, info, &context) == 0) {
+	    monitor_signal_stats_swallow(sig);
+	    return 1;
+	}
     }
 
     /*
      * A signal not in 'set' is treated as EINTR and restarted.
      */
     if (! sigismember(set, sig)) {
+	monitor_signal_stats_swallow(sig);
 	return 1;
     }
 
@@ -1296,23 +3271,15 @@ monitor_sigwait_helper(const sigset_t *set, int sig, int sigwait_errno,
 int
 MONITOR_WRAP_NAME(sigwait)(const sigset_t *set, int *sig)
 {
-    char buf[MONITOR_SIG_BUF_SIZE];
     siginfo_t my_info;
-    ucontext_t context;
     int ret, save_errno;
 
-    monitor_thread_name_init();
-    if (monitor_debug) {
-	monitor_sigset_string(buf, MONITOR_SIG_BUF_SIZE, set);
-	MONITOR_DEBUG("waiting on:%s\n", buf);
-    }
-
-    getcontext(&context);
+    MONITOR_SIGWAIT_INIT;
     do {
 	ret = real_sigwaitinfo(set, &my_info);
 	save_errno = errno;
     }
-    while (monitor_sigwait_helper(set, ret, save_errno, &my_info, &context));
+    while (monitor_sigwait_helper(set, ret, save_errno, &my_info));
 
     if (ret < 0) {
 	return save_errno;
@@ -1326,55 +3293,60 @@ MONITOR_WRAP_NAME(sigwait)(const sigset_t *set, int *sig)
 int
 MONITOR_WRAP_NAME(sigwaitinfo)(const sigset_t *set, siginfo_t *info)
 {
-    char buf[MONITOR_SIG_BUF_SIZE];
     siginfo_t my_info, *info_ptr;
-    ucontext_t context;
     int ret, save_errno;
 
-    monitor_thread_name_init();
-    if (monitor_debug) {
-	monitor_sigset_string(buf, MONITOR_SIG_BUF_SIZE, set);
-	MONITOR_DEBUG("waiting on:%s\n", buf);
-    }
-
-    getcontext(&context);
+    MONITOR_SIGWAIT_INIT;
     info_ptr = (info != NULL) ? info : &my_info;
     do {
 	ret = real_sigwaitinfo(set, info_ptr);
 	save_errno = errno;
     }
-    while (monitor_sigwait_helper(set, ret, save_errno, info_ptr, &context));
+    while (monitor_sigwait_helper(set, ret, save_errno, info_ptr));
 
     errno = save_errno;
     return ret;
 }
 
+/*
+ *  If we restart sigtimedwait(), then the application only gets the
+ *  time that remains from its original timeout, measured on the
+ *  monotonic clock so that changes to the wall clock don't matter.
+ */
 int
 MONITOR_WRAP_NAME(sigtimedwait)(const sigset_t *set, siginfo_t *info,
 				const struct timespec *timeout)
 {
-    char buf[MONITOR_SIG_BUF_SIZE];
     siginfo_t my_info, *info_ptr;
-    ucontext_t context;
+    struct timespec remain;
+    const struct timespec *ts;
+    long long deadline = 0, now;
     int ret, save_errno;
 
-    monitor_thread_name_init();
-    if (monitor_debug) {
-	monitor_sigset_string(buf, MONITOR_SIG_BUF_SIZE, set);
-	MONITOR_DEBUG("waiting on:%s\n", buf);
+    MONITOR_SIGWAIT_INIT;
+    if (timeout != NULL) {
+	deadline = monitor_clock_nsec() + timeout->tv_sec * 1000000000LL
+	    + timeout->tv_nsec;
     }
-
-    /*
-     * FIXME: if we restart sigtimedwait(), then we should subtract
-     * the elapsed time from the timeout.
-     */
-    getcontext(&context);
     info_ptr = (info != NULL) ? info : &my_info;
-    do {
-	ret = real_sigtimedwait(set, info_ptr, timeout);
+    ts = timeout;
+    for (;;) {
+	ret = real_sigtimedwait(set, info_ptr, ts);
 	save_errno = errno;
+	if (! monitor_sigwait_helper(set, ret, save_errno, info_ptr)) {
+	    break;
+	}
+	if (timeout != NULL) {
+	    now = monitor_clock_nsec();
+	    if (now >= deadline) {
+		ret = -1;
+		save_errno = EAGAIN;
+		break;
+	    }
+	    monitor_nsec_to_timespec(deadline - now, &remain);
+	    ts = &remain;
+	}
     }
-    while (monitor_sigwait_helper(set, ret, save_errno, info_ptr, &context));
 
     errno = save_errno;
     return ret;
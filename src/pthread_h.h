@@ -42,35 +42,110 @@
 #define _MONITOR_THREAD_H_
 
 #include "config.h"
+#include <sys/types.h>
 #ifdef MONITOR_USE_PTHREADS
 #include <pthread.h>
 #endif
-#include "queue.h"
+#include "monitor.h"
 
 #define MONITOR_TN_MAGIC  0x6d746e00
 
+/*
+ *  In the dynamic case, keep a __thread (initial-exec) pointer to the
+ *  thread node so that monitor_get_tn() is one TLS load from inside a
+ *  signal handler.  The static case (and any thread that monitor
+ *  didn't launch) uses pthread_getspecific() instead.
+ */
+#if defined(MONITOR_DYNAMIC) && defined(__GNUC__)
+#define MONITOR_USE_TLS  1
+#endif
+
+/*
+ *  Thread node states in the thread registry.  A node is published
+ *  on the registry once and never leaves it (except at fork), so
+ *  only tn_state changes as the node is reused.
+ */
+enum {
+    MONITOR_TN_FREE = 0,
+    MONITOR_TN_CLAIMED,
+    MONITOR_TN_ACTIVE,
+    MONITOR_TN_RETIRED
+};
+
+/*
+ *  Init-thread states.  Zero (done) is the normal case, the others are
+ *  only used with MONITOR_LAZY_INIT_THREAD.
+ */
+enum {
+    MONITOR_INIT_DONE = 0,
+    MONITOR_INIT_PENDING,
+    MONITOR_INIT_DUE,
+    MONITOR_INIT_RUNNING,
+    MONITOR_INIT_SKIPPED
+};
+
 typedef void *pthread_start_fcn_t(void *);
 
+/*
+ *  Each thread node starts on its own cache line (and its size is
+ *  rounded up to a whole number of lines), so threads that start and
+ *  stop together don't false share their fini and shootdown flags.
+ */
+#if defined(__powerpc64__)
+#define MONITOR_CACHE_LINE_SIZE  128
+#else
+#define MONITOR_CACHE_LINE_SIZE  64
+#endif
+
+#if defined(__GNUC__)
+#define MONITOR_CACHE_ALIGN  __attribute__ ((aligned (MONITOR_CACHE_LINE_SIZE)))
+#else
+#define MONITOR_CACHE_ALIGN
+#endif
+
+/*
+ *  Note: tn_next, tn_state, tn_free_next and tn_retire_epoch are read
+ *  by other threads without a lock, so they are never reset when the
+ *  node is reused.
+ *  Everything from tn_magic on is per-thread.
+ */
 struct monitor_thread_node {
-    LIST_ENTRY(monitor_thread_node) tn_links;
+    struct monitor_thread_node *tn_next;
+    struct monitor_thread_node *tn_free_next;
+    volatile long  tn_state;
+    long   tn_retire_epoch;
+    int    tn_magic;
+    int    tn_tid;
+    int    tn_index;
+    pid_t  tn_ktid;
 #ifdef MONITOR_USE_PTHREADS
     pthread_t  tn_self;
     pthread_start_fcn_t  *tn_start_routine;
 #endif
-    int    tn_magic;
-    int    tn_tid;
     void  *tn_arg;
     void  *tn_user_data;
     void  *tn_stack_bottom;
+    void  *tn_altstack;
     void  *tn_thread_info;
+    void  *tn_user_slot[MONITOR_USER_SLOTS];
+    volatile long  tn_fini_wait;
+    volatile long  tn_init_state;
+    volatile long  tn_sample_timer;
+    volatile long  tn_event_fd;
+    void  *tn_event_ring;
+    void  * volatile tn_trace;
+    void  * volatile tn_sig_stats;
+    int    tn_lazy_timer;
+    volatile long  tn_has_timer;
     char   tn_is_main;
     char   tn_ignore_threads;
+    char   tn_passthru;
     volatile char  tn_appl_started;
     volatile char  tn_fini_started;
     volatile char  tn_fini_done;
     volatile char  tn_exit_win;
     volatile char  tn_block_shootdown;
-};
+} MONITOR_CACHE_ALIGN;
 
 struct monitor_thread_node *monitor_get_tn(void);
 struct monitor_thread_node *monitor_get_main_tn(void);
@@ -36,6 +36,10 @@
 
 #include "config.h"
 #include <sys/types.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
 #ifdef MONITOR_DYNAMIC
 #include <dlfcn.h>
 #endif
@@ -47,8 +51,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "atomic.h"
 #include "common.h"
+#include "futex.h"
 #include "monitor.h"
+#include "pthread_h.h"
 #include "spinlock.h"
 
 #define MONITOR_CHOOSE_SHOOTDOWN_EARLY  1
@@ -67,21 +74,28 @@
 typedef int  sigaction_fcn_t(int, const struct sigaction *,
 			     struct sigaction *);
 typedef int  sigprocmask_fcn_t(int, const sigset_t *, sigset_t *);
+typedef int  signalfd_fcn_t(int, const sigset_t *, int);
 typedef void sighandler_fcn_t(int);
 
 #ifdef MONITOR_STATIC
 extern sigaction_fcn_t    __real_sigaction;
 extern sigprocmask_fcn_t  __real_sigprocmask;
+#ifdef __linux__
+extern signalfd_fcn_t     __real_signalfd;
+#endif
 #endif
 
 static sigaction_fcn_t    *real_sigaction = NULL;
 static sigprocmask_fcn_t  *real_sigprocmask = NULL;
+#ifdef __linux__
+static signalfd_fcn_t     *real_signalfd = NULL;
+#endif
 
+/*  The flags come first, so the handler's checks touch one line of
+ *  the entry.  mse_client_handler is the handler from
+ *  monitor_sigaction(), which is also on the signal's chain.
+ */
 struct monitor_signal_entry {
-    struct sigaction  mse_appl_act;
-    struct sigaction  mse_kern_act;
-    monitor_sighandler_t  *mse_client_handler;
-    int   mse_client_flags;
     char  mse_avoid;
     char  mse_invalid;
     char  mse_noterm;
@@ -90,11 +104,59 @@ struct monitor_signal_entry {
     char  mse_blocked;
     char  mse_appl_hand;
     char  mse_keep_open;
+    char  mse_direct;
+    int   mse_client_flags;
+    monitor_sighandler_t  *mse_client_handler;
+    struct sigaction  mse_appl_act;
+    struct sigaction  mse_kern_act;
+    struct monitor_signal_stats  mse_stats;
 };
 
+/*  Signal stats (MONITOR_SIGNAL_STATS).  Each thread node has a block
+ *  of counters per signal that only that thread writes, so the
+ *  counters are plain increments.  When a thread exits, its counts
+ *  are added to mse_stats (the retired totals) and the block is
+ *  cleared for the next thread with that node.  All the blocks are
+ *  on a list for reading.
+ */
+struct monitor_sigstat_block {
+    struct monitor_sigstat_block *sb_next;
+    int  sb_index;
+    struct monitor_signal_stats  sb_stats[MONITOR_NSIG];
+};
+
+/*  Client handler chains.  Each chain is an immutable array of
+ *  handlers in priority order, and the dispatch table holds one
+ *  pointer per signal.  Adding or removing a handler builds a new
+ *  chain and swaps the pointer, so a handler that is running (or
+ *  about to run) in another thread still sees a consistent chain.
+ *  Old chains are never freed; they are small and changes are rare.
+ */
+struct monitor_chain_entry {
+    monitor_sighandler_t  *ce_handler;
+    int  ce_priority;
+};
+
+struct monitor_chain {
+    int  ch_num;
+    struct monitor_chain_entry  ch_entry[1];
+};
+
+#define MONITOR_CHAIN_MAX  32
+#define MONITOR_CHAIN_ARENA_SIZE  4096
+
+static struct monitor_chain * volatile monitor_dispatch[MONITOR_NSIG];
+
+static char  *monitor_chain_arena = NULL;
+static size_t monitor_chain_avail = 0;
+
 static struct monitor_signal_entry
 monitor_signal_array[MONITOR_NSIG];
 
+static int monitor_sigstat_on = 0;
+static struct monitor_sigstat_block * volatile monitor_sigstat_list = NULL;
+static struct monitor_sigstat_block * volatile monitor_sigstat_shared = NULL;
+
 /*  Signals that monitor treats as totally hands-off.
  */
 static int monitor_signal_avoid_list[] = {
@@ -150,8 +212,52 @@ static spinlock_t monitor_signal_lock = SPINLOCK_UNLOCKED;
 
 static int last_resort_signal = SIGWINCH;
 static int shootdown_signal = -1;
+static int fork_timer_signal = -1;
+static volatile char monitor_has_client_signals = 0;
+
+/*  Direct-install mode (MONITOR_DIRECT_SIGNALS): signals that monitor
+ *  doesn't need go straight to the application's action instead of
+ *  through monitor_signal_handler().
+ */
+static char monitor_direct_signals = 0;
+
+/*  Size in bytes of the per-thread alternate signal stack for client
+ *  handlers (MONITOR_ALTSTACK_SIZE, in KB), or 0 for none.
+ */
+static size_t monitor_altstack_bytes = 0;
+
+/*  The keep open list as a sigset, so the mask overrides can filter a
+ *  set a word at a time.  The generation changes whenever the set
+ *  does, and monitor_mask_filter is 0 when there is nothing that
+ *  needs filtering (no client signals and no thread shootdown).
+ */
+#define MONITOR_SIGSET_WORDS  (sizeof(sigset_t) / sizeof(unsigned long))
+
+static sigset_t monitor_keep_open_set;
+static volatile int  monitor_keep_open_gen = 0;
+static volatile char monitor_mask_filter = 0;
+
+/*  Per-thread shadow of which keep open signals are blocked, so
+ *  SIG_SETMASK doesn't need a syscall to read the current mask.  The
+ *  shadow is valid when its generation matches the keep open set,
+ *  and -1 means we're inside a handler where the kernel has changed
+ *  the mask, so read it and don't remember it.
+ */
+#if defined(MONITOR_DYNAMIC) && defined(__GNUC__)
+#define MONITOR_USE_MASK_SHADOW  1
+#define MONITOR_MASK_IN_HANDLER  -1
+
+static __thread int monitor_shadow_gen
+    __attribute__ ((tls_model ("initial-exec"))) = 0;
+static __thread sigset_t monitor_shadow_blocked
+    __attribute__ ((tls_model ("initial-exec")));
+#endif
 
 static void monitor_choose_shootdown_early(void);
+static void monitor_keep_open_update(void);
+static void monitor_altstack_init(void);
+static int  monitor_use_direct(int, const struct sigaction *);
+static int  monitor_install_direct(int, struct monitor_signal_entry *);
 static inline int monitor_adjust_samask(sigset_t *);
 
 /*
@@ -160,6 +266,148 @@ static inline int monitor_adjust_samask(sigset_t *);
  *----------------------------------------------------------------------
  */
 
+/*
+ *  The kernel blocks the handler's sa_mask while a handler runs and
+ *  sigreturn restores the old mask, so a handler can't use (or
+ *  learn) the mask shadow.  If the handler siglongjmp()s out, the
+ *  thread just keeps reading the real mask.
+ */
+int
+monitor_sigmask_shadow_enter(void)
+{
+#ifdef MONITOR_USE_MASK_SHADOW
+    int gen = monitor_shadow_gen;
+
+    monitor_shadow_gen = MONITOR_MASK_IN_HANDLER;
+    return gen;
+#else
+    return 0;
+#endif
+}
+
+void
+monitor_sigmask_shadow_leave(int gen)
+{
+#ifdef MONITOR_USE_MASK_SHADOW
+    monitor_shadow_gen = gen;
+#endif
+}
+
+/*
+ *  Run the client handlers for sig in priority order until one of
+ *  them returns 0.
+ *
+ *  Returns: 0 if some handler accepted the signal, else 1.
+ */
+static inline int
+monitor_run_chain(struct monitor_chain *chain, int sig,
+		  siginfo_t *info, void *context)
+{
+    int k;
+
+    for (k = 0; k < chain->ch_num; k++) {
+	if ((chain->ch_entry[k].ce_handler)(sig, info, context) == 0) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ *  Returns: the calling thread's counters for sig, or NULL if stats
+ *  are off.  Threads without a node share a block.  A new block is
+ *  published with compare and swap in case a nested handler in this
+ *  thread makes one first (the loser is leaked, it's one page).
+ */
+static struct monitor_signal_stats *
+monitor_sigstat_get(int sig)
+{
+    struct monitor_thread_node *tn;
+    struct monitor_sigstat_block *sb, *head;
+    void * volatile *addr;
+    void *buf;
+
+    if (! monitor_sigstat_on) {
+	return (NULL);
+    }
+    tn = monitor_get_tn();
+    addr = (tn != NULL) ? (void * volatile *) &tn->tn_sig_stats
+	: (void * volatile *) &monitor_sigstat_shared;
+    sb = *addr;
+    if (sb == NULL) {
+	buf = mmap(NULL, sizeof(struct monitor_sigstat_block),
+		   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (buf == MAP_FAILED) {
+	    return (NULL);
+	}
+	sb = buf;
+	sb->sb_index = (tn != NULL) ? tn->tn_index : -1;
+	if (compare_and_swap_ptr(addr, NULL, sb) != NULL) {
+	    sb = *addr;
+	} else {
+	    do {
+		head = monitor_sigstat_list;
+		sb->sb_next = head;
+	    } while (compare_and_swap_ptr((void * volatile *) &monitor_sigstat_list,
+					  head, sb) != head);
+	}
+    }
+    return (&sb->sb_stats[sig]);
+}
+
+/*
+ *  Threads without a node all count in the shared block at the same
+ *  time, so that one needs atomic adds.  A thread's own block is only
+ *  written by that thread.
+ */
+static inline int
+monitor_sigstat_is_shared(struct monitor_signal_stats *ss)
+{
+    struct monitor_sigstat_block *sb = monitor_sigstat_shared;
+
+    return (sb != NULL && ss >= &sb->sb_stats[0]
+	    && ss < &sb->sb_stats[MONITOR_NSIG]);
+}
+
+static inline void
+monitor_sigstat_inc(struct monitor_signal_stats *ss, unsigned long *counter)
+{
+    if (monitor_sigstat_is_shared(ss)) {
+	fetch_and_add((volatile long *) counter, 1);
+    } else {
+	(*counter)++;
+    }
+}
+
+/*
+ *  Run the client's chain and count the time in the client handlers,
+ *  and whether they declined the signal.
+ */
+static inline int
+monitor_offer_client(struct monitor_chain *chain, struct monitor_signal_stats *ss,
+		     int sig, siginfo_t *info, void *context)
+{
+    unsigned long long start, cycles;
+    int ret;
+
+    if (ss == NULL) {
+	return monitor_run_chain(chain, sig, info, context);
+    }
+    start = monitor_cycles();
+    ret = monitor_run_chain(chain, sig, info, context);
+    cycles = monitor_cycles() - start;
+    if (monitor_sigstat_is_shared(ss) && sizeof(long) == sizeof(cycles)) {
+	fetch_and_add((volatile long *) &ss->ss_client_cycles, (long) cycles);
+    } else {
+	ss->ss_client_cycles += cycles;
+    }
+    monitor_sigstat_inc(ss, &ss->ss_client_calls);
+    if (ret != 0) {
+	monitor_sigstat_inc(ss, &ss->ss_declined);
+    }
+    return (ret);
+}
+
 /*
  *  Offer a synchronous signal from sigwait() to the client.
  *
@@ -169,21 +417,25 @@ static inline int monitor_adjust_samask(sigset_t *);
 int
 monitor_sigwait_handler(int sig, siginfo_t *info, void *context)
 {
-    struct monitor_signal_entry *mse;
-    int ret;
+    struct monitor_signal_stats *ss;
+    struct monitor_chain *chain;
 
     monitor_signal_init();
 
     if (sig <= 0 || sig >= MONITOR_NSIG) {
 	return 1;
     }
+    monitor_broadcast_relay(sig, info);
 
-    mse = &monitor_signal_array[sig];
-    if (mse->mse_client_handler != NULL) {
-	ret = (mse->mse_client_handler)(sig, info, context);
-	if (ret == 0) {
-	    return 0;
-	}
+    ss = monitor_sigstat_get(sig);
+    if (ss != NULL) {
+	monitor_sigstat_inc(ss, &ss->ss_delivered);
+    }
+    chain = monitor_dispatch[sig];
+    if (chain != NULL) {
+	monitor_fork_lazy_due();
+	monitor_thread_lazy_due();
+	return monitor_offer_client(chain, ss, sig, info, context);
     }
 
     return 1;
@@ -197,8 +449,10 @@ static void
 monitor_signal_handler(int sig, siginfo_t *info, void *context)
 {
     struct monitor_signal_entry *mse;
+    struct monitor_signal_stats *ss;
+    struct monitor_chain *chain;
     struct sigaction action, *sa;
-    int ret;
+    int ret, shadow_gen;
 
     if (sig <= 0 || sig >= MONITOR_NSIG ||
 	monitor_signal_array[sig].mse_avoid ||
@@ -207,15 +461,26 @@ monitor_signal_handler(int sig, siginfo_t *info, void *context)
 	MONITOR_WARN("invalid signal: %d\n", sig);
 	return;
     }
+    monitor_broadcast_relay(sig, info);
+
+    ss = monitor_sigstat_get(sig);
+    if (ss != NULL) {
+	monitor_sigstat_inc(ss, &ss->ss_delivered);
+    }
 
     /*
-     * Try the client first, if it has registered a handler.  If the
-     * client returns, then its return code describes what further
-     * action to take, where 0 means no further action.
+     * Try the client first, if it has registered any handlers.  The
+     * handlers run in priority order, and a return value of 0 means
+     * no further action (no more handlers and not the application).
      */
     mse = &monitor_signal_array[sig];
-    if (mse->mse_client_handler != NULL) {
-	ret = (mse->mse_client_handler)(sig, info, context);
+    chain = monitor_dispatch[sig];
+    if (chain != NULL) {
+	monitor_fork_lazy_due();
+	monitor_thread_lazy_due();
+	shadow_gen = monitor_sigmask_shadow_enter();
+	ret = monitor_offer_client(chain, ss, sig, info, context);
+	monitor_sigmask_shadow_leave(shadow_gen);
 	if (ret == 0) {
 	    return;
 	}
@@ -267,11 +532,13 @@ monitor_signal_handler(int sig, siginfo_t *info, void *context)
 	/*
 	 * Invoke the application's handler.
 	 */
+	shadow_gen = monitor_sigmask_shadow_enter();
 	if (sa->sa_flags & SA_SIGINFO) {
 	    (*sa->sa_sigaction)(sig, info, context);
 	} else {
 	    (*sa->sa_handler)(sig);
 	}
+	monitor_sigmask_shadow_leave(shadow_gen);
     }
 }
 
@@ -285,7 +552,7 @@ monitor_signal_init(void)
     struct monitor_signal_entry *mse;
     struct sigaction *sa;
     char buf[MONITOR_SIG_BUF_SIZE];
-    int num_avoid, num_valid, num_invalid;
+    int num_avoid, num_valid, num_invalid, num_direct;
     int i, sig, ret;
 
     MONITOR_RUN_ONCE(signal_init);
@@ -315,35 +582,69 @@ monitor_signal_init(void)
     monitor_choose_shootdown_early();
     monitor_signal_array[shootdown_signal].mse_keep_open = 1;
 
+    if (getenv("MONITOR_DIRECT_SIGNALS") != NULL) {
+	monitor_direct_signals = 1;
+    }
+    if (getenv("MONITOR_SIGNAL_STATS") != NULL) {
+	monitor_sigstat_on = 1;
+    }
+    monitor_altstack_init();
+
     /*
-     * Install our signal handler for all signals.
+     * Install our signal handler for all signals.  In direct mode,
+     * leave alone the signals where the current action doesn't need
+     * us (we'll still see any later sigaction() calls).
      */
     num_avoid = 0;
     num_valid = 0;
     num_invalid = 0;
+    num_direct = 0;
     for (sig = 1; sig < MONITOR_NSIG; sig++) {
 	mse = &monitor_signal_array[sig];
 	if (mse->mse_avoid) {
 	    num_avoid++;
+	    continue;
+	}
+	sa = &mse->mse_kern_act;
+	sa->sa_sigaction = &monitor_signal_handler;
+	sigemptyset(&sa->sa_mask);
+	monitor_adjust_samask(&sa->sa_mask);
+	sa->sa_flags = SAFLAGS_REQUIRED;
+	if (monitor_direct_signals) {
+	    ret = (*real_sigaction)(sig, NULL, &mse->mse_appl_act);
+	    if (ret == 0 && monitor_use_direct(sig, &mse->mse_appl_act)) {
+		mse->mse_direct = 1;
+		num_direct++;
+	    }
+	    else if (ret == 0) {
+		ret = (*real_sigaction)(sig, sa, NULL);
+	    }
 	} else {
-	    sa = &mse->mse_kern_act;
-	    sa->sa_sigaction = &monitor_signal_handler;
-	    sigemptyset(&sa->sa_mask);
-	    monitor_adjust_samask(&sa->sa_mask);
-	    sa->sa_flags = SAFLAGS_REQUIRED;
 	    ret = (*real_sigaction)(sig, sa, &mse->mse_appl_act);
-	    if (ret == 0) {
-		num_valid++;
-	    } else {
-		mse->mse_invalid = 1;
-		num_invalid++;
-	    }
+	}
+	if (ret == 0) {
+	    num_valid++;
+	} else {
+	    mse->mse_invalid = 1;
+	    num_invalid++;
 	}
     }
 
-    if (monitor_debug) {
-	MONITOR_DEBUG("valid: %d, invalid: %d, avoid: %d, max signum: %d\n",
-		      num_valid, num_invalid, num_avoid, MONITOR_NSIG - 1);
+    /*
+     * The mask overrides only need to filter if there is something
+     * to keep open: client signals (configured now or registered
+     * later) or the shootdown signal when threads have callbacks.
+     */
+    monitor_keep_open_update();
+    if (monitor_debug || monitor_signal_open_list[0] > 0
+	|| monitor_client_thread_callbacks() != 0) {
+	monitor_mask_filter = 1;
+    }
+
+    if (monitor_debug || monitor_trace) {
+	MONITOR_DEBUG("valid: %d, invalid: %d, avoid: %d, direct: %d, "
+		      "max signum: %d\n", num_valid, num_invalid, num_avoid,
+		      num_direct, MONITOR_NSIG - 1);
 
         monitor_signal_list_string(buf, MONITOR_SIG_BUF_SIZE,
 				   monitor_signal_open_list);
@@ -362,6 +663,52 @@ monitor_signal_init(void)
  *----------------------------------------------------------------------
  */
 
+/*
+ *  Rebuild the keep open sigset from monitor_signal_array[] and start
+ *  a new generation so that every thread's mask shadow is stale.
+ */
+static void
+monitor_keep_open_update(void)
+{
+    struct monitor_signal_entry *mse;
+    sigset_t keep_set;
+    int sig;
+
+    sigemptyset(&keep_set);
+    for (sig = 1; sig < MONITOR_NSIG; sig++) {
+	mse = &monitor_signal_array[sig];
+	if (!mse->mse_avoid && !mse->mse_invalid && mse->mse_keep_open) {
+	    sigaddset(&keep_set, sig);
+	}
+    }
+    monitor_keep_open_set = keep_set;
+    monitor_keep_open_gen++;
+}
+
+/*
+ *  Returns: 1 if the mask overrides need to filter the keep open
+ *  list, 0 if they can pass straight through.
+ */
+int
+monitor_sigmask_filter_used(void)
+{
+    return (monitor_mask_filter);
+}
+
+/*
+ *  The client changed its mask via monitor_real_sigprocmask(), so
+ *  this thread's shadow may be wrong.
+ */
+void
+monitor_sigmask_shadow_reset(void)
+{
+#ifdef MONITOR_USE_MASK_SHADOW
+    if (monitor_shadow_gen != MONITOR_MASK_IN_HANDLER) {
+	monitor_shadow_gen = 0;
+    }
+#endif
+}
+
 /*
  *  Adjust the signal set so the application can't change the mask for
  *  any signal in the keep open list.
@@ -369,16 +716,19 @@ monitor_signal_init(void)
 void
 monitor_remove_client_signals(sigset_t *set, int how)
 {
-    struct monitor_signal_entry *mse;
+    unsigned long *word = (unsigned long *) set;
+    unsigned long *keep = (unsigned long *) &monitor_keep_open_set;
+    unsigned long *blocked;
     char buf[MONITOR_SIG_BUF_SIZE];
     char *type = "";
-    int sig;
+    sigset_t cur_set;
+    int k;
 
     if (set == NULL) {
 	return;
     }
 
-    if (monitor_debug) {
+    if (monitor_debug || monitor_trace) {
 	if (how == SIG_BLOCK) { type = "block"; }
 	else if (how == SIG_UNBLOCK) { type = "unblock"; }
 	else { type = "setmask"; }
@@ -392,39 +742,46 @@ monitor_remove_client_signals(sigset_t *set, int how)
 	 * For BLOCK and UNBLOCK, remove from 'set' any signals in the
 	 * keep open list.
 	 */
-	for (sig = 1; sig < MONITOR_NSIG; sig++) {
-	    mse = &monitor_signal_array[sig];
-	    if (!mse->mse_avoid && !mse->mse_invalid && mse->mse_keep_open) {
-		sigdelset(set, sig);
-	    }
+	for (k = 0; k < MONITOR_SIGSET_WORDS; k++) {
+	    word[k] &= ~keep[k];
 	}
     }
     else {
 	/*
-	 * For SETMASK, get the current mask and require that 'set'
-	 * has the same value for all signals in the keep open list.
+	 * For SETMASK, require that 'set' has the current value for
+	 * all signals in the keep open list.  Take the current value
+	 * from the thread's shadow if it's valid, else read the mask
+	 * (and remember it, if not inside a handler).
 	 */
-	sigset_t cur_set;
+#ifdef MONITOR_USE_MASK_SHADOW
+	if (monitor_shadow_gen == monitor_keep_open_gen) {
+	    blocked = (unsigned long *) &monitor_shadow_blocked;
+	}
+	else {
+	    (*real_sigprocmask)(0, NULL, &cur_set);
+	    blocked = (unsigned long *) &cur_set;
+	    if (monitor_shadow_gen != MONITOR_MASK_IN_HANDLER) {
+		monitor_shadow_blocked = cur_set;
+		monitor_shadow_gen = monitor_keep_open_gen;
+	    }
+	}
+#else
 	(*real_sigprocmask)(0, NULL, &cur_set);
+	blocked = (unsigned long *) &cur_set;
+#endif
 
-	if (monitor_debug) {
-	    monitor_sigset_string(buf, MONITOR_SIG_BUF_SIZE, &cur_set);
+	if (monitor_debug || monitor_trace) {
+	    monitor_sigset_string(buf, MONITOR_SIG_BUF_SIZE,
+				  (sigset_t *) blocked);
 	    MONITOR_DEBUG("(%s) current:%s\n", type, buf);
 	}
 
-	for (sig = 1; sig < MONITOR_NSIG; sig++) {
-	    mse = &monitor_signal_array[sig];
-	    if (!mse->mse_avoid && !mse->mse_invalid && mse->mse_keep_open) {
-		if (sigismember(&cur_set, sig)) {
-		    sigaddset(set, sig);
-		} else {
-		    sigdelset(set, sig);
-		}
-	    }
+	for (k = 0; k < MONITOR_SIGSET_WORDS; k++) {
+	    word[k] = (word[k] & ~keep[k]) | (blocked[k] & keep[k]);
 	}
     }
 
-    if (monitor_debug) {
+    if (monitor_debug || monitor_trace) {
 	monitor_sigset_string(buf, MONITOR_SIG_BUF_SIZE, set);
 	MONITOR_DEBUG("(%s) actual: %s\n", type, buf);
     }
@@ -541,6 +898,39 @@ monitor_shootdown_signal(void)
     return shootdown_signal;
 }
 
+/*
+ *  Return a second unused signal for the lazy fork lifetime timer.
+ *  This is never the shootdown signal, which the lazy init-thread
+ *  timer uses, so both timers can run in the same child.  The signal
+ *  is held open like the shootdown signal.
+ *
+ *  Returns: the signal, or -1 if none is available.
+ */
+int
+monitor_fork_timer_signal(void)
+{
+    int i, sig;
+
+    if (fork_timer_signal > 0) {
+	return fork_timer_signal;
+    }
+    monitor_shootdown_signal();
+
+    MONITOR_SIGNAL_LOCK;
+    for (i = 0; fork_timer_signal < 0 && monitor_shootdown_list[i] > 0; i++) {
+	sig = monitor_shootdown_list[i];
+	if (sig != shootdown_signal
+	    && ! monitor_signal_array[sig].mse_keep_open) {
+	    monitor_signal_array[sig].mse_keep_open = 1;
+	    fork_timer_signal = sig;
+	}
+    }
+    MONITOR_SIGNAL_UNLOCK;
+
+    MONITOR_DEBUG("fork timer signal = %d\n", fork_timer_signal);
+    return fork_timer_signal;
+}
+
 #if 0
 /*
  *  Old, delayed way of choosing the shootdown signal and keeping the
@@ -720,7 +1110,55 @@ monitor_shootdown_signal(void)
 static inline int
 monitor_adjust_saflags(int flags)
 {
-    return (flags | SAFLAGS_REQUIRED) & ~(SAFLAGS_FORBIDDEN);
+    int forbidden = SAFLAGS_FORBIDDEN;
+
+    /*
+     * With alternate stacks, the application's SA_ONSTACK means the
+     * same as without monitor.
+     */
+    if (monitor_altstack_bytes > 0) {
+	forbidden &= ~SA_ONSTACK;
+    }
+    return (flags | SAFLAGS_REQUIRED) & ~forbidden;
+}
+
+/*
+ *  Allow MONITOR_ALTSTACK_SIZE to set the size (in KB) of an
+ *  alternate signal stack for each thread that monitor launches.
+ *  Signals with a client handler then run on that stack, so sampling
+ *  doesn't need to inflate every thread's stack.
+ */
+static void
+monitor_altstack_init(void)
+{
+    char *str;
+    long size;
+
+    str = getenv("MONITOR_ALTSTACK_SIZE");
+    if (str == NULL) {
+	return;
+    }
+    if (sscanf(str, "%ld", &size) < 1 || size < 0) {
+	MONITOR_WARN("bad value for MONITOR_ALTSTACK_SIZE: %s\n", str);
+	return;
+    }
+    size *= 1024;
+    if (size > 0 && size < MINSIGSTKSZ) {
+	size = MINSIGSTKSZ;
+    }
+    monitor_altstack_bytes = size;
+    MONITOR_DEBUG("alternate signal stack: %ld bytes\n", size);
+}
+
+/*
+ *  Returns: the size of the per-thread alternate signal stack, or 0
+ *  if not used.
+ */
+size_t
+monitor_signal_altstack_size(void)
+{
+    monitor_signal_init();
+    return (monitor_altstack_bytes);
 }
 
 /*
@@ -738,8 +1176,219 @@ monitor_adjust_samask(sigset_t *set)
 }
 
 /*
- *  The client's sigaction.  If "act" is non-NULL, then use it for
- *  sa_flags and sa_mask, but "flags" are unused for now.
+ *  In direct mode, monitor only needs to catch a signal if it's on
+ *  the keep open list, the client has a handler, or the action is the
+ *  default action that terminates the process (so we can run the
+ *  fini-process callback first).  SA_RESETHAND would leave a
+ *  terminating default behind, so we keep those also.
+ *
+ *  Returns: 1 if the kernel can run the application's action 'act'
+ *  directly.
+ */
+static int
+monitor_use_direct(int sig, const struct sigaction *act)
+{
+    struct monitor_signal_entry *mse = &monitor_signal_array[sig];
+
+    if (!monitor_direct_signals || mse->mse_keep_open
+	|| monitor_dispatch[sig] != NULL) {
+	return 0;
+    }
+    if (act->sa_handler == SIG_DFL) {
+	return (mse->mse_noterm || mse->mse_stop);
+    }
+    if (act->sa_handler == SIG_IGN) {
+	return 1;
+    }
+    return !(act->sa_flags & SA_RESETHAND);
+}
+
+/*
+ *  Give the kernel the application's action for sig, minus the keep
+ *  open signals in sa_mask.  Unlike our handler, we don't add the
+ *  shootdown signal: the application's handler runs without
+ *  monitor_sigmask_shadow_enter(), so the kernel must not change any
+ *  keep open signal in the mask, else a SIG_SETMASK inside the
+ *  handler would be filtered against a stale shadow.
+ */
+static int
+monitor_install_direct(int sig, struct monitor_signal_entry *mse)
+{
+    struct sigaction action;
+
+    action = mse->mse_appl_act;
+    if (action.sa_handler != SIG_DFL && action.sa_handler != SIG_IGN) {
+	monitor_remove_client_signals(&action.sa_mask, SIG_BLOCK);
+    }
+    mse->mse_direct = 1;
+
+    return (*real_sigaction)(sig, &action, NULL);
+}
+
+/*
+ *  Allocate space for a chain from the arena.  Called with the signal
+ *  lock held.
+ */
+static struct monitor_chain *
+monitor_chain_alloc(int num)
+{
+    size_t size;
+    char *arena;
+
+    size = sizeof(struct monitor_chain)
+	+ (num - 1) * sizeof(struct monitor_chain_entry);
+    size = (size + 15) & ~((size_t) 15);
+
+    if (size > monitor_chain_avail) {
+	arena = mmap(NULL, MONITOR_CHAIN_ARENA_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (arena == MAP_FAILED) {
+	    MONITOR_WARN1("mmap failed\n");
+	    return (NULL);
+	}
+	monitor_chain_arena = arena;
+	monitor_chain_avail = MONITOR_CHAIN_ARENA_SIZE;
+    }
+    arena = monitor_chain_arena;
+    monitor_chain_arena += size;
+    monitor_chain_avail -= size;
+
+    return ((struct monitor_chain *) arena);
+}
+
+/*
+ *  Replace sig's chain with a copy that drops the first entry for
+ *  old_hand (if non-NULL) and adds new_hand (if non-NULL) after any
+ *  handlers with the same or lower priority.
+ *
+ *  Returns: 0 on success, -1 if old_hand is not on the chain or if
+ *  out of space.
+ */
+static int
+monitor_chain_update(int sig, monitor_sighandler_t *old_hand,
+		     monitor_sighandler_t *new_hand, int priority)
+{
+    struct monitor_chain *old_chain, *new_chain;
+    struct monitor_chain_entry *entry;
+    int k, num, found, added;
+
+    MONITOR_SIGNAL_LOCK;
+    old_chain = monitor_dispatch[sig];
+    num = (old_chain != NULL) ? old_chain->ch_num : 0;
+
+    found = 0;
+    if (old_hand != NULL) {
+	for (k = 0; k < num; k++) {
+	    if (old_chain->ch_entry[k].ce_handler == old_hand) {
+		found = 1;
+		break;
+	    }
+	}
+	if (! found) {
+	    MONITOR_SIGNAL_UNLOCK;
+	    return (-1);
+	}
+    }
+    if (num - found + (new_hand != NULL) > MONITOR_CHAIN_MAX) {
+	MONITOR_SIGNAL_UNLOCK;
+	MONITOR_WARN("too many handlers for signal %d\n", sig);
+	return (-1);
+    }
+    if (num - found + (new_hand != NULL) == 0) {
+	monitor_dispatch[sig] = NULL;
+	MONITOR_SIGNAL_UNLOCK;
+	return (0);
+    }
+
+    new_chain = monitor_chain_alloc(num - found + (new_hand != NULL));
+    if (new_chain == NULL) {
+	MONITOR_SIGNAL_UNLOCK;
+	return (-1);
+    }
+    entry = &new_chain->ch_entry[0];
+    added = (new_hand == NULL);
+    for (k = 0; k < num; k++) {
+	if (found && old_chain->ch_entry[k].ce_handler == old_hand) {
+	    found = 0;
+	    continue;
+	}
+	if (!added && old_chain->ch_entry[k].ce_priority > priority) {
+	    entry->ce_handler = new_hand;
+	    entry->ce_priority = priority;
+	    entry++;
+	    added = 1;
+	}
+	*entry = old_chain->ch_entry[k];
+	entry++;
+    }
+    if (! added) {
+	entry->ce_handler = new_hand;
+	entry->ce_priority = priority;
+	entry++;
+    }
+    new_chain->ch_num = entry - &new_chain->ch_entry[0];
+
+    /*
+     * Make the new chain visible only after it's filled in.
+     */
+    memory_barrier();
+    monitor_dispatch[sig] = new_chain;
+    MONITOR_SIGNAL_UNLOCK;
+
+    return (0);
+}
+
+/*
+ *  Keep sig open for the client and make sure our handler is
+ *  installed for it, with SA_ONSTACK if we provide alternate stacks.
+ *  If "act" is non-NULL, then use it for sa_flags and sa_mask.
+ */
+static void
+monitor_client_install(int sig, struct sigaction *act)
+{
+    struct monitor_signal_entry *mse;
+    int old_flags;
+
+    mse = &monitor_signal_array[sig];
+    if (! mse->mse_keep_open) {
+	mse->mse_keep_open = 1;
+	monitor_keep_open_update();
+    }
+    monitor_mask_filter = 1;
+    if (monitor_dispatch[sig] != NULL) {
+	monitor_has_client_signals = 1;
+    }
+
+    old_flags = mse->mse_kern_act.sa_flags;
+    if (act != NULL) {
+	mse->mse_kern_act.sa_flags = monitor_adjust_saflags(act->sa_flags);
+	mse->mse_kern_act.sa_mask = act->sa_mask;
+	monitor_adjust_samask(&mse->mse_kern_act.sa_mask);
+    }
+    if (monitor_dispatch[sig] != NULL && monitor_altstack_bytes > 0) {
+	mse->mse_kern_act.sa_flags |= SA_ONSTACK;
+    }
+    if (act != NULL || mse->mse_direct
+	|| mse->mse_kern_act.sa_flags != old_flags) {
+	mse->mse_direct = 0;
+	(*real_sigaction)(sig, &mse->mse_kern_act, NULL);
+    }
+}
+
+static int
+monitor_client_sig_valid(int sig)
+{
+    return (sig > 0 && sig < MONITOR_NSIG
+	    && !monitor_signal_array[sig].mse_avoid
+	    && !monitor_signal_array[sig].mse_invalid);
+}
+
+/*
+ *  The client's sigaction.  This sets the one handler for sig from
+ *  monitor_sigaction() (at the default priority), replacing the
+ *  previous one, and a NULL handler removes it.  If "act" is
+ *  non-NULL, then use it for sa_flags and sa_mask, but "flags" are
+ *  unused for now.
  *
  *  Returns: 0 on success, -1 if invalid signal number.
  */
@@ -750,28 +1399,250 @@ monitor_sigaction(int sig, monitor_sighandler_t *handler,
     struct monitor_signal_entry *mse;
 
     monitor_signal_init();
-    if (sig <= 0 || sig >= MONITOR_NSIG ||
-	monitor_signal_array[sig].mse_avoid ||
-	monitor_signal_array[sig].mse_invalid) {
+    if (! monitor_client_sig_valid(sig)) {
 	MONITOR_DEBUG("client sigaction: %d (invalid)\n", sig);
 	return (-1);
     }
     mse = &monitor_signal_array[sig];
-    mse->mse_keep_open = 1;
 
     MONITOR_DEBUG("client sigaction: %d (caught)\n", sig);
+    if (mse->mse_client_handler != handler
+	&& monitor_chain_update(sig, mse->mse_client_handler, handler,
+				MONITOR_SIG_PRIO_DEFAULT) != 0) {
+	return (-1);
+    }
     mse->mse_client_handler = handler;
     mse->mse_client_flags = flags;
-    if (act != NULL) {
-	mse->mse_kern_act.sa_flags = monitor_adjust_saflags(act->sa_flags);
-	mse->mse_kern_act.sa_mask = act->sa_mask;
-	monitor_adjust_samask(&mse->mse_kern_act.sa_mask);
-	(*real_sigaction)(sig, &mse->mse_kern_act, NULL);
+    monitor_client_install(sig, act);
+
+    return (0);
+}
+
+/*
+ *  Add another client handler for sig.  Handlers run in order of
+ *  priority (lowest first, and in order of registration for equal
+ *  priorities) until one returns 0.
+ *
+ *  Returns: 0 on success, -1 if invalid signal number or too many
+ *  handlers.
+ */
+int
+monitor_sigaction_add(int sig, monitor_sighandler_t *handler, int priority)
+{
+    monitor_signal_init();
+    if (! monitor_client_sig_valid(sig) || handler == NULL) {
+	MONITOR_DEBUG("client sigaction add: %d (invalid)\n", sig);
+	return (-1);
     }
+    MONITOR_DEBUG("client sigaction add: %d (priority %d)\n", sig, priority);
+    if (monitor_chain_update(sig, NULL, handler, priority) != 0) {
+	return (-1);
+    }
+    monitor_client_install(sig, NULL);
 
     return (0);
 }
 
+/*
+ *  Remove one client handler for sig, added with either
+ *  monitor_sigaction() or monitor_sigaction_add().  The signal stays
+ *  on the keep open list.
+ *
+ *  Returns: 0 on success, -1 if the handler is not registered.
+ */
+int
+monitor_sigaction_remove(int sig, monitor_sighandler_t *handler)
+{
+    struct monitor_signal_entry *mse;
+
+    monitor_signal_init();
+    if (! monitor_client_sig_valid(sig) || handler == NULL) {
+	return (-1);
+    }
+    MONITOR_DEBUG("client sigaction remove: %d\n", sig);
+    if (monitor_chain_update(sig, handler, NULL, 0) != 0) {
+	return (-1);
+    }
+    mse = &monitor_signal_array[sig];
+    if (mse->mse_client_handler == handler) {
+	mse->mse_client_handler = NULL;
+    }
+
+    return (0);
+}
+
+/*
+ *  Add the counts in src to dest.
+ */
+static void
+monitor_sigstat_add(struct monitor_signal_stats *dest,
+		    struct monitor_signal_stats *src)
+{
+    dest->ss_delivered += src->ss_delivered;
+    dest->ss_client_calls += src->ss_client_calls;
+    dest->ss_declined += src->ss_declined;
+    dest->ss_swallowed += src->ss_swallowed;
+    dest->ss_client_cycles += src->ss_client_cycles;
+}
+
+/*
+ *  Fill in the signal stats for signal sig (or 0 for all signals) and
+ *  thread index (or -1 for all threads, including ones that have
+ *  exited).  Client cycles are from the time stamp counter (or else
+ *  nanoseconds).
+ *
+ *  Returns: 0 on success, or -1 if stats are off (set
+ *  MONITOR_SIGNAL_STATS) or sig is invalid.
+ */
+int
+monitor_get_signal_stats(int sig, int thread_index,
+			 struct monitor_signal_stats *stats)
+{
+    struct monitor_sigstat_block *sb;
+    int first, last, k;
+
+    monitor_signal_init();
+    if (! monitor_sigstat_on || stats == NULL
+	|| sig < 0 || sig >= MONITOR_NSIG) {
+	return (-1);
+    }
+    first = (sig == 0) ? 1 : sig;
+    last = (sig == 0) ? MONITOR_NSIG - 1 : sig;
+
+    memset(stats, 0, sizeof(*stats));
+    for (k = first; k <= last; k++) {
+	if (thread_index < 0) {
+	    monitor_sigstat_add(stats, &monitor_signal_array[k].mse_stats);
+	}
+	for (sb = monitor_sigstat_list; sb != NULL; sb = sb->sb_next) {
+	    if (thread_index < 0 || sb->sb_index == thread_index) {
+		monitor_sigstat_add(stats, &sb->sb_stats[k]);
+	    }
+	}
+    }
+    return (0);
+}
+
+/*
+ *  Count a signal that the sigwait() override took and didn't
+ *  return to the application.
+ */
+void
+monitor_signal_stats_swallow(int sig)
+{
+    struct monitor_signal_stats *ss;
+
+    if (sig > 0 && sig < MONITOR_NSIG && (ss = monitor_sigstat_get(sig)) != NULL) {
+	monitor_sigstat_inc(ss, &ss->ss_swallowed);
+    }
+}
+
+/*
+ *  Move the counts from an exiting thread's block to the totals and
+ *  clear the block for the node's next thread.
+ */
+void
+monitor_signal_stats_retire(void *block)
+{
+    struct monitor_sigstat_block *sb = block;
+    int sig;
+
+    if (sb == NULL) {
+	return;
+    }
+    MONITOR_SIGNAL_LOCK;
+    for (sig = 1; sig < MONITOR_NSIG; sig++) {
+	monitor_sigstat_add(&monitor_signal_array[sig].mse_stats,
+			    &sb->sb_stats[sig]);
+    }
+    MONITOR_SIGNAL_UNLOCK;
+    memset(sb->sb_stats, 0, sizeof(sb->sb_stats));
+}
+
+/*
+ *  In the child after fork, start the counts over.
+ */
+void
+monitor_signal_stats_reset(void)
+{
+    struct monitor_sigstat_block *sb;
+    int sig;
+
+    if (! monitor_sigstat_on) {
+	return;
+    }
+    for (sig = 1; sig < MONITOR_NSIG; sig++) {
+	memset(&monitor_signal_array[sig].mse_stats, 0,
+	       sizeof(struct monitor_signal_stats));
+    }
+    for (sb = monitor_sigstat_list; sb != NULL; sb = sb->sb_next) {
+	memset(sb->sb_stats, 0, sizeof(sb->sb_stats));
+    }
+}
+
+/*
+ *  Print the signal stats at process exit: totals per signal and
+ *  then per thread index (for the threads still running).
+ */
+void
+monitor_signal_stats_report(void)
+{
+    struct monitor_signal_stats stats;
+    struct monitor_sigstat_block *sb;
+    int sig, pid;
+
+    if (! monitor_sigstat_on) {
+	return;
+    }
+    pid = getpid();
+    fprintf(stderr, "monitor signal stats [%d]: %5s %12s %12s %12s %12s %16s %10s\n",
+	    pid, "sig", "delivered", "client", "declined", "swallowed",
+	    "client cycles", "per call");
+    for (sig = 1; sig < MONITOR_NSIG; sig++) {
+	monitor_get_signal_stats(sig, -1, &stats);
+	if (stats.ss_delivered == 0 && stats.ss_swallowed == 0) {
+	    continue;
+	}
+	fprintf(stderr, "monitor signal stats [%d]: %5d %12lu %12lu %12lu %12lu %16llu %10llu\n",
+		pid, sig, stats.ss_delivered, stats.ss_client_calls,
+		stats.ss_declined, stats.ss_swallowed, stats.ss_client_cycles,
+		stats.ss_client_cycles / (stats.ss_client_calls ? stats.ss_client_calls : 1));
+    }
+    for (sb = monitor_sigstat_list; sb != NULL; sb = sb->sb_next) {
+	memset(&stats, 0, sizeof(stats));
+	for (sig = 1; sig < MONITOR_NSIG; sig++) {
+	    monitor_sigstat_add(&stats, &sb->sb_stats[sig]);
+	}
+	if (stats.ss_delivered == 0 && stats.ss_swallowed == 0) {
+	    continue;
+	}
+	fprintf(stderr, "monitor signal stats [%d]: index %3d %10lu %12lu %12lu %12lu %16llu %10llu\n",
+		pid, sb->sb_index, stats.ss_delivered, stats.ss_client_calls,
+		stats.ss_declined, stats.ss_swallowed, stats.ss_client_cycles,
+		stats.ss_client_cycles / (stats.ss_client_calls ? stats.ss_client_calls : 1));
+    }
+}
+
+/*
+ *  Returns: 1 if the client has installed any signal handler with
+ *  monitor_sigaction().
+ */
+int
+monitor_client_signals_used(void)
+{
+    return (monitor_has_client_signals);
+}
+
+/*
+ *  Returns: 1 if the client has a handler for sig from
+ *  monitor_sigaction().
+ */
+int
+monitor_client_signal_handled(int sig)
+{
+    return (sig > 0 && sig < MONITOR_NSIG && monitor_dispatch[sig] != NULL);
+}
+
 /*
  *  Client function for generating a core file.  Reset the default
  *  signal handler, clear the signal mask and raise SIGABRT.
@@ -852,10 +1723,19 @@ monitor_appl_sigaction(int sig, const struct sigaction *act,
 	 */
 	mse->mse_appl_act = *act;
 	mse->mse_kern_act.sa_flags = monitor_adjust_saflags(act->sa_flags);
+	if (monitor_dispatch[sig] != NULL && monitor_altstack_bytes > 0) {
+	    mse->mse_kern_act.sa_flags |= SA_ONSTACK;
+	}
 	mse->mse_kern_act.sa_mask = act->sa_mask;
 	monitor_remove_client_signals(&mse->mse_kern_act.sa_mask, SIG_BLOCK);
 	monitor_adjust_samask(&mse->mse_kern_act.sa_mask);
-	(*real_sigaction)(sig, &mse->mse_kern_act, NULL);
+	if (monitor_use_direct(sig, act)) {
+	    MONITOR_DEBUG("application sigaction: %d (direct)\n", sig);
+	    monitor_install_direct(sig, mse);
+	} else {
+	    mse->mse_direct = 0;
+	    (*real_sigaction)(sig, &mse->mse_kern_act, NULL);
+	}
     }
 
     return (0);
@@ -897,7 +1777,7 @@ MONITOR_WRAP_NAME(sigprocmask)(int how, const sigset_t *set,
 
     monitor_signal_init();
 
-    if (set != NULL) {
+    if (set != NULL && monitor_mask_filter) {
 	MONITOR_DEBUG1("\n");
 	my_set = *set;
 	monitor_remove_client_signals(&my_set, how);
@@ -906,3 +1786,29 @@ MONITOR_WRAP_NAME(sigprocmask)(int how, const sigset_t *set,
 
     return (*real_sigprocmask)(how, set, oldset);
 }
+
+#ifdef __linux__
+/*
+ *  A signalfd(2) consumer dequeues signals without running a handler,
+ *  so a signal in the keep open list that is read from the fd would
+ *  never reach the client or shootdown.  Remove those signals from
+ *  the fd's mask, the same as for sigprocmask().
+ */
+int
+MONITOR_WRAP_NAME(signalfd)(int fd, const sigset_t *mask, int flags)
+{
+    sigset_t my_set;
+
+    monitor_signal_init();
+    MONITOR_GET_REAL_NAME_WRAP(real_signalfd, signalfd);
+
+    MONITOR_DEBUG1("\n");
+    if (monitor_mask_filter) {
+	my_set = *mask;
+	monitor_remove_client_signals(&my_set, SIG_BLOCK);
+	mask = &my_set;
+    }
+
+    return (*real_signalfd)(fd, mask, flags);
+}
+#endif
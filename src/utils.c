@@ -34,11 +34,24 @@
  *  $Id$
  */
 
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "common.h"
+#include "monitor.h"
+#include "atomic.h"
+#include "futex.h"
+#include "pthread_h.h"
 
 /*
  *  Print the list of signals in the set into the buffer, up to a size
@@ -146,3 +159,461 @@ monitor_signal_list_string(char *buf, int size, int *list)
 
     return num_sigs;
 }
+
+/*
+ *----------------------------------------------------------------------
+ *  BINARY DEBUG TRACE
+ *----------------------------------------------------------------------
+ */
+
+/*
+ *  With MONITOR_TRACE=prefix in the environment, the MONITOR_DEBUG
+ *  messages go to per-thread binary rings instead of stderr.  Each
+ *  record holds the timestamp, the format and function pointers (the
+ *  event id) and the raw args, taken in the same order that printf
+ *  would take them.  Writing a record is a slot reservation plus some
+ *  stores: no locks, no stdio and no syscalls (except to map a new
+ *  ring), so it's safe in signal handlers and cheap enough to leave on.
+ *
+ *  The rings are written to prefix.pid at library fini, or whenever
+ *  the client calls monitor_trace_dump().  The file has the format
+ *  and function strings for the records, and tests/trace_decode
+ *  turns it back into text.  MONITOR_TRACE_SIZE is the ring size per
+ *  thread in KB (default 64).  The oldest records are overwritten.
+ *
+ *  Note: the file format is also in tests/trace_decode.c.
+ */
+#define MONITOR_TRACE_MAGIC      "MONTRACE"
+#define MONITOR_TRACE_VERSION    1
+#define MONITOR_TRACE_ARG_BYTES  96
+#define MONITOR_TRACE_STR_MAX    64
+#define MONITOR_TRACE_KB         64
+#define MONITOR_TRACE_PATH_SIZE  500
+#define MONITOR_TRACE_SEEN_SIZE  1024
+
+#define MONITOR_TRACE_TYPE_STRING  1
+#define MONITOR_TRACE_TYPE_RECORD  2
+
+struct monitor_trace_rec {
+    uint64_t  tr_nsec;
+    uint64_t  tr_fmt;
+    uint64_t  tr_func;
+    int32_t   tr_pid;
+    int16_t   tr_thread;
+    uint16_t  tr_len;
+    char      tr_args[MONITOR_TRACE_ARG_BYTES];
+};
+
+struct monitor_trace_ring {
+    struct monitor_trace_ring *tr_next;
+    volatile long  tr_pos;
+    long    tr_dumped;
+    long    tr_slots;
+    size_t  tr_bytes;
+    pid_t   tr_pid;
+    struct monitor_trace_rec *tr_rec;
+};
+
+int monitor_trace = 0;
+
+static struct monitor_trace_ring * volatile monitor_trace_rings = NULL;
+static struct monitor_trace_ring * volatile monitor_trace_shared = NULL;
+static char monitor_trace_path[MONITOR_TRACE_PATH_SIZE];
+static long monitor_trace_slots = 0;
+static volatile long monitor_trace_dump_busy = 0;
+static int monitor_trace_file_started = 0;
+static uint64_t monitor_trace_seen[MONITOR_TRACE_SEEN_SIZE];
+
+/*
+ *  Read MONITOR_TRACE and MONITOR_TRACE_SIZE, called from
+ *  monitor_early_init().  The trace records the MONITOR_DEBUG
+ *  messages, but it's separate from monitor_debug, so it doesn't
+ *  change what monitor does (eg, which thread callbacks it makes).
+ */
+void
+monitor_trace_init(void)
+{
+    char *str;
+    long kb;
+
+    str = getenv("MONITOR_TRACE");
+    if (str == NULL || str[0] == 0
+	|| strlen(str) + 20 >= MONITOR_TRACE_PATH_SIZE) {
+	return;
+    }
+    strcpy(monitor_trace_path, str);
+
+    kb = MONITOR_TRACE_KB;
+    str = getenv("MONITOR_TRACE_SIZE");
+    if (str != NULL && sscanf(str, "%ld", &kb) == 1 && kb < 4) {
+	kb = 4;
+    }
+    monitor_trace_slots = (kb * 1024) / sizeof(struct monitor_trace_rec);
+    monitor_trace = 1;
+}
+
+/*
+ *  Map a new ring and add it to the list of rings.
+ */
+static struct monitor_trace_ring *
+monitor_trace_new_ring(void)
+{
+    struct monitor_trace_ring *ring, *head;
+    size_t bytes;
+    void *buf;
+
+    bytes = sizeof(struct monitor_trace_ring)
+	+ monitor_trace_slots * sizeof(struct monitor_trace_rec);
+    buf = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (buf == MAP_FAILED) {
+	return (NULL);
+    }
+    ring = buf;
+    ring->tr_pos = 0;
+    ring->tr_dumped = 0;
+    ring->tr_slots = monitor_trace_slots;
+    ring->tr_bytes = bytes;
+    ring->tr_pid = getpid();
+    ring->tr_rec = (struct monitor_trace_rec *) (ring + 1);
+
+    do {
+	head = monitor_trace_rings;
+	ring->tr_next = head;
+    } while (compare_and_swap_ptr((void * volatile *) &monitor_trace_rings,
+				  head, ring) != head);
+
+    return (ring);
+}
+
+/*
+ *  Returns: the calling thread's ring, or the shared ring if the
+ *  thread has no node yet.  A new ring is published with compare and
+ *  swap in case a signal handler in this thread makes one first.
+ *  The loser stays on the list (empty), we can't unlist it safely.
+ */
+static struct monitor_trace_ring *
+monitor_trace_get_ring(struct monitor_thread_node *tn)
+{
+    struct monitor_trace_ring *ring;
+    void * volatile *addr;
+
+    addr = (tn != NULL) ? (void * volatile *) &tn->tn_trace
+	: (void * volatile *) &monitor_trace_shared;
+    ring = *addr;
+    if (ring != NULL) {
+	return (ring);
+    }
+    ring = monitor_trace_new_ring();
+    if (ring == NULL) {
+	return (NULL);
+    }
+    if (compare_and_swap_ptr(addr, NULL, ring) != NULL) {
+	ring = *addr;
+    }
+    return (ring);
+}
+
+/*
+ *  Copy the args for fmt into buf, the same as printf would take
+ *  them: 8 bytes for each number and pointer, and strings inline
+ *  (with the null byte), up to MONITOR_TRACE_STR_MAX.  Stop if buf
+ *  fills up.
+ *
+ *  Returns: the number of bytes used.
+ */
+#define MONITOR_TRACE_PUT(val)  do {		\
+    if (pos + 8 > size)				\
+	return (pos);				\
+    memcpy(&buf[pos], &(val), 8);		\
+    pos += 8;					\
+} while (0)
+
+static int
+monitor_trace_args(char *buf, int size, const char *fmt, va_list ap)
+{
+    const char *p, *str;
+    uint64_t val;
+    double dval;
+    int pos, len, lng;
+
+    pos = 0;
+    for (p = fmt; *p != 0; p++) {
+	if (*p != '%') {
+	    continue;
+	}
+	p++;
+	if (*p == '%') {
+	    continue;
+	}
+	while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') {
+	    p++;
+	}
+	if (*p == '*') {
+	    val = (int64_t) va_arg(ap, int);
+	    MONITOR_TRACE_PUT(val);
+	    p++;
+	}
+	while (*p >= '0' && *p <= '9') {
+	    p++;
+	}
+	if (*p == '.') {
+	    p++;
+	    if (*p == '*') {
+		val = (int64_t) va_arg(ap, int);
+		MONITOR_TRACE_PUT(val);
+		p++;
+	    }
+	    while (*p >= '0' && *p <= '9') {
+		p++;
+	    }
+	}
+	lng = 0;
+	for (;; p++) {
+	    if (*p == 'l' || *p == 'z' || *p == 'j' || *p == 't') {
+		lng++;
+	    } else if (*p == 'L') {
+		lng = -1;
+	    } else if (*p != 'h') {
+		break;
+	    }
+	}
+	switch (*p) {
+	case 'd': case 'i':
+	    val = (lng >= 2) ? (int64_t) va_arg(ap, long long)
+		: (lng == 1) ? (int64_t) va_arg(ap, long)
+		: (int64_t) va_arg(ap, int);
+	    MONITOR_TRACE_PUT(val);
+	    break;
+	case 'u': case 'x': case 'X': case 'o': case 'c':
+	    val = (lng >= 2) ? (uint64_t) va_arg(ap, unsigned long long)
+		: (lng == 1) ? (uint64_t) va_arg(ap, unsigned long)
+		: (uint64_t) va_arg(ap, unsigned int);
+	    MONITOR_TRACE_PUT(val);
+	    break;
+	case 'p': case 'n':
+	    val = (uintptr_t) va_arg(ap, void *);
+	    MONITOR_TRACE_PUT(val);
+	    break;
+	case 'f': case 'F': case 'e': case 'E':
+	case 'g': case 'G': case 'a': case 'A':
+	    dval = (lng < 0) ? (double) va_arg(ap, long double)
+		: va_arg(ap, double);
+	    MONITOR_TRACE_PUT(dval);
+	    break;
+	case 's':
+	    str = va_arg(ap, const char *);
+	    if (str == NULL) {
+		str = "(null)";
+	    }
+	    for (len = 0; len < MONITOR_TRACE_STR_MAX - 1 && str[len] != 0; len++) {
+	    }
+	    if (pos + len + 1 > size) {
+		return (pos);
+	    }
+	    memcpy(&buf[pos], str, len);
+	    buf[pos + len] = 0;
+	    pos += len + 1;
+	    break;
+	default:
+	    return (pos);
+	}
+    }
+    return (pos);
+}
+
+/*
+ *  Add one record to the calling thread's ring, called from
+ *  MONITOR_DEBUG in trace mode.  Safe in signal handlers: a handler
+ *  that interrupts us reserves the next slot.
+ */
+void
+monitor_trace_printf(const char *fmt, const char *func, ...)
+{
+    struct monitor_thread_node *tn;
+    struct monitor_trace_ring *ring;
+    struct monitor_trace_rec *rec;
+    va_list ap;
+    long pos;
+
+    tn = monitor_get_tn();
+    ring = monitor_trace_get_ring(tn);
+    if (ring == NULL) {
+	return;
+    }
+    pos = fetch_and_add(&ring->tr_pos, 1);
+    rec = &ring->tr_rec[pos % ring->tr_slots];
+
+    rec->tr_nsec = monitor_clock_nsec();
+    rec->tr_fmt = (uintptr_t) fmt;
+    rec->tr_func = (uintptr_t) func;
+    rec->tr_pid = ring->tr_pid;
+    rec->tr_thread = (tn != NULL) ? tn->tn_tid : -1;
+    va_start(ap, func);
+    rec->tr_len = monitor_trace_args(rec->tr_args, MONITOR_TRACE_ARG_BYTES,
+				     fmt, ap);
+    va_end(ap);
+}
+
+/*
+ *  Write all of buf, retrying after signals and short writes.
+ */
+static int
+monitor_trace_write(int fd, const void *buf, size_t len)
+{
+    const char *ptr = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+	ret = write(fd, ptr, len);
+	if (ret < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (ret <= 0) {
+	    return (FAILURE);
+	}
+	ptr += ret;
+	len -= ret;
+    }
+    return (SUCCESS);
+}
+
+/*
+ *  Write the string for key (a format or function name), unless it's
+ *  already in the file.
+ */
+static void
+monitor_trace_write_string(int fd, uint64_t key)
+{
+    uint32_t type, len;
+    int k, start;
+
+    if (key == 0) {
+	return;
+    }
+    start = (int) ((key >> 3) % MONITOR_TRACE_SEEN_SIZE);
+    for (k = start;;) {
+	if (monitor_trace_seen[k] == key) {
+	    return;
+	}
+	if (monitor_trace_seen[k] == 0) {
+	    monitor_trace_seen[k] = key;
+	    break;
+	}
+	k = (k + 1) % MONITOR_TRACE_SEEN_SIZE;
+	if (k == start) {
+	    /* Table is full, write it again. */
+	    break;
+	}
+    }
+    type = MONITOR_TRACE_TYPE_STRING;
+    len = strlen((const char *) (uintptr_t) key);
+    monitor_trace_write(fd, &type, sizeof(type));
+    monitor_trace_write(fd, &key, sizeof(key));
+    monitor_trace_write(fd, &len, sizeof(len));
+    monitor_trace_write(fd, (const char *) (uintptr_t) key, len);
+}
+
+/*
+ *  Append the records since the last dump to prefix.pid.  The first
+ *  dump in a process truncates the file and writes the header.
+ *
+ *  Returns: 0 on success, -1 if tracing is off, or on error.
+ */
+int
+monitor_trace_dump(void)
+{
+    struct monitor_trace_ring *ring;
+    struct monitor_trace_rec *rec;
+    char path[MONITOR_TRACE_PATH_SIZE];
+    char digits[24];
+    uint32_t type, version, size;
+    long pos, end;
+    int fd, flags, n, k;
+    pid_t pid;
+
+    if (! monitor_trace) {
+	return (FAILURE);
+    }
+    if (compare_and_swap(&monitor_trace_dump_busy, 0, 1) != 0) {
+	return (FAILURE);
+    }
+
+    /* path = prefix.pid */
+    pid = getpid();
+    n = 0;
+    do {
+	digits[n++] = '0' + pid % 10;
+	pid /= 10;
+    } while (pid > 0);
+    k = strlen(monitor_trace_path);
+    memcpy(path, monitor_trace_path, k);
+    path[k++] = '.';
+    while (n > 0) {
+	path[k++] = digits[--n];
+    }
+    path[k] = 0;
+
+    flags = O_WRONLY | O_CREAT
+	| (monitor_trace_file_started ? O_APPEND : O_TRUNC);
+    fd = open(path, flags, 0644);
+    if (fd < 0) {
+	MONITOR_WARN("unable to open trace file: %s\n", path);
+	monitor_trace_dump_busy = 0;
+	return (FAILURE);
+    }
+    if (! monitor_trace_file_started) {
+	version = MONITOR_TRACE_VERSION;
+	size = sizeof(struct monitor_trace_rec);
+	monitor_trace_write(fd, MONITOR_TRACE_MAGIC, 8);
+	monitor_trace_write(fd, &version, sizeof(version));
+	monitor_trace_write(fd, &size, sizeof(size));
+	monitor_trace_file_started = 1;
+    }
+
+    type = MONITOR_TRACE_TYPE_RECORD;
+    for (ring = monitor_trace_rings; ring != NULL; ring = ring->tr_next) {
+	end = ring->tr_pos;
+	pos = ring->tr_dumped;
+	if (pos < end - ring->tr_slots) {
+	    pos = end - ring->tr_slots;
+	}
+	for (; pos < end; pos++) {
+	    rec = &ring->tr_rec[pos % ring->tr_slots];
+	    monitor_trace_write_string(fd, rec->tr_fmt);
+	    monitor_trace_write_string(fd, rec->tr_func);
+	    monitor_trace_write(fd, &type, sizeof(type));
+	    monitor_trace_write(fd, rec, sizeof(*rec));
+	}
+	ring->tr_dumped = end;
+    }
+    close(fd);
+    monitor_trace_dump_busy = 0;
+
+    return (SUCCESS);
+}
+
+/*
+ *  In the child after fork, the rings hold the parent's records
+ *  (already the parent's to dump), so empty them, take the child's
+ *  pid and start a new file for the child.
+ */
+void
+monitor_trace_reset(void)
+{
+    struct monitor_trace_ring *ring;
+    pid_t pid;
+
+    if (! monitor_trace) {
+	return;
+    }
+    pid = getpid();
+    for (ring = monitor_trace_rings; ring != NULL; ring = ring->tr_next) {
+	ring->tr_pos = 0;
+	ring->tr_dumped = 0;
+	ring->tr_pid = pid;
+    }
+    memset(monitor_trace_seen, 0, sizeof(monitor_trace_seen));
+    monitor_trace_file_started = 0;
+    monitor_trace_dump_busy = 0;
+}
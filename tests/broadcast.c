@@ -0,0 +1,192 @@
+/*
+ *  Test monitor_broadcast_signal() under load: many busy threads,
+ *  plus threads that create and join short-lived threads, so thread
+ *  nodes are retired and reused while broadcasts are in flight.
+ *
+ *  The program finds monitor_sigaction() and monitor_broadcast_signal()
+ *  with dlsym(), so it runs as an ordinary program without monitor.
+ *  With monitor, every worker thread should get every broadcast:
+ *  first a burst of real-time signals sent back to back (these queue,
+ *  and use the relay tree), then SIGUSR1 one at a time (non-RT
+ *  signals merge while pending, so we wait for each one).
+ *
+ *  Copyright (c) 2007-2023, Rice University.
+ *  See the file LICENSE for details.
+ *
+ *  $Id$
+ */
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <dlfcn.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_THREADS   1000
+#define NUM_THREADS    200
+#define NUM_CHURN        4
+#define NUM_RT_ROUNDS   50
+#define NUM_USR_ROUNDS  20
+#define WAIT_TIME       10
+
+typedef int sighandler_fcn_t(int, siginfo_t *, void *);
+typedef int sigaction_fcn_t(int, sighandler_fcn_t *, int, void *);
+typedef int broadcast_fcn_t(int);
+
+int num_threads = NUM_THREADS;
+
+volatile long rt_count[MAX_THREADS];
+volatile long usr_count[MAX_THREADS];
+volatile long num_started = 0;
+volatile int  done = 0;
+
+__thread int my_index = -1;
+
+int
+handler(int sig, siginfo_t *info, void *context)
+{
+    int k = my_index;
+
+    if (k >= 0) {
+	if (sig == SIGUSR1)
+	    __sync_fetch_and_add(&usr_count[k], 1);
+	else
+	    __sync_fetch_and_add(&rt_count[k], 1);
+    }
+    return 0;
+}
+
+void *
+worker(void *arg)
+{
+    volatile double x = 1.0;
+
+    my_index = (int) (long) arg;
+    __sync_fetch_and_add(&num_started, 1);
+    while (! done) {
+	x = x * 1.000001 + 0.5;
+    }
+    return NULL;
+}
+
+void *
+short_thread(void *arg)
+{
+    return arg;
+}
+
+void *
+churn(void *arg)
+{
+    pthread_t td;
+
+    while (! done) {
+	if (pthread_create(&td, NULL, short_thread, NULL) != 0)
+	    errx(1, "pthread_create failed");
+	pthread_join(td, NULL);
+    }
+    return NULL;
+}
+
+/*
+ *  Wait until every worker has count rounds, or time runs out.
+ *
+ *  Returns: the smallest count.
+ */
+long
+wait_for(volatile long *count, long rounds)
+{
+    struct timeval start, now;
+    long min;
+    int k;
+
+    gettimeofday(&start, NULL);
+    for (;;) {
+	min = rounds;
+	for (k = 0; k < num_threads; k++) {
+	    if (count[k] < min)
+		min = count[k];
+	}
+	gettimeofday(&now, NULL);
+	if (min >= rounds || now.tv_sec - start.tv_sec >= WAIT_TIME)
+	    return min;
+	usleep(1000);
+    }
+}
+
+/*
+ *  Program args: num_threads.
+ */
+int
+main(int argc, char **argv)
+{
+    pthread_t td[MAX_THREADS], cd[NUM_CHURN];
+    sigaction_fcn_t *sigaction_fcn;
+    broadcast_fcn_t *broadcast_fcn;
+    long k, rt_min, usr_min;
+    int rt_sig = SIGRTMIN + 4;
+
+    if (argc > 1)
+	num_threads = atoi(argv[1]);
+    if (num_threads < 1 || num_threads > MAX_THREADS)
+	num_threads = NUM_THREADS;
+
+    sigaction_fcn = (sigaction_fcn_t *) dlsym(RTLD_DEFAULT, "monitor_sigaction");
+    broadcast_fcn = (broadcast_fcn_t *) dlsym(RTLD_DEFAULT, "monitor_broadcast_signal");
+    if (sigaction_fcn == NULL || broadcast_fcn == NULL) {
+	printf("not running with monitor, nothing to test\n");
+	return 0;
+    }
+    if ((*sigaction_fcn)(rt_sig, handler, 0, NULL) != 0
+	|| (*sigaction_fcn)(SIGUSR1, handler, 0, NULL) != 0)
+	errx(1, "monitor_sigaction failed");
+
+    printf("starting %d threads ...\n", num_threads);
+    for (k = 0; k < num_threads; k++) {
+	if (pthread_create(&td[k], NULL, worker, (void *) k) != 0)
+	    errx(1, "pthread_create failed");
+    }
+    for (k = 0; k < NUM_CHURN; k++) {
+	if (pthread_create(&cd[k], NULL, churn, NULL) != 0)
+	    errx(1, "pthread_create failed");
+    }
+    while (num_started < num_threads) {
+	usleep(1000);
+    }
+
+    for (k = 0; k < NUM_RT_ROUNDS; k++) {
+	(*broadcast_fcn)(rt_sig);
+    }
+    wait_for(rt_count, NUM_RT_ROUNDS);
+
+    for (k = 1; k <= NUM_USR_ROUNDS; k++) {
+	(*broadcast_fcn)(SIGUSR1);
+	if (wait_for(usr_count, k) < k)
+	    break;
+    }
+    usr_min = wait_for(usr_count, NUM_USR_ROUNDS);
+    rt_min = wait_for(rt_count, NUM_RT_ROUNDS);
+
+    done = 1;
+    for (k = 0; k < num_threads; k++) {
+	pthread_join(td[k], NULL);
+    }
+    for (k = 0; k < NUM_CHURN; k++) {
+	pthread_join(cd[k], NULL);
+    }
+
+    printf("rt signal: min %ld of %d\n", rt_min, NUM_RT_ROUNDS);
+    printf("SIGUSR1:   min %ld of %d\n", usr_min, NUM_USR_ROUNDS);
+    if (rt_min < NUM_RT_ROUNDS || usr_min < NUM_USR_ROUNDS) {
+	printf("FAIL: some threads missed a broadcast\n");
+	return 1;
+    }
+    printf("PASS\n");
+
+    return 0;
+}
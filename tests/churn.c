@@ -0,0 +1,95 @@
+/*
+ *  Stress test monitor's thread registry with many threads that all
+ *  create and join short-lived threads at the same time.
+ *
+ *  Run with and without monitor to compare thread create/exit
+ *  throughput.  There should be one init-thread and one fini-thread
+ *  callback for every short-lived thread.
+ *
+ *  Copyright (c) 2007-2023, Rice University.
+ *  See the file LICENSE for details.
+ *
+ *  $Id$
+ */
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_THREADS   256
+#define NUM_THREADS    16
+#define NUM_ROUNDS   2000
+
+int num_threads = NUM_THREADS;
+int num_rounds = NUM_ROUNDS;
+
+void *
+short_thread(void *arg)
+{
+    return arg;
+}
+
+/*
+ *  Each long-lived thread creates and joins num_rounds short-lived
+ *  threads.
+ */
+void *
+churn_thread(void *arg)
+{
+    pthread_t td;
+    void *ret;
+    int k;
+
+    for (k = 0; k < num_rounds; k++) {
+	if (pthread_create(&td, NULL, short_thread, arg) != 0)
+	    errx(1, "pthread_create failed");
+	if (pthread_join(td, &ret) != 0 || ret != arg)
+	    errx(1, "pthread_join failed");
+    }
+
+    return NULL;
+}
+
+/*
+ *  Program args: num_threads, num_rounds.
+ */
+int
+main(int argc, char **argv)
+{
+    pthread_t td[MAX_THREADS];
+    struct timeval start, end;
+    double secs;
+    long i;
+
+    if (argc < 2 || sscanf(argv[1], "%d", &num_threads) < 1)
+	num_threads = NUM_THREADS;
+    if (argc < 3 || sscanf(argv[2], "%d", &num_rounds) < 1)
+	num_rounds = NUM_ROUNDS;
+    if (num_threads < 1)
+	num_threads = 1;
+    if (num_threads > MAX_THREADS)
+	num_threads = MAX_THREADS;
+    printf("num_threads = %d, num_rounds = %d\n", num_threads, num_rounds);
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < num_threads; i++) {
+	if (pthread_create(&td[i], NULL, churn_thread, (void *)i) != 0)
+	    errx(1, "pthread_create failed");
+    }
+    for (i = 0; i < num_threads; i++) {
+	pthread_join(td[i], NULL);
+    }
+
+    gettimeofday(&end, NULL);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec)/1000000.0;
+    printf("threads: %ld, time: %.3f sec, rate: %.0f threads/sec\n",
+	   (long) num_threads * num_rounds, secs, num_threads * num_rounds / secs);
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ *  Measure the per-thread cost of pthread_create() and pthread_join()
+ *  from one thread, one thread at a time.
+ *
+ *  Run with and without monitor to see monitor's overhead per create.
+ *  If the client doesn't override any thread callbacks, then monitor
+ *  should pass pthread_create() straight through.
+ *
+ *  Copyright (c) 2007-2023, Rice University.
+ *  See the file LICENSE for details.
+ *
+ *  $Id$
+ */
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_THREADS  20000
+
+void *
+null_thread(void *arg)
+{
+    return arg;
+}
+
+/*
+ *  Program args: num_threads.
+ */
+int
+main(int argc, char **argv)
+{
+    struct timeval start, end;
+    pthread_t td;
+    double usecs;
+    void *ret;
+    long num_threads, i;
+
+    if (argc < 2 || sscanf(argv[1], "%ld", &num_threads) < 1)
+	num_threads = NUM_THREADS;
+    if (num_threads < 1)
+	num_threads = 1;
+    printf("num_threads = %ld\n", num_threads);
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < num_threads; i++) {
+	if (pthread_create(&td, NULL, null_thread, (void *)i) != 0)
+	    errx(1, "pthread_create failed");
+	if (pthread_join(td, &ret) != 0 || ret != (void *)i)
+	    errx(1, "pthread_join failed");
+    }
+
+    gettimeofday(&end, NULL);
+    usecs = (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec);
+    printf("time: %.3f sec, per create and join: %.2f usec\n",
+	   usecs / 1000000.0, usecs / num_threads);
+
+    return 0;
+}
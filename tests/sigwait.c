@@ -0,0 +1,73 @@
+/*
+ *  Time the sigtimedwait() override in the style of an event loop
+ *  that polls for signals with a zero timeout, and check that a
+ *  timed wait still returns EAGAIN after about its full timeout.
+ *
+ *  Run with and without monitor to compare the cost per call.
+ *
+ *  Copyright (c) 2007-2023, Rice University.
+ *  See the file LICENSE for details.
+ *
+ *  $Id$
+ */
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_CALLS  200000
+
+double
+elapsed(struct timeval *start, struct timeval *end)
+{
+    return (end->tv_sec - start->tv_sec)
+	+ (end->tv_usec - start->tv_usec)/1000000.0;
+}
+
+/*
+ *  Program args: num_calls.
+ */
+int
+main(int argc, char **argv)
+{
+    struct timeval start, end;
+    struct timespec zero = { 0, 0 };
+    struct timespec half = { 0, 500000000 };
+    sigset_t set;
+    siginfo_t info;
+    double secs;
+    int k, num_calls;
+
+    if (argc < 2 || sscanf(argv[1], "%d", &num_calls) < 1)
+	num_calls = NUM_CALLS;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    gettimeofday(&start, NULL);
+    for (k = 0; k < num_calls; k++) {
+	if (sigtimedwait(&set, &info, &zero) >= 0 || errno != EAGAIN)
+	    errx(1, "sigtimedwait poll failed");
+    }
+    gettimeofday(&end, NULL);
+    secs = elapsed(&start, &end);
+    printf("polls: %d, time: %.3f sec, %.3f usec/call\n",
+	   num_calls, secs, 1000000.0 * secs / num_calls);
+
+    gettimeofday(&start, NULL);
+    if (sigtimedwait(&set, &info, &half) >= 0 || errno != EAGAIN)
+	errx(1, "sigtimedwait timed wait failed");
+    gettimeofday(&end, NULL);
+    printf("timed wait: 0.500 sec, returned after: %.3f sec\n",
+	   elapsed(&start, &end));
+
+    return 0;
+}
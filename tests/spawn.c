@@ -0,0 +1,108 @@
+/*
+ *  Launch child programs with vfork() and exec, posix_spawn(),
+ *  posix_spawnp(), system() and popen(), and check their exit status.
+ *
+ *  With monitor, the parent should get pre-fork and post-fork
+ *  callbacks for each child, but no fini-process callback from the
+ *  vfork child.  Each child program gets its own init-process and
+ *  fini-process when LD_PRELOAD is inherited.
+ *
+ *  Copyright (c) 2007-2023, Rice University.
+ *  See the file LICENSE for details.
+ *
+ *  $Id$
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/*
+ *  The vfork child modifies nothing of the parent's, and returns 0 to
+ *  the shell on success.
+ */
+void
+run_vfork(char *prog)
+{
+    char *argv[2] = { prog, NULL };
+    pid_t pid;
+    int status;
+
+    pid = vfork();
+    if (pid < 0)
+	err(1, "vfork failed");
+    if (pid == 0) {
+	execv(prog, argv);
+	_exit(127);
+    }
+    if (waitpid(pid, &status, 0) != pid)
+	err(1, "waitpid failed");
+    printf("vfork: pid = %d, status = %d\n", (int) pid, WEXITSTATUS(status));
+}
+
+void
+run_spawn(char *prog, int use_path)
+{
+    char *argv[2] = { prog, NULL };
+    pid_t pid;
+    int ret, status;
+
+    if (use_path)
+	ret = posix_spawnp(&pid, prog, NULL, NULL, argv, environ);
+    else
+	ret = posix_spawn(&pid, prog, NULL, NULL, argv, environ);
+    if (ret != 0)
+	errx(1, "posix_spawn%s failed: %s", (use_path ? "p" : ""),
+	     strerror(ret));
+    if (waitpid(pid, &status, 0) != pid)
+	err(1, "waitpid failed");
+    printf("posix_spawn%s: pid = %d, status = %d\n", (use_path ? "p" : ""),
+	   (int) pid, WEXITSTATUS(status));
+}
+
+void
+run_shell(void)
+{
+    char buf[100];
+    FILE *fp;
+    int status;
+
+    status = system("exit 3");
+    printf("system: status = %d\n", WEXITSTATUS(status));
+
+    fp = popen("echo hello from popen", "r");
+    if (fp == NULL)
+	err(1, "popen failed");
+    if (fgets(buf, sizeof(buf), fp) == NULL)
+	errx(1, "popen read failed");
+    status = pclose(fp);
+    printf("popen: %s", buf);
+    printf("pclose: status = %d\n", WEXITSTATUS(status));
+}
+
+/*
+ *  Program args: program to run (default /bin/true).
+ */
+int
+main(int argc, char **argv)
+{
+    char *prog = (argc > 1) ? argv[1] : "/bin/true";
+    char *base = strrchr(prog, '/');
+
+    run_vfork(prog);
+    run_spawn(prog, 0);
+    run_spawn((base != NULL) ? base + 1 : prog, 1);
+    run_vfork("/nonexistent/program");
+    run_shell();
+    printf("done\n");
+
+    return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ *  Decode the binary trace files from MONITOR_TRACE into the same
+ *  text that MONITOR_DEBUG writes to stderr, with a timestamp, sorted
+ *  by time over all threads.
+ *
+ *    MONITOR_TRACE=/tmp/trace monitor-run ./program
+ *    ./trace_decode /tmp/trace.*
+ *
+ *  The file format must match utils.c in libmonitor.
+ *
+ *  Copyright (c) 2007-2023, Rice University.
+ *  See the file LICENSE for details.
+ *
+ *  $Id$
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC      "MONTRACE"
+#define TRACE_VERSION    1
+#define TRACE_ARG_BYTES  96
+#define TYPE_STRING  1
+#define TYPE_RECORD  2
+
+struct trace_rec {
+    uint64_t  tr_nsec;
+    uint64_t  tr_fmt;
+    uint64_t  tr_func;
+    int32_t   tr_pid;
+    int16_t   tr_thread;
+    uint16_t  tr_len;
+    char      tr_args[TRACE_ARG_BYTES];
+};
+
+/*
+ *  Strings and records from all files.  The string keys are
+ *  addresses in the traced process, so keep them per file.
+ */
+struct trace_string {
+    int       file;
+    uint64_t  key;
+    char     *str;
+};
+
+struct trace_entry {
+    int   file;
+    long  order;
+    struct trace_rec rec;
+};
+
+struct trace_string *strings = NULL;
+long num_strings = 0, max_strings = 0;
+struct trace_entry *entries = NULL;
+long num_entries = 0, max_entries = 0;
+
+const char *
+lookup(int file, uint64_t key)
+{
+    long k;
+
+    for (k = num_strings - 1; k >= 0; k--) {
+	if (strings[k].file == file && strings[k].key == key)
+	    return strings[k].str;
+    }
+    return NULL;
+}
+
+void
+read_file(int file, const char *path)
+{
+    FILE *fp;
+    char magic[8];
+    uint32_t type, version, size, len;
+    uint64_t key;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+	err(1, "unable to open: %s", path);
+    if (fread(magic, 8, 1, fp) != 1 || memcmp(magic, TRACE_MAGIC, 8) != 0
+	|| fread(&version, 4, 1, fp) != 1 || fread(&size, 4, 1, fp) != 1)
+	errx(1, "not a monitor trace file: %s", path);
+    if (version != TRACE_VERSION || size != sizeof(struct trace_rec))
+	errx(1, "wrong trace version (%u) or record size (%u): %s",
+	     version, size, path);
+
+    while (fread(&type, 4, 1, fp) == 1) {
+	if (type == TYPE_STRING) {
+	    if (fread(&key, 8, 1, fp) != 1 || fread(&len, 4, 1, fp) != 1)
+		errx(1, "truncated string: %s", path);
+	    if (num_strings == max_strings) {
+		max_strings = 2 * max_strings + 100;
+		strings = realloc(strings, max_strings * sizeof(*strings));
+		if (strings == NULL)
+		    err(1, "realloc failed");
+	    }
+	    strings[num_strings].file = file;
+	    strings[num_strings].key = key;
+	    strings[num_strings].str = malloc(len + 1);
+	    if (strings[num_strings].str == NULL
+		|| fread(strings[num_strings].str, 1, len, fp) != len)
+		errx(1, "truncated string: %s", path);
+	    strings[num_strings].str[len] = 0;
+	    num_strings++;
+	}
+	else if (type == TYPE_RECORD) {
+	    if (num_entries == max_entries) {
+		max_entries = 2 * max_entries + 1000;
+		entries = realloc(entries, max_entries * sizeof(*entries));
+		if (entries == NULL)
+		    err(1, "realloc failed");
+	    }
+	    if (fread(&entries[num_entries].rec, sizeof(struct trace_rec), 1, fp) != 1)
+		errx(1, "truncated record: %s", path);
+	    entries[num_entries].file = file;
+	    entries[num_entries].order = num_entries;
+	    num_entries++;
+	}
+	else {
+	    errx(1, "bad entry type (%u): %s", type, path);
+	}
+    }
+    fclose(fp);
+}
+
+int
+compare(const void *p1, const void *p2)
+{
+    const struct trace_entry *e1 = p1, *e2 = p2;
+
+    if (e1->rec.tr_nsec != e2->rec.tr_nsec)
+	return (e1->rec.tr_nsec < e2->rec.tr_nsec) ? -1 : 1;
+    return (e1->order < e2->order) ? -1 : 1;
+}
+
+/*
+ *  Take the next 8-byte arg, returns 0 if there are no more.
+ */
+int
+next_arg(struct trace_rec *rec, int *pos, void *val)
+{
+    if (*pos + 8 > rec->tr_len)
+	return 0;
+    memcpy(val, &rec->tr_args[*pos], 8);
+    *pos += 8;
+    return 1;
+}
+
+/*
+ *  Print fmt with the args from the record, one conversion at a
+ *  time, the same way utils.c took them.
+ */
+void
+print_message(const char *fmt, struct trace_rec *rec)
+{
+    char spec[64];
+    const char *p, *start;
+    int64_t ival, star[2];
+    double dval;
+    int pos, num_star, len;
+
+    pos = 0;
+    for (p = fmt; *p != 0; p++) {
+	if (*p != '%') {
+	    putchar(*p);
+	    continue;
+	}
+	start = p++;
+	if (*p == '%') {
+	    putchar('%');
+	    continue;
+	}
+	num_star = 0;
+	while (*p != 0 && strchr("-+ #0", *p) != NULL)
+	    p++;
+	if (*p == '*') {
+	    if (! next_arg(rec, &pos, &star[num_star++]))
+		goto truncated;
+	    p++;
+	}
+	while (*p >= '0' && *p <= '9')
+	    p++;
+	if (*p == '.') {
+	    p++;
+	    if (*p == '*') {
+		if (! next_arg(rec, &pos, &star[num_star++]))
+		    goto truncated;
+		p++;
+	    }
+	    while (*p >= '0' && *p <= '9')
+		p++;
+	}
+	/* Args are all 8 bytes now, so replace the length modifiers. */
+	while (*p != 0 && strchr("hlzjtL", *p) != NULL)
+	    p++;
+	if (*p == 0)
+	    break;
+	len = p - start;
+	if (len + 4 > (int) sizeof(spec))
+	    len = sizeof(spec) - 4;
+	memcpy(spec, start, len);
+	spec[len] = 0;
+
+	switch (*p) {
+	case 'c':
+	    if (! next_arg(rec, &pos, &ival))
+		goto truncated;
+	    putchar((int) ival);
+	    break;
+	case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+	    if (! next_arg(rec, &pos, &ival))
+		goto truncated;
+	    strcat(spec, "ll");
+	    len = strlen(spec);
+	    spec[len] = *p;
+	    spec[len + 1] = 0;
+	    if (num_star == 2)
+		printf(spec, (int) star[0], (int) star[1], (long long) ival);
+	    else if (num_star == 1)
+		printf(spec, (int) star[0], (long long) ival);
+	    else
+		printf(spec, (long long) ival);
+	    break;
+	case 'p': case 'n':
+	    if (! next_arg(rec, &pos, &ival))
+		goto truncated;
+	    printf("0x%llx", (unsigned long long) ival);
+	    break;
+	case 'f': case 'F': case 'e': case 'E':
+	case 'g': case 'G': case 'a': case 'A':
+	    if (! next_arg(rec, &pos, &dval))
+		goto truncated;
+	    spec[len] = *p;
+	    spec[len + 1] = 0;
+	    if (num_star == 2)
+		printf(spec, (int) star[0], (int) star[1], dval);
+	    else if (num_star == 1)
+		printf(spec, (int) star[0], dval);
+	    else
+		printf(spec, dval);
+	    break;
+	case 's':
+	    if (pos >= rec->tr_len)
+		goto truncated;
+	    spec[len] = 's';
+	    spec[len + 1] = 0;
+	    if (num_star == 2)
+		printf(spec, (int) star[0], (int) star[1], &rec->tr_args[pos]);
+	    else if (num_star == 1)
+		printf(spec, (int) star[0], &rec->tr_args[pos]);
+	    else
+		printf(spec, &rec->tr_args[pos]);
+	    pos += strlen(&rec->tr_args[pos]) + 1;
+	    break;
+	default:
+	    fputs(start, stdout);
+	    return;
+	}
+    }
+    return;
+
+truncated:
+    printf(" [truncated]\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    struct trace_rec *rec;
+    const char *fmt, *func;
+    long k;
+    int file;
+
+    if (argc < 2)
+	errx(1, "usage: %s trace-file ...", argv[0]);
+
+    for (file = 1; file < argc; file++)
+	read_file(file, argv[file]);
+    qsort(entries, num_entries, sizeof(*entries), compare);
+
+    for (k = 0; k < num_entries; k++) {
+	rec = &entries[k].rec;
+	fmt = lookup(entries[k].file, rec->tr_fmt);
+	func = lookup(entries[k].file, rec->tr_func);
+	printf("%llu.%09llu monitor debug [%d,%d] %s: ",
+	       (unsigned long long) rec->tr_nsec / 1000000000ULL,
+	       (unsigned long long) rec->tr_nsec % 1000000000ULL,
+	       (int) rec->tr_pid, (int) rec->tr_thread,
+	       (func != NULL) ? func : "??");
+	if (fmt == NULL) {
+	    printf("[unknown format]\n");
+	    continue;
+	}
+	print_message(fmt, rec);
+    }
+
+    return 0;
+}